@@ -0,0 +1,217 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief User space micro-benchmark of the circular buffer functions
+ *
+ * Measures the cost in ns per call of the circular buffer functions used by
+ * every driver write, read, llseek and ioctl, for several packet size
+ * distributions. The ring capacity is AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+ * the CMake build compiles one benchmark per capacity in AESD_BENCH_CAPACITIES.
+ *
+ * The positions looked up are generated before the timed loops, so that
+ * the random number generator is not part of the measurement.
+ *
+ * @author Sujoy Ray
+ * @date 2023-02-25
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "aesd-circular-buffer.h"
+
+#define BENCH_DEFAULT_ITERATIONS    (1000000)
+/* Largest packet of all distributions */
+#define BENCH_MAX_ENTRY_SIZE        (4096)
+
+struct bench_distribution
+{
+    const char *name;
+    size_t (*size)(void);
+};
+
+static char bench_data[BENCH_MAX_ENTRY_SIZE];
+static volatile size_t bench_sink;
+static uint64_t bench_rng_state = 88172645463325252ULL;
+
+/**
+ * xorshift64 generator, cheaper and more predictable than rand()
+ * @return the next pseudo random number
+ */
+static uint64_t bench_random(void)
+{
+    bench_rng_state ^= bench_rng_state << 13;
+    bench_rng_state ^= bench_rng_state >> 7;
+    bench_rng_state ^= bench_rng_state << 17;
+    return bench_rng_state;
+}
+
+/**
+ * @return the current monotonic time in nanoseconds
+ */
+static uint64_t bench_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Timestamp lines written by aesdsocket every 10 seconds */
+static size_t bench_size_fixed(void)
+{
+    return 32;
+}
+
+/* Short text lines of the autotest */
+static size_t bench_size_uniform(void)
+{
+    return 1 + bench_random() % 256;
+}
+
+/* Mostly short lines with an occasional large packet */
+static size_t bench_size_bimodal(void)
+{
+    if (bench_random() % 10 == 0) {
+        return 1024 + bench_random() % (BENCH_MAX_ENTRY_SIZE - 1024);
+    }
+    return 16 + bench_random() % 64;
+}
+
+static const struct bench_distribution bench_distributions[] = {
+    { "fixed-32", bench_size_fixed },
+    { "uniform-1-256", bench_size_uniform },
+    { "bimodal", bench_size_bimodal },
+};
+
+/**
+ * Fills @param buffer completely with entries of the given @param distribution
+ * @return the total number of bytes in the buffer
+ */
+static size_t bench_fill(struct aesd_circular_buffer *buffer, const struct bench_distribution *distribution)
+{
+    struct aesd_buffer_entry entry;
+    size_t total = 0;
+
+    aesd_circular_buffer_init(buffer);
+    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        entry.buffptr = bench_data;
+        entry.size = distribution->size();
+        total += entry.size;
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    return total;
+}
+
+/**
+ * Runs all measurements for one @param distribution, @param iterations calls each
+ * @return 0 for success, -1 if the position table cannot be allocated
+ */
+static int bench_run(const struct bench_distribution *distribution, long iterations)
+{
+    struct aesd_circular_buffer *buffer;
+    struct aesd_buffer_entry *entries;
+    size_t *positions;
+    size_t total;
+    size_t offset;
+    uint64_t start;
+    double add_ns;
+    double find_ns;
+    double size_ns;
+    double char_ns;
+    long i;
+
+    buffer = malloc(sizeof(*buffer));
+    entries = malloc(iterations * sizeof(*entries));
+    positions = malloc(iterations * sizeof(*positions));
+    if (buffer == NULL || entries == NULL || positions == NULL) {
+        free(buffer);
+        free(entries);
+        free(positions);
+        return -1;
+    }
+
+    /* add_entry, wrapping around the ring many times */
+    for (i = 0; i < iterations; i++) {
+        entries[i].buffptr = bench_data;
+        entries[i].size = distribution->size();
+    }
+    aesd_circular_buffer_init(buffer);
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+        aesd_circular_buffer_add_entry(buffer, &entries[i]);
+    }
+    add_ns = (double)(bench_now() - start) / iterations;
+
+    /* find_entry_offset_for_fpos, random read positions in a full ring */
+    total = bench_fill(buffer, distribution);
+    for (i = 0; i < iterations; i++) {
+        positions[i] = bench_random() % total;
+    }
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+        bench_sink = (size_t)aesd_circular_buffer_find_entry_offset_for_fpos(buffer, positions[i], &offset);
+    }
+    find_ns = (double)(bench_now() - start) / iterations;
+
+    /* return_size, done for every llseek */
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+        bench_sink = aesd_circular_buffer_return_size(buffer);
+    }
+    size_ns = (double)(bench_now() - start) / iterations;
+
+    /* return_char_offset, random AESDCHAR_IOCSEEKTO write commands */
+    for (i = 0; i < iterations; i++) {
+        positions[i] = bench_random() % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+        aesd_circular_buffer_return_char_offset(buffer, positions[i], 0, &offset);
+        bench_sink = offset;
+    }
+    char_ns = (double)(bench_now() - start) / iterations;
+
+    printf("%-16s %12.1f %12.1f %12.1f %12.1f\n", distribution->name, add_ns, find_ns,
+        size_ns, char_ns);
+    free(buffer);
+    free(entries);
+    free(positions);
+    return 0;
+}
+
+/**
+ * Usage: aesd-circular-buffer-bench [iterations]
+ * @return 0 for success, 1 on error
+ */
+int main(int argc, char **argv)
+{
+    long iterations = BENCH_DEFAULT_ITERATIONS;
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2) {
+        iterations = atol(argv[1]);
+        if (iterations <= 0) {
+            fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+    memset(bench_data, 'a', sizeof(bench_data));
+
+    printf("capacity %d, %ld iterations, ns/op\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+        iterations);
+    printf("%-16s %12s %12s %12s %12s\n", "distribution", "add_entry", "find_fpos",
+        "return_size", "char_offset");
+    for (size_t i = 0; i < sizeof(bench_distributions) / sizeof(bench_distributions[0]); i++) {
+        if (bench_run(&bench_distributions[i], iterations)) {
+            fprintf(stderr, "%s: out of memory\n", argv[0]);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -30,7 +30,7 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    uint8_t read_index = buffer->out_offs;
+    uint32_t read_index = buffer->out_offs;
     size_t current_char_offset = 0;
     size_t entry_size = 0;
 
@@ -113,7 +113,7 @@ struct aesd_buffer_entry * aesd_circular_buffer_return_full_pointer(struct aesd_
 unsigned int aesd_circular_buffer_return_size(struct aesd_circular_buffer *buffer)
 {
     
-    uint8_t read_index = buffer->out_offs;    
+    uint32_t read_index = buffer->out_offs;    
     size_t entry_size = 0;
     while(1) {
         entry_size += buffer->entry[read_index].size;
@@ -129,7 +129,7 @@ int aesd_circular_buffer_return_char_offset(struct aesd_circular_buffer *buffer,
     size_t member_offset, size_t char_offset, size_t *entry_offset_byte_rtn)
 {
     
-    uint8_t read_index = buffer->out_offs;    
+    uint32_t read_index = buffer->out_offs;    
     size_t entry_size = 0;
 
     if(member_offset > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
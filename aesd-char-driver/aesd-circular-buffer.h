@@ -16,7 +16,13 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Number of write operations kept by the buffer. Can be overridden at build time, for example
+ * by the circular buffer benchmark, to measure larger rings.
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
@@ -40,11 +46,11 @@ struct aesd_circular_buffer
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
@@ -71,9 +77,9 @@ int aesd_circular_buffer_return_char_offset(struct aesd_circular_buffer *buffer,
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -431,7 +431,7 @@ static int aesd_init_module(void)
 
 static void aesd_cleanup_module(void)
 {
-    uint8_t index = 0;
+    uint32_t index = 0;
     struct aesd_buffer_entry *entry;
 
     dev_t devno = MKDEV(aesd_major, aesd_minor);
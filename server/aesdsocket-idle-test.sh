@@ -0,0 +1,65 @@
+#!/bin/bash
+# Checks that idle clients do not starve new ones: opens more keep-open
+# incremental clients than there are pool workers, then expects a new
+# client to still get its reply.
+# Usage: ./aesdsocket-idle-test.sh [workers] [idle clients]
+
+set -u
+
+cd $(dirname $0)
+
+WORKERS=${1:-2}
+IDLE=${2:-8}
+PORT=9000
+TIMEOUT=5
+DATAFILE=/var/tmp/aesdsocketdata
+
+if [ ! -x ./aesdsocket ]
+then
+	echo "failed: build aesdsocket first"
+	exit 1
+fi
+
+rm -f ${DATAFILE} ${DATAFILE}.idx
+./aesdsocket -e pool -n ${WORKERS} -t file &
+server_pid=$!
+trap "kill ${server_pid} 2>/dev/null; wait ${server_pid} 2>/dev/null" EXIT
+
+for i in $(seq 1 50)
+do
+	(exec 3<>/dev/tcp/127.0.0.1/${PORT}) 2>/dev/null && break
+	sleep 0.1
+done
+
+# Each idle client is served once and then keeps its connection open
+fds=""
+for i in $(seq 1 ${IDLE})
+do
+	exec {fd}<>/dev/tcp/127.0.0.1/${PORT} || exit 1
+	printf 'AESDSOCKET_INCREMENTAL\nidle%d\n' ${i} >&${fd}
+	if ! read -r -t ${TIMEOUT} line <&${fd}
+	then
+		echo "failed: idle client ${i} got no reply"
+		exit 1
+	fi
+	fds="${fds} ${fd}"
+done
+
+exec {fd}<>/dev/tcp/127.0.0.1/${PORT} || exit 1
+printf 'newclient\n' >&${fd}
+reply=$(timeout ${TIMEOUT} cat <&${fd})
+exec {fd}>&-
+
+for fd in ${fds}
+do
+	exec {fd}>&-
+done
+
+echo "${reply}" | grep -q "^newclient$"
+if [ $? -eq 0 ]; then
+	echo "success"
+	exit 0
+else
+	echo "failed: new client not served with ${IDLE} idle clients and ${WORKERS} workers"
+	exit 1
+fi
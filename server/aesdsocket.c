@@ -22,9 +22,13 @@
 *
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <sched.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -33,11 +37,16 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <errno.h>
-#include "queue.h"
+#include <getopt.h>
 #include <pthread.h>
-#include "./../aesd-char-driver/aesd_ioctl.h"
+#include "aesdsocket.h"
 
 
 
@@ -46,55 +55,93 @@
 *******************************************************************************/
 #define SOCKET_PORT                 (9000)
 #define MAX_SERVER_CONNECTION       (10)
-#define TRUE                        (1)
-#define FALSE                       (0)
 #define PACKET_TIMEOUT_END          (1)
 #define MSEC_2_USEC(x)              ((x) * 1000)
-#define FIXED_RD_BUF_SIZE           (1024)
-#define MAX_TIME_ENTRY              (100)
-#define USE_AESD_CHAR_DEVICE        (1)
+/* Largest sendfile() request, the kernel caps it at 0x7ffff000 anyway */
+#define SEND_CHUNK_SIZE             (0x7ffff000)
+/* Storage reads batched into one send, and the reply size that is corked */
+#define SEND_BOUNCE_SIZE            (16384)
+#define SEND_WAIT_MS                (100)
+/* Packet switching the client to incremental replies, it is not stored */
+#define INCREMENTAL_CMD             ("AESDSOCKET_INCREMENTAL\n")
+#define METRICS_CMD                 ("AESDSOCKET_METRICS\n")
+/* Switches the connection to the binary framing of aesdsocket_binary.c */
+#define BINARY_CMD                  ("AESDSOCKET_BINARY\n")
+/* Seek command, followed by "X,Y" and the newline */
+#define SEEK_CMD                    ("AESDCHAR_IOCSEEKTO:")
+#define SEEK_CMD_LEN                (sizeof(SEEK_CMD) - 1)
+#define MAX_LOCAL_LISTENERS         (8)
+
+/* Listening socket, see aesdsoc_listen_spec() */
+typedef struct aesdsoc_listen_spec {
+    int family;                 /* AF_INET, AF_INET6 or AF_UNIX */
+    int type;                   /* SOCK_STREAM or SOCK_SEQPACKET */
+    const char *path;           /* AF_UNIX only */
+} aesdsoc_listen_spec_t;
+
+typedef struct aesdsoc_shard {
+    pthread_t thread;
+    const aesdsoc_engine_t *engine;
+    int index;
+    int soc_server;
+    int cpu;
+    int rc;
+} aesdsoc_shard_t;
 
 /*******************************************************************************
  * Prototypes
 *******************************************************************************/
-static int  process_and_save_data(char *buffer, char *file_buffer, 
-    int rcv_data_len, int *wr_pointer, FILE *fp);
+static int  process_and_save_data(aesdsoc_conn_t *conn, char *buffer,
+    int rcv_data_len);
+static int  process_lines(aesdsoc_conn_t *conn, const char *buffer,
+    int rcv_data_len, uint64_t now);
 static void aesdsoc_sighandler(int signal_no);
-static int aesdsocket_server(int d_mode); 
-static void *soc_thread(void *argument);
-static void asesd_soc_timer_handler(int signum);
-static int asesd_soc_timer_init(void);
-static int find_ioctl (char *data, int length, int *word, int *offset);
-
-typedef struct ASEDSocThread {    
-    pthread_t thread;
-    int soc_client;
-    int done;
-    struct sockaddr_in aesdsoc_addr;
-    SLIST_ENTRY(ASEDSocThread) entries;
-} ASEDSocThread_t;
+static int aesdsocket_server(int d_mode, const aesdsoc_engine_t *engine); 
+static int aesdsoc_listen_open(const aesdsoc_listen_spec_t *spec);
+static void aesdsoc_listen_spec(int index, aesdsoc_listen_spec_t *spec);
+static int aesdsoc_listen_get(int index);
+static int aesdsoc_shards_run(const aesdsoc_engine_t *engine, int soc_server,
+    aesdsoc_shard_t **shards);
+static void aesdsoc_log_cpu_usage(const aesdsoc_engine_t *engine);
+static int aesdsoc_sockopt_parse(const char *option);
 
 
 /*******************************************************************************
  * Variables and Macros
 *******************************************************************************/
-static volatile sig_atomic_t exit_aesd_soc = FALSE;
-static volatile sig_atomic_t file_close = TRUE;
+volatile sig_atomic_t exit_aesd_soc = FALSE;
 static volatile sig_atomic_t soc_close = FALSE;
 static volatile sig_atomic_t mutex_close = FALSE;
-static volatile sig_atomic_t write_time = 0;
 
-
-SLIST_HEAD(thread_head, ASEDSocThread) head = SLIST_HEAD_INITIALIZER(head);
-static pthread_mutex_t link_list_mutex = PTHREAD_MUTEX_INITIALIZER;
-#if (USE_AESD_CHAR_DEVICE != 1)
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Number of pool workers or epoll event loops, 0 = engine default */
+int aesdsoc_threads = 0;
+/* Number of acceptor shards, each with its own listening socket */
+static int aesdsoc_shards = 1;
+static int aesdsoc_pin_shards = FALSE;
+static int aesdsoc_backlog = MAX_SERVER_CONNECTION;
+/* Listening socket of every shard, owned by aesdsocket_server() */
+static int *aesdsoc_listeners = NULL;
+/* TCP shards plus local listeners */
+static int aesdsoc_listener_count = 0;
+static int aesdsoc_ipv6 = FALSE;
+static aesdsoc_listen_spec_t aesdsoc_local_specs[MAX_LOCAL_LISTENERS];
+static int aesdsoc_local_count = 0;
+/* Readable once the acceptors have to stop, polled next to the listeners */
+static int aesdsoc_stop_event = -1;
+/* Client socket options, -1 keeps the kernel default */
+static int aesdsoc_tcp_nodelay = FALSE;
+static int aesdsoc_sndbuf = -1;
+static int aesdsoc_rcvbuf = -1;
+
+static const aesdsoc_engine_t *aesdsoc_engines[] = {
+    &aesdsoc_pool_engine,
+    &aesdsoc_epoll_engine,
+#if (USE_IO_URING == 1)
+    &aesdsoc_uring_engine,
 #endif
-static timer_t timerid;
-static time_t time_value[MAX_TIME_ENTRY];
-static FILE *fp;
-static int prev_len = 0;
-static int force_send = 0;
+    NULL,
+};
+
 
 
 
@@ -108,6 +155,46 @@ static int force_send = 0;
 * Parameters:
 *   argc: Argument count
 *   argv: Argument vector
+*           -d          : Run as daemon
+*           -e engine   : Connection engine, "pool" (default), "epoll" or
+*                         "uring" when built with USE_IO_URING=1
+*           -n threads  : Number of pool workers, default 4 per CPU, or
+*                         epoll event loop threads, default one per CPU
+*           -q depth    : Accepted client queue depth of the pool engine
+*           -s shards   : Number of acceptor shards, each running its own
+*                         engine instance on its own listening socket
+*           -c          : Pin shard i and its threads to CPU i
+*           -b backlog  : Listen backlog of every listening socket
+*           -t storage  : Storage backend, "aesdchar", "file", "mmap",
+*                         "segment" or "ring", default "file" when built
+*                         with USE_AESD_CHAR_DEVICE=0
+*           -f sync     : Storage sync policy, "none" (default), "batch"
+*                         to fdatasync() or msync() every group commit
+*                         batch, or "async" to only start the write back
+*           -l level    : Log level, "emerg" to "debug", default "info".
+*                         Levels above AESDSOC_LOG_LEVEL are compiled out
+*           -6          : Dual stack IPv6 listener instead of IPv4
+*           -U path     : Additional Unix stream listener, repeatable
+*           -S path     : Additional Unix seqpacket listener, one packet
+*                         per message, repeatable
+*           -m clients  : Maximum number of connections served at once,
+*                         further clients are closed when accepted
+*           -k bytes    : Maximum incomplete packet buffered per client
+*           -M bytes    : Maximum receive, packet and reply buffer memory
+*                         of all clients, see aesdsocket_admit.c
+*           -i          : Save the write command index of the file and
+*                         mmap storage next to the data file
+*           -g bytes    : Segment size of the segment storage
+*           -r bytes    : Segment storage retention by size
+*           -a seconds  : Segment storage retention by age
+*           -w bytes    : Reply window of the segment storage, replies
+*                         start at most this far back from the end
+*           -o option   : Client socket option, repeatable: "nodelay" for
+*                         TCP_NODELAY, "sndbuf=bytes" for SO_SNDBUF and
+*                         "rcvbuf=bytes" for SO_RCVBUF
+*           -u path     : Upgrade control socket. Takes over the server
+*                         running with the same path, if any, and hands
+*                         over to the next one, see aesdsocket_handoff.c
 *
 * Returns: 0 if the function executed without any error. Otherwise, error code 
 *          is logged in syslog and the program exists with code 1
@@ -117,218 +204,448 @@ int main(int argc, char **argv)
 {
     int d_mode = 0;
     int rc = -1;
+    int opt;
+    const aesdsoc_engine_t *engine = &aesdsoc_pool_engine;
     /* Open log and set log level */
     openlog ("aesdsocket", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_USER);
     setlogmask (LOG_UPTO (LOG_DEBUG));
 
-    syslog(LOG_INFO,"**** Starting AESDSOCKET application ****");
+    AESDSOC_LOG(LOG_INFO,"**** Starting AESDSOCKET application ****");
 
-    if(argc > 1) {
-        if (strcmp(argv[1],"-d") !=0) {
-            syslog(LOG_INFO,"aesdsocket:-d is NOT detected \n");
-            d_mode = 0;
-        }
-        else {     
+    while ((opt = getopt(argc, argv, "de:n:q:s:cb:t:f:il:u:6U:S:m:k:M:g:r:a:w:o:")) != -1) {
+        switch (opt) {
+        case 'd':
             d_mode = 1;
-            syslog(LOG_INFO,"aesdsocket: -d is detected \n");
+            AESDSOC_LOG(LOG_INFO,"aesdsocket: -d is detected \n");
+            break;
+        case 'e':
+            engine = NULL;
+            for (int i = 0; aesdsoc_engines[i] != NULL; i++) {
+                if (strcmp(optarg, aesdsoc_engines[i]->name) == 0) {
+                    engine = aesdsoc_engines[i];
+                }
+            }
+            if (engine == NULL) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: unknown engine %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'n':
+            aesdsoc_threads = atoi(optarg);
+            if (aesdsoc_threads <= 0) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid thread count %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'q':
+            aesdsoc_queue_depth = atoi(optarg);
+            if (aesdsoc_queue_depth <= 0) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid queue depth %s", optarg);
+                goto usage;
+            }
+            break;
+        case 's':
+            aesdsoc_shards = atoi(optarg);
+            if (aesdsoc_shards <= 0) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid shard count %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'c':
+            aesdsoc_pin_shards = TRUE;
+            break;
+        case 'b':
+            aesdsoc_backlog = atoi(optarg);
+            if (aesdsoc_backlog <= 0) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid backlog %s", optarg);
+                goto usage;
+            }
+            break;
+        case 't':
+            aesdsoc_storage = aesdsoc_storage_find(optarg);
+            if (aesdsoc_storage == NULL) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: unknown storage %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "none") == 0) {
+                aesdsoc_sync_policy = AESDSOC_SYNC_NONE;
+            }
+            else if (strcmp(optarg, "batch") == 0) {
+                aesdsoc_sync_policy = AESDSOC_SYNC_BATCH;
+            }
+            else if (strcmp(optarg, "async") == 0) {
+                aesdsoc_sync_policy = AESDSOC_SYNC_ASYNC;
+            }
+            else {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: unknown sync policy %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'l':
+            aesdsoc_log_level = aesdsoc_log_parse_level(optarg);
+            if (aesdsoc_log_level < 0) {
+                aesdsoc_log_level = AESDSOC_LOG_LEVEL;
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: unknown log level %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'u':
+            aesdsoc_handoff_path = optarg;
+            break;
+        case 'm':
+            aesdsoc_max_clients = atoi(optarg);
+            if (aesdsoc_max_clients <= 0) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid connection limit %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'k':
+            aesdsoc_conn_budget = atoi(optarg);
+            if (aesdsoc_conn_budget <= 0) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid connection budget %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'M':
+            aesdsoc_mem_budget = atol(optarg);
+            if (aesdsoc_mem_budget <= 0) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid memory budget %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'i':
+            aesdsoc_index_persist = TRUE;
+            break;
+        case 'g':
+            aesdsoc_segment_size = atol(optarg);
+            if (aesdsoc_segment_size <= 0) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid segment size %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'r':
+            aesdsoc_retain_bytes = atol(optarg);
+            if (aesdsoc_retain_bytes <= 0) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid retention size %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'a':
+            aesdsoc_retain_age = atoi(optarg);
+            if (aesdsoc_retain_age <= 0) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid retention age %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'w':
+            aesdsoc_reply_window = atol(optarg);
+            if (aesdsoc_reply_window <= 0) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid reply window %s", optarg);
+                goto usage;
+            }
+            break;
+        case 'o':
+            if (aesdsoc_sockopt_parse(optarg)) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: invalid socket option %s", optarg);
+                goto usage;
+            }
+            break;
+        case '6':
+            aesdsoc_ipv6 = TRUE;
+            break;
+        case 'U':
+        case 'S':
+            if (aesdsoc_local_count == MAX_LOCAL_LISTENERS) {
+                AESDSOC_LOG(LOG_ERR,"aesdsocket: too many local listeners");
+                goto usage;
+            }
+            aesdsoc_local_specs[aesdsoc_local_count].family = AF_UNIX;
+            aesdsoc_local_specs[aesdsoc_local_count].type =
+                (opt == 'U') ? SOCK_STREAM : SOCK_SEQPACKET;
+            aesdsoc_local_specs[aesdsoc_local_count].path = optarg;
+            aesdsoc_local_count++;
+            break;
+        default:
+            goto usage;
         }
     }
-    rc = aesdsocket_server(d_mode);
+    AESDSOC_LOG(LOG_INFO,"aesdsocket: using %s engine, %s storage", engine->name,
+        aesdsoc_storage->name);
+    rc = aesdsocket_server(d_mode, engine);
     closelog();
     return rc;
-    
+
+usage:
+    fprintf(stderr, "Usage: %s [-d] [-e pool|epoll%s] [-n threads] [-q depth] "
+        "[-s shards] [-c] [-b backlog] [-t storage] [-f none|batch|async] [-i] [-l level] [-u path] [-6] "
+        "[-U path] [-S path] [-m clients] [-k bytes] [-M bytes] [-g bytes] [-r bytes] "
+        "[-a seconds] [-w bytes] [-o nodelay|sndbuf=bytes|rcvbuf=bytes]\n", argv[0],
+        (USE_IO_URING == 1) ? "|uring" : "");
+    closelog();
+    return 1;
+}
+
+/*
+* aesdsoc_sighandler
+* 
+* Parameters:
+*   signal_no:      Signal number. 
+*
+* Returns: None
+*/
+static void aesdsoc_sighandler(int signal_no) {
+    /* Only async-signal-safe work here, the exit is logged by the server */
+    if (signal_no == SIGINT || signal_no == SIGTERM ) {
+       exit_aesd_soc = TRUE;
+       soc_close = TRUE;
+    }
 }
 
 /*
-* asesd_soc_write_time_stamp 
-* This is ased timer write function that saves data in file
+* aesdsoc_thread_create
+* Creates a worker thread with the termination signals blocked, so that
+* they are always delivered to the thread running the accept loop.
 * 
+* Parameters:
+*   thread:     Returns the thread id
+*   routine:    Thread function
+*   arg:        Thread argument
+*
+* Returns: 0 for success, otherwise the pthread_create error code
+*/
+int aesdsoc_thread_create(pthread_t *thread, void *(*routine)(void *), void *arg) {
+    sigset_t block_set;
+    sigset_t old_set;
+    int rc;
+
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+    rc = pthread_create(thread, NULL, routine, arg);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    return rc;
+}
+
+/*
+* aesdsoc_accept_wait
+* Waits until the listening socket has a client or a handoff stops the
+* acceptors. With upgrade support the listening socket is non-blocking, it
+* may be shared with another server.
 * 
-* Parameters: None
-*    
+* Parameters:
+*   soc_server:     Listening socket
+*   wake_fd:        Acceptor stop event
 *
-* Returns: 0 for succcess and non-zero for error
+* Returns: 0 when a client may be waiting, -1 with errno set otherwise
 */
-int asesd_soc_write_time_stamp(void) {
-#if (USE_AESD_CHAR_DEVICE != 1)
-    int rc = 0;
-    syslog(LOG_INFO,"**** Hello timer handler ****");
-    time_t now;
-    struct tm* cur_time;
-    char time_stamp[100];
-
-    for (int i = 0; i < write_time; i++ ) {
-        now = time_value[i];
-        cur_time = localtime(&now);
-        if(strftime(time_stamp, sizeof(time_stamp), "%Y-%m-%d %H:%M:%S", cur_time) == 0) {
-            syslog(LOG_INFO,"**** AESDSocket: asesd_soc_write_time_stamp: strftime Error  ****");
-            return -1;
-        }
-        if(pthread_mutex_lock(&file_mutex) !=0) {            
-            syslog(LOG_INFO,"**** AESDSocket: asesd_soc_write_time_stamp: pthread_mutex_lock error: %s****", 
-                strerror(errno));
-            return -2;
-        }
-        if( fprintf(fp, "timestamp: %s\n", time_stamp) < 0) {
-            syslog(LOG_INFO,"**** AESDSocket: asesd_soc_write_time_stamp: fprintf error ****"); 
-            rc = -3;
-            goto cleanup;
-        
-        }
-        if (fflush(fp) < 0) {            
-            syslog(LOG_INFO,"**** AESDSocket: asesd_soc_write_time_stamp: fflush error ****"); 
-            rc = -4;
-            goto cleanup;
-        }
-cleanup:        
-        if((pthread_mutex_unlock(&file_mutex)) !=0) {
-            rc = -5;            
-            syslog(LOG_INFO,"**** AESDSocket: asesd_soc_write_time_stamp: pthread_mutex_unlock error: %s****", 
-                strerror(errno));
-            return rc;
-        }
-        if(rc) {
-            return rc;
-        }
-        syslog(LOG_INFO,"**** Wrote TS AESDSOCKET timer handler ****");
+static int aesdsoc_accept_wait(int soc_server, int wake_fd) {
+    struct pollfd pfds[2];
+
+    pfds[0].fd = soc_server;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = wake_fd;
+    pfds[1].events = POLLIN;
+    if (poll(pfds, 2, -1) < 0) {
+        return -1;
+    }
+    if (pfds[1].revents) {
+        errno = EINTR;
+        return -1;
     }
-    write_time = 0;
-#endif    
     return 0;
 }
 
 /*
-* asesd_soc_timer_init 
-* This is ased timer init function that will
-* trigger at every 10 sec.
-* 
+* aesdsoc_stop_fd
+*
 * Parameters: None
-*    
 *
-* Returns: 0 for succcess and non-zero for error
+* Returns: Event descriptor that becomes readable when the acceptors have
+*          to stop, or -1 outside the server
 */
-void asesd_soc_timer_handler(int signum) {
-    time_t now;
-    
-    syslog(LOG_INFO,"**** AESDSOCKET timer handler ****");
-    time_value[write_time++] = time(&now);
-    if (( write_time % MAX_TIME_ENTRY) == 0) {
-        write_time = 1;
-    }
- 
+int aesdsoc_stop_fd(void) {
+    return aesdsoc_stop_event;
 }
 
 /*
-* asesd_soc_timer_init 
-* This is ased timer init function that will
-* trigger at every 10 sec.
-* 
+* aesdsoc_stop_acceptors
+* Signals the stop event, for the shards on exit and for a handoff.
+*
 * Parameters: None
-*    
 *
-* Returns: 0 for succcess and non-zero for error
+* Returns: None
 */
-int  asesd_soc_timer_init(void)
-{
-    struct sigevent aesd_soc_tmr_event;
-    struct itimerspec aesd_soc_tmr_timer_spec;
+void aesdsoc_stop_acceptors(void) {
+    uint64_t one = 1;
 
-    aesd_soc_tmr_event.sigev_signo = SIGALRM;
-    aesd_soc_tmr_event.sigev_value.sival_ptr = &timerid;
-    aesd_soc_tmr_event.sigev_notify = SIGEV_SIGNAL;
+    if (aesdsoc_stop_event >= 0 &&
+        write(aesdsoc_stop_event, &one, sizeof(one)) != sizeof(one)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: eventfd write failed %s", strerror(errno));
+    }
+}
 
+/*
+* aesdsoc_accept
+* Accepts the next client and makes it non-blocking. Clients taken over
+* from the previous server come first. Shared by all connection engines.
+* 
+* Parameters:
+*   soc_server:     Listening socket
+*   aesdsoc_addr:   Returns the peer address
+*
+* Returns: Client socket, or -1 on error. errno is EINTR when the accept was
+*          interrupted by a termination signal or a handoff.
+*/
+int aesdsoc_accept(int soc_server, struct sockaddr_storage *aesdsoc_addr) {
+    socklen_t aesdsoc_addr_len = sizeof(struct sockaddr_storage);
+    int wake_fd = (aesdsoc_handoff_path != NULL) ? aesdsoc_stop_event : -1;
+    int soc_client;
 
-    if (timer_create(CLOCK_REALTIME, &aesd_soc_tmr_event, &timerid) != 0) {
-        syslog(LOG_INFO,"**** Unable to create timer ****");
+    AESDSOC_LOG(LOG_DEBUG,"**** AESDSOCKET application: accept ****");
+    soc_client = aesdsoc_handoff_take(aesdsoc_addr);
+    while (soc_client < 0) {
+        if (wake_fd >= 0 && aesdsoc_accept_wait(soc_server, wake_fd)) {
+            soc_client = -1;
+            break;
+        }
+        soc_client = accept(soc_server, (struct sockaddr*)aesdsoc_addr, 
+            &aesdsoc_addr_len);
+        if (soc_client >= 0 || wake_fd < 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            break;
+        }
+    }
+    if (soc_client < 0 ) {
+        int accept_errno = errno;
+        if (accept_errno != EINTR) {
+            aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+        }
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: API accept failed %s", strerror(errno));
+        errno = accept_errno;
         return -1;
     }
+    if (aesdsoc_accepted(soc_client, aesdsoc_addr)) {
+        close(soc_client);
+        return -1;
+    }
+    return soc_client;
+}
 
-    aesd_soc_tmr_timer_spec.it_value.tv_sec = 10;
-    aesd_soc_tmr_timer_spec.it_value.tv_nsec = 0;
-    aesd_soc_tmr_timer_spec.it_interval.tv_sec = 10; 
-    aesd_soc_tmr_timer_spec.it_interval.tv_nsec = 0; 
-
+/*
+* aesdsoc_sockopt_parse
+* Parses a -o client socket option.
+* 
+* Parameters:
+*   option:     "nodelay", "sndbuf=bytes" or "rcvbuf=bytes"
+*
+* Returns: 0 for success, -1 for an unknown option or an invalid size
+*/
+static int aesdsoc_sockopt_parse(const char *option) {
+    int *size = NULL;
 
-    if (timer_settime(timerid, 0, &aesd_soc_tmr_timer_spec, NULL) != 0) {
-        syslog(LOG_INFO,"**** Unable to set the timer ****");
-        return -2;
+    if (strcmp(option, "nodelay") == 0) {
+        aesdsoc_tcp_nodelay = TRUE;
+        return 0;
     }
-    
-    signal(SIGALRM, asesd_soc_timer_handler);
-
-    return 0;
+    if (strncmp(option, "sndbuf=", 7) == 0) {
+        size = &aesdsoc_sndbuf;
+    }
+    else if (strncmp(option, "rcvbuf=", 7) == 0) {
+        size = &aesdsoc_rcvbuf;
+    }
+    if (size == NULL) {
+        return -1;
+    }
+    *size = atoi(option + 7);
+    return (*size > 0) ? 0 : -1;
 }
 
-
 /*
-* aesdsoc_sighandler
+* aesdsoc_sockopt_apply
+* Applies the -o options to a client socket. TCP_NODELAY only applies to
+* TCP clients, a failure is logged and the client is served anyway.
 * 
 * Parameters:
-*   signal_no:      Signal number. 
+*   soc_client: Client socket
+*   family:     Address family of the client
 *
 * Returns: None
 */
-static void aesdsoc_sighandler(int signal_no) {
-
-    syslog(LOG_INFO, "Caught signal, exiting"); 
-    if (signal_no == SIGINT || signal_no == SIGTERM ) {
-       exit_aesd_soc = TRUE;
-       soc_close = TRUE;
+static void aesdsoc_sockopt_apply(int soc_client, int family) {
+    if (aesdsoc_tcp_nodelay && family != AF_UNIX &&
+        setsockopt(soc_client, IPPROTO_TCP, TCP_NODELAY, &aesdsoc_tcp_nodelay,
+            sizeof(aesdsoc_tcp_nodelay)) < 0) {
+        AESDSOC_LOG(LOG_WARNING, "aesdsocket: TCP_NODELAY failed %s", strerror(errno));
+    }
+    if (aesdsoc_sndbuf > 0 &&
+        setsockopt(soc_client, SOL_SOCKET, SO_SNDBUF, &aesdsoc_sndbuf,
+            sizeof(aesdsoc_sndbuf)) < 0) {
+        AESDSOC_LOG(LOG_WARNING, "aesdsocket: SO_SNDBUF failed %s", strerror(errno));
+    }
+    if (aesdsoc_rcvbuf > 0 &&
+        setsockopt(soc_client, SOL_SOCKET, SO_RCVBUF, &aesdsoc_rcvbuf,
+            sizeof(aesdsoc_rcvbuf)) < 0) {
+        AESDSOC_LOG(LOG_WARNING, "aesdsocket: SO_RCVBUF failed %s", strerror(errno));
     }
-    if (signal_no == SIGINT )
-       file_close = FALSE;    
 }
 
 /*
-* aesdsocket thread clean-up function
+* aesdsoc_accepted
+* Common setup of a freshly accepted client: makes it non-blocking and
+* applies the -o socket options.
 * 
-* Parameters: None
+* Parameters:
+*   soc_client:     Accepted client socket
+*   aesdsoc_addr:   Peer address
 *
-* Returns: 0 list is empty, otherwise 1; 
-*   
+* Returns: 0 for succcess and non-zero for error, the caller closes the socket
 */
-int aesdsocket_memory_cleanup(void) {
-    ASEDSocThread_t *temp;
-    ASEDSocThread_t *ptr;
-    pthread_mutex_lock(&link_list_mutex);            
-    SLIST_FOREACH_SAFE(ptr, &head, entries, temp) {
-        SLIST_REMOVE(&head, ptr, ASEDSocThread, entries);
-        free(ptr);
-    }
-    
-    pthread_mutex_unlock(&link_list_mutex);
-    if (SLIST_EMPTY(&head)) {
-        return 0;
+int aesdsoc_accepted(int soc_client, const struct sockaddr_storage *aesdsoc_addr) {
+    char peer[AESDSOC_ADDR_TEXT_SIZE];
+
+    AESDSOC_LOG(LOG_INFO, "Accepted connection from %s",
+        aesdsoc_addr_text(aesdsoc_addr, peer, sizeof(peer)));
+    aesdsoc_metric_add(AESDSOC_METRIC_ACCEPTED, 1);
+    if (fcntl(soc_client, F_SETFL, O_NONBLOCK) < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: fcntl failed %s", strerror(errno));
+        return -1;
     }
-    return 1;
+    aesdsoc_sockopt_apply(soc_client, aesdsoc_addr->ss_family);
+    return 0;
 }
 
 /*
-* aesdsocket thread clean-up function
+* aesdsoc_addr_text
+* Formats a peer address for the log. IPv4 clients of the dual stack
+* listener are shown as IPv4 addresses.
 * 
-* Parameters: None
+* Parameters:
+*   aesdsoc_addr:   Peer address
+*   text:           Output buffer, AESDSOC_ADDR_TEXT_SIZE bytes
+*   len:            Size of text
 *
-* Returns: 0 list is empty, otherwise 1; 
-*   
+* Returns: text
 */
-int aesdsocket_thread_cleanup(void) {
-    ASEDSocThread_t *temp;
-    ASEDSocThread_t *ptr;
-    pthread_mutex_lock(&link_list_mutex);            
-    SLIST_FOREACH_SAFE(ptr, &head, entries, temp) {
-        if (ptr->done == 1) {
-            syslog(LOG_INFO, "Pthread join for %lu", ptr->thread);
-            pthread_join(ptr->thread, NULL);
-            SLIST_REMOVE(&head, ptr, ASEDSocThread, entries);
-            free(ptr);
-            continue;
-        }
+const char *aesdsoc_addr_text(const struct sockaddr_storage *aesdsoc_addr, char *text,
+    size_t len) {
+    const struct sockaddr_in *addr4 = (const struct sockaddr_in *)aesdsoc_addr;
+    const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)aesdsoc_addr;
+
+    if (aesdsoc_addr->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+        inet_ntop(AF_INET, &addr6->sin6_addr.s6_addr[12], text, len);
     }
-    pthread_mutex_unlock(&link_list_mutex);
-    if (SLIST_EMPTY(&head)) {
-        return 0;
+    else if (aesdsoc_addr->ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &addr6->sin6_addr, text, len);
     }
-    return 1;
+    else if (aesdsoc_addr->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &addr4->sin_addr, text, len);
+    }
+    else {
+        snprintf(text, len, "local socket");
+    }
+    return text;
 }
 
 /*
@@ -336,49 +653,38 @@ int aesdsocket_thread_cleanup(void) {
 * 
 * Parameters:
 *   d_mode: Flag stating if daemon mode is enabled or not, 1= daemon mode
+*   engine: Connection engine serving the accepted clients
 *
 * Returns: 0 if the function executed without any error. Otherwise, error code 
 *          is logged in syslog and the program exists with non-zero value
 *   
 */
-static int aesdsocket_server(int d_mode) {
+static int aesdsocket_server(int d_mode, const aesdsoc_engine_t *engine) {
     int soc_server = -1;
     int rc = -1;
-    int cmd_option = 1;
-    int aesdsoc_addr_len = sizeof(struct sockaddr_in);
+    int storage_open = FALSE;
     struct sigaction signal_action;    
-    int soc_client = -1;
-    struct sockaddr_in aesdsoc_addr;
-    int file_create = 0;
-    syslog(LOG_INFO,"**** AESDSOCKET application: socket ****");
-    soc_server = socket(AF_INET, SOCK_STREAM, 0);
-    if (soc_server < 0) {
-        rc = -1;
-        syslog(LOG_ERR, "aesdsocket: Socket creation failed %s", strerror(errno));
-        goto error_0;
-    }
+    aesdsoc_shard_t *shards = NULL;
 
-    syslog(LOG_INFO,"**** AESDSOCKET application: setsockopt ****");
-    rc = setsockopt(soc_server, SOL_SOCKET, SO_REUSEPORT, &cmd_option, sizeof(cmd_option));
-    if (rc < 0) {
-        syslog(LOG_ERR, "aesdsocket: API setsockopt failed %s", strerror(errno));
-        goto error_0;
+    /* Takes over a running server, or the sockets of the service manager */
+    if (aesdsoc_handoff_init()) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: takeover incomplete, opening the missing listeners");
     }
-
-    syslog(LOG_INFO,"**** AESDSOCKET application: bind ****");
-    aesdsoc_addr.sin_family = AF_INET;
-    aesdsoc_addr.sin_addr.s_addr = INADDR_ANY;
-    aesdsoc_addr.sin_port = htons(SOCKET_PORT);
-    rc = bind(soc_server, (struct sockaddr*)&aesdsoc_addr, aesdsoc_addr_len);
-    if (rc < 0) {
-        syslog(LOG_ERR, "aesdsocket: API bind failure %s", strerror(errno));
+    if (aesdsoc_handoff_listener_count() > aesdsoc_shards + aesdsoc_local_count) {
+        aesdsoc_shards = aesdsoc_handoff_listener_count() - aesdsoc_local_count;
+    }
+    aesdsoc_listener_count = aesdsoc_shards + aesdsoc_local_count;
+    aesdsoc_listeners = (int *)malloc(aesdsoc_listener_count * sizeof(int));
+    if (aesdsoc_listeners == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
         goto error_0;
     }
-
-    syslog(LOG_INFO,"**** AESDSOCKET application: listen ****");
-    rc = listen(soc_server, MAX_SERVER_CONNECTION);
-    if (rc < 0) {
-        syslog(LOG_ERR, "aesdsocket: API listen failed %s", strerror(errno));
+    for (int i = 0; i < aesdsoc_listener_count; i++) {
+        aesdsoc_listeners[i] = -1;
+    }
+    soc_server = aesdsoc_listen_get(0);
+    if (soc_server < 0) {
+        rc = -1;
         goto error_0;
     }
 
@@ -386,419 +692,1549 @@ static int aesdsocket_server(int d_mode) {
     if(d_mode == TRUE) {
         rc = daemon(0,0);
         if (rc < 0) {
-            syslog(LOG_ERR, "aesdsocket: daemon creation error %s", strerror(errno));
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: daemon creation error %s", strerror(errno));
             goto  error_0;
         }
     }
-    syslog(LOG_INFO, "aesdsocket:Starting aesdsocket_server in daemon = %s", 
+    AESDSOC_LOG(LOG_INFO, "aesdsocket:Starting aesdsocket_server in daemon = %s", 
         ((d_mode ==1)? "TRUE" : "FALSE")); 
+    /* Messages are logged synchronously if the log thread is missing */
+    aesdsoc_log_start();
 
+    if (aesdsoc_storage->open()) {
+        rc = -1;
+        goto  error_0;
+    }
+    storage_open = TRUE;
 
-    file_close = TRUE;
+    aesdsoc_stop_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (aesdsoc_stop_event < 0) {
+        rc = -1;
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: eventfd failed %s", strerror(errno));
+        goto error_1;
+    }
     
-    if(asesd_soc_timer_init()) {
+    if(aesdsoc_timer_start()) {
         goto error_1;
     }
+    if(aesdsoc_handoff_start()) {
+        goto error_2;
+    }
 
     memset(&signal_action, 0, sizeof(signal_action));
     signal_action.sa_handler = aesdsoc_sighandler;
     rc = sigaction(SIGINT,  &signal_action, 0);
     if (rc < 0 ) {
-        syslog(LOG_ERR, "aesdsocket: Sigaction failed for SIGINT %s", strerror(errno));
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Sigaction failed for SIGINT %s", strerror(errno));
         goto error_2;
     }
     rc = sigaction(SIGTERM, &signal_action, 0);
     if (rc < 0 ) {
-        syslog(LOG_ERR, "aesdsocket: Sigaction failed for SIGTERM %s", strerror(errno));
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Sigaction failed for SIGTERM %s", strerror(errno));
+        goto error_2;
+    }
+    /* sendfile() has no MSG_NOSIGNAL, report a closed client as EPIPE */
+    signal_action.sa_handler = SIG_IGN;
+    rc = sigaction(SIGPIPE, &signal_action, 0);
+    if (rc < 0 ) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Sigaction failed for SIGPIPE %s", strerror(errno));
         goto error_2;
     }
     
-    syslog(LOG_INFO,"**** AESDSOCKET application: Staring multi-thread mode ****");
-    while( exit_aesd_soc == FALSE) {            
-        syslog(LOG_INFO,"**** AESDSOCKET application: accept ****");
-        soc_client = accept(soc_server, (struct sockaddr*)&aesdsoc_addr, 
-            (socklen_t*)&aesdsoc_addr_len);
-        if (soc_client < 0 ) {
-            rc = -1;
-            syslog(LOG_ERR, "aesdsocket: API accept failed %s", strerror(errno));
-            goto error_2;
-        }
-        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(aesdsoc_addr.sin_addr));                 
-        rc = fcntl(soc_client, F_SETFL, O_NONBLOCK);
-        if (rc < 0) {
-            syslog(LOG_ERR, "aesdsocket: fcntl failed %s", strerror(errno));
-            goto error_3;
-        }
-
-        if (file_create == 0) {
-#if (USE_AESD_CHAR_DEVICE == 1)
-            fp =  fopen("/dev/aesdchar", "a+");
-#else
-            fp =  fopen("/var/tmp/aesdsocketdata", "a+");
-#endif
-            if (fp == NULL) {
-                syslog(LOG_ERR, "aesdsocket: File open Error %s", strerror(errno));
-                goto  error_0;
-            }
-            file_create = 1;
-        }
-        
-        ASEDSocThread_t *thread_struct;
-        pthread_t thread;
-        thread_struct = (ASEDSocThread_t *)malloc(sizeof(ASEDSocThread_t));
-        if(thread_struct == NULL) {
-            syslog(LOG_ERR, "aesdsocket: Malloc failed");
-            goto error_3;
-        }
-        
-        thread_struct->done = 0;
-        thread_struct->aesdsoc_addr = aesdsoc_addr;
-        thread_struct->soc_client = soc_client;
-        if (pthread_mutex_lock(&link_list_mutex) !=0) {
-            free(thread_struct);
-            syslog(LOG_ERR, "aesdsocket: mutex_lock failed %s", strerror(errno));
-            goto error_3;
-        }
-        SLIST_INSERT_HEAD(&head, thread_struct, entries);
-        if (pthread_mutex_unlock(&link_list_mutex) !=0) {            
-            syslog(LOG_ERR, "aesdsocket: mutex_unlock failed %s", strerror(errno));
-            goto error_4;
-        }
-
-        if(write_time) {
-            if (asesd_soc_write_time_stamp())
-                goto error_4;
-        }
-        
-        if (pthread_create(&thread, NULL, soc_thread, thread_struct) != 0) {
-            perror("pthread_create failed");
-            goto error_4;
-        }
-
-        syslog(LOG_INFO, "Pthread created thread  %lu", thread);
-
-        if(aesdsocket_thread_cleanup()) {
-            continue;
-        }       
+    if (aesdsoc_listener_count <= 1) {
+        rc = engine->run(soc_server);
+    }
+    else {
+        rc = aesdsoc_shards_run(engine, soc_server, &shards);
+    }
+    aesdsoc_log_cpu_usage(engine);
+    aesdsoc_buf_pool_release();
+    aesdsoc_snapshot_release();
+    if (aesdsoc_handoff_active()) {
+        /* The new server scans the data once the handoff ends, no timestamp
+         * may be appended after that */
+        aesdsoc_timer_stop();
+        aesdsoc_storage->close(TRUE);
+        storage_open = FALSE;
+        aesdsoc_handoff_send(aesdsoc_listeners, aesdsoc_listener_count);
+    }
+    else if (exit_aesd_soc == TRUE) {
+        AESDSOC_LOG(LOG_INFO, "Caught signal, exiting");
     }
 
-    /* Make sure all thread data is cleaned up */
-    error_4:
-    while(aesdsocket_memory_cleanup());
-    error_3:
-    close(soc_client);
     error_2:    
-    timer_delete(timerid);
+    aesdsoc_handoff_stop();
+    aesdsoc_timer_stop();
     error_1:
-    if(file_close) {
-        fclose(fp);
+    if (aesdsoc_stop_event >= 0) {
+        close(aesdsoc_stop_event);
+        aesdsoc_stop_event = -1;
     }
-#if (USE_AESD_CHAR_DEVICE == 1)
-    fclose(fp);
-    remove("/dev/aesdchar");
-
-#else
-    if(remove("/var/tmp/aesdsocketdata")) {
-        printf("Error file removal\n");
+    if (storage_open) {
+        /* The new server keeps using the data */
+        aesdsoc_storage->close(aesdsoc_handoff_active());
     }
-#endif    
     error_0:
-    shutdown(soc_server, SHUT_RDWR);
+    for (int i = 0; aesdsoc_listeners != NULL && i < aesdsoc_listener_count; i++) {
+        aesdsoc_listen_spec_t spec;
+
+        if (aesdsoc_listeners[i] < 0) {
+            continue;
+        }
+        /* Shutting down a handed over socket would stop the new server too */
+        if (!aesdsoc_handoff_active()) {
+            shutdown(aesdsoc_listeners[i], SHUT_RDWR);
+            aesdsoc_listen_spec(i, &spec);
+            if (spec.family == AF_UNIX) {
+                unlink(spec.path);
+            }
+        }
+        close(aesdsoc_listeners[i]);
+    }
+    free(aesdsoc_listeners);
+    aesdsoc_listeners = NULL;
+    free(shards);
+    aesdsoc_log_stop();
     rc = (exit_aesd_soc == TRUE) ? 0 : rc;
     return rc;
 }
 
 /*
-* Socket server API
+* aesdsoc_listen_open
+* Creates a listening socket, on SOCKET_PORT for TCP. SO_REUSEPORT lets
+* every shard bind its own socket to the same port.
 * 
 * Parameters:
-*   d_mode: Flag stating if daemon mode is enabled or not, 1= daemon mode
+*   spec:       Listener to create
 *
-* Returns: 0 if the function executed without any error. Otherwise, error code 
-*          is logged in syslog and the program exists with non-zero value
-*   
+* Returns: Listening socket, or -1 on error
 */
-int sendpacket(int soc_client)
-{
-    char *tx_buf = NULL;
-    int data_wrote = 0;
-    int rc = 0;
-
-#if (USE_AESD_CHAR_DEVICE != 1)
-    if(pthread_mutex_lock(&file_mutex) !=0) {        
-        syslog(LOG_ERR, "aesdsocket: mutex_lock failed %s", strerror(errno));
+static int aesdsoc_listen_open(const aesdsoc_listen_spec_t *spec) {
+    int soc_server = -1;
+    int rc = -1;
+    int cmd_option = 1;
+    socklen_t aesdsoc_addr_len;
+    struct sockaddr_storage aesdsoc_addr;
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)&aesdsoc_addr;
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&aesdsoc_addr;
+    struct sockaddr_un *addr_un = (struct sockaddr_un *)&aesdsoc_addr;
+    AESDSOC_LOG(LOG_INFO,"**** AESDSOCKET application: socket ****");
+    soc_server = socket(spec->family, spec->type | SOCK_CLOEXEC, 0);
+    if (soc_server < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Socket creation failed %s", strerror(errno));
         return -1;
     }
-#endif    
-
-    int file_len = ftell(fp);
-    syslog(LOG_INFO, "sendpacket: force_send = %d, file_len = %d \n", force_send, file_len);
-    if (force_send == 0) {
-        data_wrote = file_len- prev_len; 
-        syslog(LOG_INFO, "File info %d %d", file_len, prev_len);
 
-        if((data_wrote) <=0) {
-        
-            syslog(LOG_INFO, "Nothing to send %d %d", file_len, prev_len);
-            goto return_send;
-        }
-    
-        prev_len = file_len;
-        if(!file_len) goto return_send;
+    memset(&aesdsoc_addr, 0, sizeof(aesdsoc_addr));
+    if (spec->family == AF_UNIX) {
+        addr_un->sun_family = AF_UNIX;
+        strncpy(addr_un->sun_path, spec->path, sizeof(addr_un->sun_path) - 1);
+        aesdsoc_addr_len = sizeof(struct sockaddr_un);
+        /* Left behind by a crash, a handed over socket is inherited instead */
+        unlink(addr_un->sun_path);
     }
     else {
-        data_wrote = file_len;
-    }
-    tx_buf = (char *) malloc(file_len);
-    syslog(LOG_INFO, "Sneding %d to client", file_len);
-    if (force_send == 0) {
-
-        if(fseek(fp, 0, SEEK_SET)) {  
-            rc = -2;
-            syslog(LOG_ERR, "aesdsocket: FSEEK failed %s", strerror(errno));
-            goto free_up_resource;
+        AESDSOC_LOG(LOG_INFO,"**** AESDSOCKET application: setsockopt ****");
+        rc = setsockopt(soc_server, SOL_SOCKET, SO_REUSEPORT, &cmd_option, sizeof(cmd_option));
+        /* Dual stack, IPv4 clients show up as mapped addresses */
+        if (rc == 0 && spec->family == AF_INET6) {
+            cmd_option = 0;
+            rc = setsockopt(soc_server, IPPROTO_IPV6, IPV6_V6ONLY, &cmd_option,
+                sizeof(cmd_option));
         }
-    }
-    while(fgets(tx_buf, file_len, fp) != NULL)  {
-        syslog(LOG_INFO, "Sending data to client %s", tx_buf);
-        if(send(soc_client, tx_buf, strlen(tx_buf), 0)== -1)  {
-            rc = -3;
-            syslog(LOG_ERR, "aesdsocket: SEND failed %s", strerror(errno)); 
-            goto free_up_resource;
+        /* The window scale is negotiated from the listener receive buffer */
+        if (rc == 0 && aesdsoc_rcvbuf > 0) {
+            rc = setsockopt(soc_server, SOL_SOCKET, SO_RCVBUF, &aesdsoc_rcvbuf,
+                sizeof(aesdsoc_rcvbuf));
+        }
+        if (rc < 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: API setsockopt failed %s", strerror(errno));
+            goto error_0;
+        }
+        if (spec->family == AF_INET6) {
+            addr6->sin6_family = AF_INET6;
+            addr6->sin6_addr = in6addr_any;
+            addr6->sin6_port = htons(SOCKET_PORT);
+            aesdsoc_addr_len = sizeof(struct sockaddr_in6);
+        }
+        else {
+            addr4->sin_family = AF_INET;
+            addr4->sin_addr.s_addr = INADDR_ANY;
+            addr4->sin_port = htons(SOCKET_PORT);
+            aesdsoc_addr_len = sizeof(struct sockaddr_in);
         }
     }
-    if(fseek(fp, 0, SEEK_END)) {
-        syslog(LOG_ERR, "aesdsocket: fseek failed %s", strerror(errno));
-        rc = -4;
+
+    AESDSOC_LOG(LOG_INFO,"**** AESDSOCKET application: bind ****");
+    rc = bind(soc_server, (struct sockaddr*)&aesdsoc_addr, aesdsoc_addr_len);
+    if (rc < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: API bind failure %s", strerror(errno));
+        goto error_0;
     }
-    
-free_up_resource:
-    free(tx_buf);
-return_send: 
 
-#if (USE_AESD_CHAR_DEVICE != 1)    
-    if(pthread_mutex_unlock(&file_mutex) != 0) {
-        syslog(LOG_ERR, "aesdsocket: mutex_unlock failed %s", strerror(errno));
+    AESDSOC_LOG(LOG_INFO,"**** AESDSOCKET application: listen ****");
+    rc = listen(soc_server, aesdsoc_backlog);
+    if (rc < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: API listen failed %s", strerror(errno));
+        goto error_0;
     }
-#endif  
-    force_send = 0;
-    if(rc) return rc;
-    return data_wrote;
+    return soc_server;
+
+    error_0:
+    close(soc_server);
+    return -1;
 }
 
 /*
-* process_and_save_data
+* aesdsoc_listen_spec
+* Listener i is TCP for the first aesdsoc_shards, then one per local
+* listener given with -U or -S.
 * 
 * Parameters:
-*   buffer:         Pointer to data buffer containing client data. 
-*                   Freed by the caller.
-*   file_buffer:    Pointer to file buffer, freed by the caller.
-*   rcv_data_len:   Size of data buffer in bytes
-*   write_ptr:      Index of file buffer
-*   fp:             File pointer
+*   index:      Listener index
+*   spec:       Returns the listener
 *
 * Returns: None
-        0 : For sucsess, 
-        < 0 for error
 */
-static int process_and_save_data(char *buffer, char *file_buffer, 
-    int rcv_data_len, int *wr_pointer, FILE *fp) {
+static void aesdsoc_listen_spec(int index, aesdsoc_listen_spec_t *spec) {
+    if (index >= aesdsoc_shards) {
+        *spec = aesdsoc_local_specs[index - aesdsoc_shards];
+        return;
+    }
+    spec->family = aesdsoc_ipv6 ? AF_INET6 : AF_INET;
+    spec->type = SOCK_STREAM;
+    spec->path = NULL;
+}
 
-    int buf_rd_ptr = 0;    
-    int pos = 0;
-    int rc = 0;
-    char *start = &buffer[buf_rd_ptr];
-    char *end = &buffer[buf_rd_ptr];
-    int len_to_copy = rcv_data_len;  
-    end  = memchr(buffer, '\n', rcv_data_len ); 
-    syslog(LOG_INFO, "aesdsocket: process_and_save_data: RCV_len = %d, wr_pointer = %d", rcv_data_len, *wr_pointer);
-    while(1) {
-        if(end == NULL) {
-            memcpy(&file_buffer[*wr_pointer], &buffer[buf_rd_ptr], len_to_copy);
-            *wr_pointer += len_to_copy;
-            syslog(LOG_INFO, "aesdsocket: process_and_save_data: saving %d in memory, wr= =%d", len_to_copy, *wr_pointer);
-            buf_rd_ptr = 0;
+/*
+* aesdsoc_listen_get
+* Returns the listening socket of a shard: the inherited one if there is
+* one, a new one otherwise. With upgrade support the socket is made
+* non-blocking, see aesdsoc_accept_wait().
+* 
+* Parameters:
+*   index:      Shard number
+*
+* Returns: Listening socket, or -1 on error
+*/
+static int aesdsoc_listen_get(int index) {
+    int soc_server = aesdsoc_handoff_listener(index);
+    aesdsoc_listen_spec_t spec;
+
+    if (soc_server < 0) {
+        aesdsoc_listen_spec(index, &spec);
+        soc_server = aesdsoc_listen_open(&spec);
+    }
+    else {
+        AESDSOC_LOG(LOG_INFO, "aesdsocket: shard %d uses inherited socket %d", index, soc_server);
+    }
+    if (soc_server < 0) {
+        return -1;
+    }
+    if (aesdsoc_handoff_path != NULL && fcntl(soc_server, F_SETFL, O_NONBLOCK) < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: fcntl failed %s", strerror(errno));
+        close(soc_server);
+        return -1;
+    }
+    aesdsoc_listeners[index] = soc_server;
+    return soc_server;
+}
+
+/*
+* aesdsoc_shard_thread
+* Runs one engine instance on the shard's own listening socket.
+* 
+* Parameters:
+*   argument:   Pointer to aesdsoc_shard_t
+*
+* Returns: argument
+*/
+static void *aesdsoc_shard_thread(void *argument) {
+    aesdsoc_shard_t *shard = (aesdsoc_shard_t *)argument;
+    cpu_set_t cpu_set;
+
+    if (shard->cpu >= 0) {
+        /* Threads started by the engine inherit the affinity */
+        CPU_ZERO(&cpu_set);
+        CPU_SET(shard->cpu, &cpu_set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: shard %d cannot be pinned to cpu %d",
+                shard->index, shard->cpu);
+        }
+    }
+    AESDSOC_LOG(LOG_INFO, "aesdsocket: shard %d started", shard->index);
+    shard->rc = shard->engine->run(shard->soc_server);
+    return argument;
+}
+
+/*
+* aesdsoc_shards_run
+* Starts one acceptor shard per listener: aesdsoc_shards on SOCKET_PORT, so
+* the kernel load balances new connections between them, and one per local
+* listener.
+* Waits for the exit request, then stops the shards by shutting their
+* listening sockets down.
+* 
+* Parameters:
+*   engine:     Engine run by every shard
+*   soc_server: Listening socket of the first shard
+*   shards:     Returns the shard array, freed by the caller
+*
+* Returns: 0 on exit request, otherwise error code
+*/
+static int aesdsoc_shards_run(const aesdsoc_engine_t *engine, int soc_server,
+    aesdsoc_shard_t **shards) {
+    aesdsoc_shard_t *shard;
+    sigset_t block_set;
+    sigset_t old_set;
+    int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int started = 0;
+    int rc = 0;
+
+    *shards = (aesdsoc_shard_t *)calloc(aesdsoc_listener_count, sizeof(aesdsoc_shard_t));
+    if (*shards == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+        return -1;
+    }
+    for (started = 0; started < aesdsoc_listener_count; started++) {
+        shard = &(*shards)[started];
+        shard->index = started;
+        shard->engine = engine;
+        shard->cpu = (aesdsoc_pin_shards && cpu_count > 0) ? started % cpu_count : -1;
+        shard->soc_server = (started == 0) ? soc_server : aesdsoc_listen_get(started);
+        if (shard->soc_server < 0) {
+            rc = -1;
             break;
         }
-        else {
-            int word = 0;
-            int offset = 0;
-            pos = (unsigned int)(end - start+1);
-            if (find_ioctl (buffer, rcv_data_len, &word, &offset) == 1) {
-                syslog(LOG_INFO, "Word = %d, offset =%d \n", word, offset);
-                int fd = fileno(fp);
-                int buf[2];
-                buf[0] =word;
-                buf[1] =offset;
-                ioctl(fd, AESDCHAR_IOCSEEKTO, &buf);
-                force_send = 1;
-                return 0;
+        if (aesdsoc_thread_create(&shard->thread, aesdsoc_shard_thread, shard) != 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: pthread_create failed");
+            rc = -1;
+            break;
+        }
+    }
+    AESDSOC_LOG(LOG_INFO,"**** AESDSOCKET application: %d %s shards running ****",
+        started, engine->name);
+
+    /* Sleep until the termination signal */
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+    while (rc == 0 && exit_aesd_soc == FALSE) {
+        sigsuspend(&old_set);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    /*
+    * accept() in the shards returns once the listening socket is shut down.
+    * A pending io_uring accept on a local socket does not, that engine polls
+    * the stop event as well. On a handoff the stop event has stopped them
+    * already, the sockets stay usable for the new server. The caller closes
+    * them.
+    */
+    exit_aesd_soc = (rc == 0) ? TRUE : exit_aesd_soc;
+    aesdsoc_stop_acceptors();
+    for (int i = 0; i < started && !aesdsoc_handoff_active(); i++) {
+        shutdown((*shards)[i].soc_server, SHUT_RDWR);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join((*shards)[i].thread, NULL);
+    }
+    return rc;
+}
+
+/*
+* aesdsoc_drain_expired
+* Replies in flight are finished for AESDSOC_DRAIN_MS once the server
+* stops, the time starts with the first call after the exit request.
+* 
+* Parameters: None
+*
+* Returns: TRUE when the server stops and the replies in flight are given up
+*/
+int aesdsoc_drain_expired(void) {
+    static uint64_t deadline = 0;
+    uint64_t now;
+    uint64_t expected = 0;
+
+    if (exit_aesd_soc == FALSE) {
+        return FALSE;
+    }
+    now = aesdsoc_metrics_now();
+    /* The first thread to see the exit sets the deadline for all of them */
+    __atomic_compare_exchange_n(&deadline, &expected,
+        now + (uint64_t)AESDSOC_DRAIN_MS * 1000000ULL, FALSE,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return now >= __atomic_load_n(&deadline, __ATOMIC_RELAXED);
+}
+
+/*
+* aesdsoc_send_wait
+* Waits until a non-blocking client socket has room for more data.
+* 
+* Parameters:
+*   soc_client: Client socket
+*
+* Returns: 0 when the socket is writable, -1 on error or once the drain time
+*          after an exit request is over
+*/
+static int aesdsoc_send_wait(int soc_client) {
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = soc_client;
+    pfd.events = POLLOUT;
+    while (!aesdsoc_drain_expired()) {
+        rc = poll(&pfd, 1, SEND_WAIT_MS);
+        if (rc > 0) {
+            return (pfd.revents & (POLLERR | POLLHUP)) ? -1 : 0;
+        }
+        if (rc < 0 && errno != EINTR) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: poll failed %s", strerror(errno));
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/*
+* aesdsoc_send_buf
+* Sends as much of a buffer as a non-blocking client socket takes.
+* 
+* Parameters:
+*   soc_client: Client socket
+*   data:       Data to send
+*   len:        Number of bytes in data
+*   flags:      MSG_MORE when the reply continues with another send
+*
+* Returns: Number of bytes sent, less than len when the socket is full, or
+*          -1 on error
+*/
+static ssize_t aesdsoc_send_buf(int soc_client, const char *data, size_t len, int flags) {
+    ssize_t sent;
+    size_t tx_len = 0;
+
+    while (tx_len < len) {
+        sent = send(soc_client, data + tx_len, len - tx_len, MSG_NOSIGNAL | flags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            memcpy(&file_buffer[*wr_pointer], &buffer[buf_rd_ptr], pos); 
-            *wr_pointer += pos;
-            file_buffer[*wr_pointer] ='\n';            
-            syslog(LOG_INFO, "aesdsocket: process_and_save_data: saving %d in file", *wr_pointer);
-#if (USE_AESD_CHAR_DEVICE != 1)            
-            pthread_mutex_lock(&file_mutex);    
-#endif
-            rc = fwrite (file_buffer , sizeof(char), *wr_pointer, fp);
-            if (rc < 0) {
-                syslog(LOG_ERR, "aesdsocket: fwrite failed %s", strerror(errno));   
-#if (USE_AESD_CHAR_DEVICE != 1)                
-                pthread_mutex_unlock(&file_mutex);
-#endif
-                return rc;
-            } 
-            fflush(fp);   
-#if (USE_AESD_CHAR_DEVICE != 1)            
-            pthread_mutex_unlock(&file_mutex);
-#endif
-            *wr_pointer = 0;
-            len_to_copy = len_to_copy - pos;
-            buf_rd_ptr += pos;
-            syslog(LOG_INFO, "aesdsocket: process_and_save_data: len= %d", len_to_copy);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: SEND failed %s", strerror(errno));
+            return -1;
+        }
+        tx_len += sent;
+    }
+    return tx_len;
+}
+
+/*
+* aesdsoc_send_copy
+* Sends storage contents through a bounce buffer. Used for storage that
+* sendfile() cannot read from, such as /dev/aesdchar, which returns at most
+* one write command per read, or that has no descriptor at all. Reads are
+* batched until the bounce buffer is full, so short write commands do not
+* leave as one small segment each.
+* 
+* Parameters:
+*   soc_client: Client socket
+*   offset:     Read offset, advanced by the number of bytes sent
+*   end:        Offset to stop at, or -1 to send up to the end of the storage
+*
+* Returns: 1 when everything is sent, 0 when the socket is full and -1 on
+*          error
+*/
+static int aesdsoc_send_copy(int soc_client, off_t *offset, off_t end) {
+    char tx_buf[SEND_BOUNCE_SIZE];
+    size_t tx_len;
+    size_t rd_size;
+    ssize_t rd_len = 1;
+    ssize_t sent;
+
+    while (rd_len > 0 && (end < 0 || *offset < end)) {
+        tx_len = 0;
+        while (tx_len < sizeof(tx_buf) && (end < 0 || *offset + (off_t)tx_len < end)) {
+            rd_size = sizeof(tx_buf) - tx_len;
+            if (end >= 0 && (off_t)rd_size > end - *offset - (off_t)tx_len) {
+                rd_size = end - *offset - tx_len;
+            }
+            rd_len = aesdsoc_storage->read(*offset + tx_len, tx_buf + tx_len, rd_size);
+            if (rd_len < 0) {
+                return -1;
+            }
+            if (rd_len == 0) {
+                break;
+            }
+            tx_len += rd_len;
+        }
+        if (tx_len == 0) {
+            break;
+        }
+        /* MSG_MORE only when more is known to follow, a held back tail
+         * would otherwise wait for the next reply */
+        sent = aesdsoc_send_buf(soc_client, tx_buf, tx_len,
+            (end >= 0 && *offset + (off_t)tx_len < end) ? MSG_MORE : 0);
+        if (sent < 0) {
+            return -1;
+        }
+        *offset += sent;
+        if ((size_t)sent < tx_len) {
+            /* The rest is read again once the socket has room */
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+* aesdsoc_cork
+* Sets TCP_CORK on a TCP client, other sockets are left alone.
+* 
+* Parameters:
+*   conn:       Connection state
+*   on:         TRUE to cork, FALSE to send what is pending
+*
+* Returns: TRUE if the option was changed
+*/
+static int aesdsoc_cork(aesdsoc_conn_t *conn, int on) {
+    if (conn->aesdsoc_addr.ss_family != AF_INET && conn->aesdsoc_addr.ss_family != AF_INET6) {
+        return FALSE;
+    }
+    if (setsockopt(conn->soc_client, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) < 0) {
+        AESDSOC_LOG(LOG_DEBUG, "aesdsocket: TCP_CORK failed %s", strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+* aesdsoc_send_storage
+* Streams the storage from offset into the client socket. Uses sendfile()
+* so the data goes from the page cache to the socket without a user space
+* copy, and falls back to aesdsoc_send_copy() when the storage does not
+* support it.
+* 
+* Parameters:
+*   soc_client: Client socket
+*   offset:     Start offset, returns the offset after the last byte sent
+*   end:        Offset to stop at, or -1 to send up to the end of the storage
+*
+* Returns: 1 when everything is sent, 0 when the socket is full and -1 on
+*          error
+*/
+static int aesdsoc_send_storage(int soc_client, off_t *offset, off_t end) {
+    int fd = aesdsoc_storage->fd();
+    size_t count;
+    ssize_t sent;
 
-            if(len_to_copy == 0) break;
+    if (!aesdsoc_storage->sendfile || fd < 0) {
+        return aesdsoc_send_copy(soc_client, offset, end);
+    }
+    while (end < 0 || *offset < end) {
+        count = SEND_CHUNK_SIZE;
+        if (end >= 0 && (off_t)count > end - *offset) {
+            count = end - *offset;
+        }
+        sent = sendfile(soc_client, fd, offset, count);
+        if (sent > 0) {
+            continue;
+        }
+        if (sent == 0) {
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
         }
-        start = end+1;
-        end = memchr(start, '\n', len_to_copy );
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno == EINVAL || errno == ENOSYS) {
+            return aesdsoc_send_copy(soc_client, offset, end);
+        }
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: sendfile failed %s", strerror(errno));
+        return -1;
+    }
+    return 1;
+}
+
+/*
+* aesdsoc_reply_start
+* Picks the storage offset the next reply starts from: the seek position
+* after an AESDCHAR_IOCSEEKTO command, the end of the previous reply for an
+* incremental client and the beginning otherwise. The storage may move it
+* past data it no longer keeps.
+* 
+* Parameters:
+*   conn:       Connection state
+*
+* Returns: Start offset
+*/
+off_t aesdsoc_reply_start(aesdsoc_conn_t *conn) {
+    off_t start;
+
+    if (conn->seek_pending) {
+        conn->seek_pending = FALSE;
+        start = conn->seek_offset;
+    }
+    else {
+        start = conn->incremental ? conn->reply_offset : 0;
     }
+    return (aesdsoc_storage->first != NULL) ? aesdsoc_storage->first(start) : start;
+}
+
+/*
+* aesdsoc_reply_done
+* Records a reply sent to the client.
+* 
+* Parameters:
+*   conn:       Connection state
+*   end:        Storage offset after the last byte sent
+*
+* Returns: None
+*/
+void aesdsoc_reply_done(aesdsoc_conn_t *conn, off_t end) {
+    conn->reply_offset = end;
+    aesdsoc_count_reply();
+    if (conn->commit_time != 0) {
+        aesdsoc_metric_observe(AESDSOC_HIST_COMMIT_REPLY,
+            aesdsoc_metrics_now() - conn->commit_time);
+        conn->commit_time = 0;
+    }
+}
+
+/*
+* aesdsoc_conn_reply_append
+* Adds data to the prepared reply of a connection, which is sent instead
+* of the storage contents.
+* 
+* Parameters:
+*   conn:       Connection state
+*   data:       Data to add
+*   len:        Number of bytes in data
+*
+* Returns: 0 for success, -1 on allocation failure
+*/
+int aesdsoc_conn_reply_append(aesdsoc_conn_t *conn, const void *data, int len)
+{
+    char *new_buf;
+    int size = (conn->reply_size > 0) ? conn->reply_size : FIXED_RD_BUF_SIZE;
+
+    while (size - conn->reply_len < len) {
+        size *= 2;
+    }
+    if (size != conn->reply_size) {
+        if (aesdsoc_mem_charge(conn, size - conn->reply_size)) {
+            aesdsoc_metric_add(AESDSOC_METRIC_REJECTED, 1);
+            AESDSOC_LOG(LOG_WARNING, "aesdsocket: no memory budget left for a reply");
+            return -1;
+        }
+        new_buf = (char *)realloc(conn->reply_buf, size);
+        if (new_buf == NULL) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: realloc failed %s", strerror(errno));
+            aesdsoc_mem_uncharge(conn, size - conn->reply_size);
+            return -1;
+        }
+        conn->reply_buf = new_buf;
+        conn->reply_size = size;
+    }
+    memcpy(conn->reply_buf + conn->reply_len, data, len);
+    conn->reply_len += len;
     return 0;
 }
 
 /*
-* Soceket thread
+* aesdsoc_reply_finish
+* Ends the reply in progress.
 * 
 * Parameters:
-*   argument:       Thread argument. 
-*                   Freed by the caller.
-*   
-* Returns: Sucess or error through thread data structure
-*/
-static void *soc_thread(void *argument) {
-    char *buffer = NULL;
-    char *file_buffer = NULL;
-    int rcv_data_len = 0;
-    int wr_pointer = 0;
-    int buffer_size = FIXED_RD_BUF_SIZE;
-    
-    ASEDSocThread_t *th_data = (ASEDSocThread_t *)argument;
+*   conn:       Connection state
+*   rc:         1 when the reply was sent, -1 when it failed
+*
+* Returns: None
+*/
+static void aesdsoc_reply_finish(aesdsoc_conn_t *conn, int rc)
+{
+    if (conn->tx_cork) {
+        aesdsoc_cork(conn, FALSE);
+        conn->tx_cork = FALSE;
+    }
+    if (conn->tx_snap != NULL) {
+        aesdsoc_snapshot_put(conn->tx_snap);
+        conn->tx_snap = NULL;
+    }
+    if (rc > 0) {
+        aesdsoc_metric_add(AESDSOC_METRIC_BYTES_OUT, conn->tx_offset - conn->tx_start);
+        if (!conn->tx_prepared) {
+            aesdsoc_reply_done(conn, conn->tx_offset);
+        }
+    }
+    /* The prepared reply buffer is kept for the next one */
+    if (conn->tx_prepared) {
+        conn->reply_len = 0;
+    }
+    conn->tx_active = FALSE;
+}
 
-    struct sockaddr_in aesdsoc_addr = th_data->aesdsoc_addr;
-    int soc_client = th_data->soc_client;
-    th_data->thread = pthread_self();
-    
-    syslog(LOG_INFO, "aesdsocket: thread started");
-
-    while( exit_aesd_soc == FALSE) {
-        
-        syslog(LOG_INFO, "aesdsocket: allocating buffer");
-        
-        int byte_allocated = buffer_size;
-        file_buffer = (char*)malloc(sizeof(char)*(buffer_size+1)); 
-        if (file_buffer == NULL) {            
-            syslog(LOG_ERR, "aesdsocket: malloc failed %s", strerror(errno));
-            goto exit_client;
-        }
-        buffer = (char*)malloc(sizeof(char)* buffer_size);
-        if(buffer == NULL) {    
-            syslog(LOG_ERR, "aesdsocket: malloc failed %s", strerror(errno));
-            goto exit_client;
-        }
-        while(exit_aesd_soc == FALSE) {  
-            rcv_data_len = recv(soc_client, buffer, buffer_size, 0);
-            syslog(LOG_INFO, "aesdsocket: receive %d %d %d", soc_client, buffer_size, rcv_data_len);
-            if (rcv_data_len < 0) {  
-                if(errno != EAGAIN) {
-                    syslog(LOG_INFO,"aesdsocket: recv returned error %s", strerror(errno) );
-                    goto exit_client;
-                }
-                continue;
+/*
+* aesdsoc_reply_continue
+* Sends more of the reply in progress.
+* 
+* Parameters:
+*   conn:       Connection state
+*
+* Returns: 1 when the reply is sent, 0 when the socket is full and -1 on
+*          error
+*/
+static int aesdsoc_reply_continue(aesdsoc_conn_t *conn)
+{
+    const char *data = NULL;
+    ssize_t sent;
+    int rc;
+
+    if (conn->tx_prepared) {
+        data = conn->reply_buf + conn->tx_offset;
+    }
+    else if (conn->tx_snap != NULL) {
+        data = conn->tx_snap->data + (conn->tx_offset - conn->tx_snap->start);
+    }
+    if (data != NULL) {
+        sent = aesdsoc_send_buf(conn->soc_client, data, conn->tx_end - conn->tx_offset, 0);
+        if (sent >= 0) {
+            conn->tx_offset += sent;
+        }
+        rc = (sent < 0) ? -1 : (conn->tx_offset == conn->tx_end);
+    }
+    else {
+        rc = aesdsoc_send_storage(conn->soc_client, &conn->tx_offset, conn->tx_end);
+    }
+    if (rc != 0) {
+        aesdsoc_reply_finish(conn, rc);
+    }
+    return rc;
+}
+
+/*
+* sendpacket
+* Starts the reply for the packets the client just completed and sends
+* what the socket takes.
+* 
+* Parameters:
+*   conn:       Connection state
+*
+* Returns: 1 when the reply is sent, 0 when the rest waits for room in the
+*          socket and negative value on error
+*/
+int sendpacket(aesdsoc_conn_t *conn)
+{
+    off_t start;
+    off_t end;
+
+    conn->tx_active = TRUE;
+    conn->tx_prepared = (conn->reply_len > 0);
+    conn->tx_snap = NULL;
+    conn->tx_cork = FALSE;
+    if (conn->tx_prepared) {
+        conn->tx_start = 0;
+        conn->tx_offset = 0;
+        conn->tx_end = conn->reply_len;
+        return aesdsoc_reply_continue(conn);
+    }
+    start = aesdsoc_reply_start(conn);
+    /* Complete packets only, -1 when the storage hands them out by itself */
+    end = aesdsoc_storage->size();
+    AESDSOC_LOG(LOG_DEBUG, "sendpacket: start = %ld, end = %ld, incremental = %d",
+        (long)start, (long)end, conn->incremental);
+    /* Without sendfile() the replies of one commit share a single read */
+    conn->tx_snap = aesdsoc_storage->sendfile ? NULL : aesdsoc_snapshot_get(start);
+    if (conn->tx_snap != NULL) {
+        end = conn->tx_snap->end;
+    }
+    else if (end < 0 || end - start > SEND_BOUNCE_SIZE) {
+        /* Streamed in several calls, corked so that only the last segment
+         * is short and the uncork pushes it without waiting for an ACK */
+        conn->tx_cork = aesdsoc_cork(conn, TRUE);
+    }
+    conn->tx_start = start;
+    conn->tx_offset = start;
+    conn->tx_end = end;
+    return aesdsoc_reply_continue(conn);
+}
+
+/*
+* aesdsoc_reply_read
+* Reads the reply for the last processed packet into memory, for engines
+* that transmit the reply themselves. The caller reports the sent reply
+* with aesdsoc_reply_done().
+* 
+* Parameters:
+*   conn:       Connection state, charged with the reply length
+*   start:      Storage offset from aesdsoc_reply_start()
+*   reply:      Returns a malloc'ed buffer with the reply, freed by the caller
+*
+* Returns: Reply length in bytes, or negative value on error
+*/
+int aesdsoc_reply_read(aesdsoc_conn_t *conn, off_t start, char **reply) {
+    return aesdsoc_storage_read(conn, start, -1, reply);
+}
+
+/*
+* aesdsoc_storage_read
+* Reads a range of the storage into memory. The buffer is charged against
+* the memory budget while it grows, the number of bytes read stays charged.
+* 
+* Parameters:
+*   conn:       Connection state, NULL to charge the server only
+*   start:      Storage offset
+*   max:        Number of bytes to read at most, -1 to read up to the end
+*   data:       Returns a malloc'ed buffer with the data, freed by the caller
+*               who uncharges the returned length
+*
+* Returns: Number of bytes read, or negative value on error with errno set
+*          to ENOBUFS above the memory budget
+*/
+int aesdsoc_storage_read(aesdsoc_conn_t *conn, off_t start, off_t max, char **data) {
+    off_t end = aesdsoc_storage->size();
+    size_t size = FIXED_RD_BUF_SIZE;
+    size_t rd_size;
+    ssize_t len = 0;
+    ssize_t rd_len;
+    long charged = size;
+    int over = FALSE;
+    char *tx_buf;
+    char *new_buf;
+
+    /* Stops at the last complete packet */
+    if (end >= 0 && (max < 0 || start + max > end)) {
+        max = (end > start) ? end - start : 0;
+    }
+    if (aesdsoc_mem_charge(conn, charged)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    tx_buf = (char *)malloc(size);
+    if (tx_buf == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+        aesdsoc_mem_uncharge(conn, charged);
+        return -1;
+    }
+    while (max < 0 || len < max) {
+        if ((size_t)len == size) {
+            if (aesdsoc_mem_charge(conn, size)) {
+                over = TRUE;
+                len = -1;
+                break;
             }
-            else if (rcv_data_len == 0) {
-                syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(aesdsoc_addr.sin_addr));
-                goto exit_client;
+            charged += size;
+            size *= 2;
+            new_buf = (char *)realloc(tx_buf, size);
+            if (new_buf == NULL) {
+                AESDSOC_LOG(LOG_ERR, "aesdsocket: realloc failed %s", strerror(errno));
+                len = -1;
+                break;
             }
-            else {
-                if (process_and_save_data(buffer, file_buffer, 
-                    rcv_data_len, &wr_pointer, fp) < 0) {
-                    syslog(LOG_ERR, "aesdsocket: process_and_save_data return error");
-                    goto exit_client;
-                }
-                
-                int len = sendpacket(soc_client);
-                if (len > 0) {                    
-                    syslog(LOG_INFO, "aesdsocket: Wrote to client");
-                    goto exit_client;
-                }
-                else if (len < 0) { 
-                    syslog(LOG_INFO, "aesdsocket: Error Writing to client");
-                    goto exit_client;
-                }
-                else {
-                    buffer_size *= 2;
-                    byte_allocated += buffer_size;
-                    syslog(LOG_INFO, "aesdsocket: file_buffer %d", byte_allocated+1);
-                    file_buffer = (char*)realloc(file_buffer, byte_allocated+1);
-                    if(file_buffer == NULL) {
-                        syslog(LOG_ERR, "aesdsocket: realloc failed %s", strerror(errno));
-                        goto exit_client;
-                    }
-                    syslog(LOG_INFO, "aesdsocket: buffer %d", buffer_size);
-                    buffer = (char*)realloc(buffer, buffer_size);
-                    if (buffer == NULL) {                    
-                        syslog(LOG_ERR, "aesdsocket: realloc failed %s", strerror(errno));
-                        goto exit_client;
-                    }
-                }
+            tx_buf = new_buf;
+        }
+        rd_size = size - len;
+        if (max >= 0 && (off_t)rd_size > max - len) {
+            rd_size = max - len;
+        }
+        /* The char device returns one write command per read */
+        rd_len = aesdsoc_storage->read(start + len, tx_buf + len, rd_size);
+        if (rd_len < 0) {
+            len = -1;
+            break;
+        }
+        if (rd_len == 0) {
+            break;
+        }
+        len += rd_len;
+    }
+    if (len < 0) {
+        free(tx_buf);
+        aesdsoc_mem_uncharge(conn, charged);
+        if (over) {
+            aesdsoc_metric_add(AESDSOC_METRIC_REJECTED, 1);
+            AESDSOC_LOG(LOG_WARNING, "aesdsocket: no memory budget left for a storage read");
+            errno = ENOBUFS;
+        }
+        return -1;
+    }
+    aesdsoc_mem_uncharge(conn, charged - len);
+    *data = tx_buf;
+    return len;
+}
+
+/*
+* aesdsoc_seek
+* Resolves AESDCHAR_IOCSEEKTO through the storage backend and keeps the
+* position for the next reply of the connection.
+* 
+* Parameters:
+*   conn:       Connection state
+*   word:       Write command index
+*   offset:     Byte offset within the write command
+*
+* Returns: 0 for success, -1 if the seek failed. The reply starts at the
+*          beginning then.
+*/
+int aesdsoc_seek(aesdsoc_conn_t *conn, uint32_t word, uint32_t offset) {
+    off_t pos = 0;
+
+    conn->seek_pending = TRUE;
+    conn->seek_offset = 0;
+    aesdsoc_metric_add(AESDSOC_METRIC_SEEKS, 1);
+    if (aesdsoc_storage->seek(word, offset, &pos)) {
+        return -1;
+    }
+    conn->seek_offset = pos;
+    return 0;
+}
+
+/*
+* aesdsoc_count_reply
+* Counts a reply sent to a client, used for the CPU per reply statistic.
+* 
+* Parameters: None
+*
+* Returns: None
+*/
+void aesdsoc_count_reply(void) {
+    aesdsoc_metric_add(AESDSOC_METRIC_REPLIES, 1);
+}
+
+/*
+* aesdsoc_log_cpu_usage
+* Logs the process CPU time spent per reply, so that engines can be compared
+* under the same load, and the average group commit batch size.
+* 
+* Parameters:
+*   engine:     Engine that served the clients
+*
+* Returns: None
+*/
+static void aesdsoc_log_cpu_usage(const aesdsoc_engine_t *engine) {
+    struct rusage usage;
+    long cpu_us;
+    unsigned long replies = aesdsoc_metric_total(AESDSOC_METRIC_REPLIES);
+    unsigned long batches;
+    unsigned long records;
+
+    aesdsoc_commit_stats(&batches, &records);
+    AESDSOC_LOG(LOG_INFO, "aesdsocket: group commit wrote %lu packets in %lu batches",
+        records, batches);
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        return;
+    }
+    cpu_us = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    AESDSOC_LOG(LOG_INFO, "aesdsocket: %s engine used %ld us CPU for %lu replies, %ld us per reply",
+        engine->name, cpu_us, replies, (replies > 0) ? (long)(cpu_us / replies) : 0L);
+}
+
+/*
+* aesdsoc_conn_command
+* Handles a complete line that is a command instead of a packet. Commands
+* are whole lines, recognized by their first bytes only.
+* 
+* Parameters:
+*   conn:       Connection state
+*   line:       Complete line, newline included
+*   len:        Line length in bytes
+*
+* Returns: -1 when the line is a packet, 0 for a command without reply,
+*          1 when a reply is due and -2 on error
+*/
+static int aesdsoc_conn_command(aesdsoc_conn_t *conn, const char *line, int len) {
+    char peer[AESDSOC_ADDR_TEXT_SIZE];
+    uint32_t word;
+    uint32_t offset;
+    int rc;
+
+    /* Every command starts with AESD */
+    if (len < 5 || memcmp(line, "AESD", 4) != 0) {
+        return -1;
+    }
+    if (len > SEEK_CMD_LEN && memcmp(line, SEEK_CMD, SEEK_CMD_LEN) == 0) {
+        if (aesdsoc_parse_seek(line + SEEK_CMD_LEN, len - SEEK_CMD_LEN - 1, &word, &offset)) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: malformed %.*s", len - 1, line);
+            aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+            /* The reply starts at the beginning, like a failed seek */
+            conn->seek_pending = TRUE;
+            conn->seek_offset = 0;
+            return 1;
+        }
+        AESDSOC_LOG(LOG_DEBUG, "Word = %u, offset =%u", word, offset);
+        /* The seek counts the packets received before it */
+        if (conn->commit_sync != NULL && conn->commit_sync(conn) < 0) {
+            return -2;
+        }
+        aesdsoc_seek(conn, word, offset);
+        return 1;
+    }
+    if (len == strlen(INCREMENTAL_CMD) && memcmp(line, INCREMENTAL_CMD, len) == 0) {
+        /* The reply cursor would point at other data once the oldest write
+         * command is dropped, the client gets whole replies and is closed */
+        if (!aesdsoc_storage->stable_offsets) {
+            AESDSOC_LOG(LOG_WARNING, "aesdsocket: no incremental replies on %s storage for %s",
+                aesdsoc_storage->name,
+                aesdsoc_addr_text(&conn->aesdsoc_addr, peer, sizeof(peer)));
+            aesdsoc_metric_add(AESDSOC_METRIC_REJECTED, 1);
+            return 0;
+        }
+        AESDSOC_LOG(LOG_INFO, "aesdsocket: incremental replies for %s",
+            aesdsoc_addr_text(&conn->aesdsoc_addr, peer, sizeof(peer)));
+        conn->incremental = TRUE;
+        return 0;
+    }
+    if (len == strlen(METRICS_CMD) && memcmp(line, METRICS_CMD, len) == 0) {
+        char *text;
+        int text_len;
+
+        if (conn->commit_sync != NULL && conn->commit_sync(conn) < 0) {
+            return -2;
+        }
+        text_len = aesdsoc_metrics_render(&text);
+        if (text_len < 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: metrics allocation failed");
+            return -2;
+        }
+        rc = aesdsoc_conn_reply_append(conn, text, text_len);
+        free(text);
+        return (rc < 0) ? -2 : 1;
+    }
+    if (len == strlen(BINARY_CMD) && memcmp(line, BINARY_CMD, len) == 0) {
+        AESDSOC_LOG(LOG_INFO, "aesdsocket: binary framing for %s",
+            aesdsoc_addr_text(&conn->aesdsoc_addr, peer, sizeof(peer)));
+        conn->binary = TRUE;
+        return (aesdsoc_binary_hello(conn) < 0) ? -2 : 1;
+    }
+    return -1;
+}
+
+/*
+* aesdsoc_conn_store
+* Saves one complete packet, through the engine commit hook if there is
+* one and batched with the packets of the other clients otherwise.
+* 
+* Parameters:
+*   conn:       Connection state
+*   data:       Packet, unchanged until it is written
+*   len:        Packet length in bytes
+*
+* Returns: 0 for success, AESDSOC_STORE_PENDING when the commit hook
+*          writes it later and negative value on error
+*/
+int aesdsoc_conn_store(aesdsoc_conn_t *conn, const char *data, int len) {
+    int rc;
+
+    if (conn->commit != NULL) {
+        rc = conn->commit(conn, data, len);
+    }
+    else {
+        rc = aesdsoc_group_commit(data, len);
+    }
+    if (rc < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: saving packet failed");   
+        return rc;
+    } 
+    conn->commit_time = aesdsoc_metrics_now();
+    aesdsoc_metric_add(AESDSOC_METRIC_COMMITTED, 1);
+    aesdsoc_metric_observe(AESDSOC_HIST_RECV_COMMIT,
+        conn->commit_time - conn->packet_start);
+    return rc;
+}
+
+/*
+* process_and_save_data
+* Splits the received data into lines in a single pass. A partial line is
+* kept in file_buffer until its newline arrives, a line received in one
+* piece is saved straight from the receive buffer.
+* 
+* Parameters:
+*   conn:           Connection state, holds the partial packet in
+*                   file_buffer at index wr_pointer.
+*   buffer:         Pointer to data buffer containing client data. 
+*                   Freed by the caller.
+*   rcv_data_len:   Size of data buffer in bytes
+*
+* Returns: None
+        1 : When a packet was saved, a seek was done or metrics were
+            requested, reply is due
+        0 : For sucsess, packet is not complete yet
+        AESDSOC_STORE_PENDING : A packet waits for its commit, the rest of
+            the data is kept in rx_next
+        < 0 for error
+*/
+static int process_and_save_data(aesdsoc_conn_t *conn, char *buffer,
+    int rcv_data_len) {
+    uint64_t now = aesdsoc_metrics_now();
+
+    aesdsoc_metric_add(AESDSOC_METRIC_BYTES_IN, rcv_data_len);
+    if (conn->wr_pointer == 0) {
+        conn->packet_start = now;
+    }
+    if (conn->binary) {
+        return aesdsoc_binary_process(conn, buffer, rcv_data_len);
+    }
+    return process_lines(conn, buffer, rcv_data_len, now);
+}
+
+/*
+* process_lines
+* Line splitting of process_and_save_data(), also resumes the rest of a
+* receive after a pending commit.
+* 
+* Parameters:
+*   conn:           Connection state
+*   buffer:         Received data
+*   rcv_data_len:   Size of data buffer in bytes
+*   now:            Time of the receive
+*
+* Returns: Same as process_and_save_data()
+*/
+static int process_lines(aesdsoc_conn_t *conn, const char *buffer,
+    int rcv_data_len, uint64_t now) {
+
+    char *file_buffer = conn->file_buffer;
+    int *wr_pointer = &conn->wr_pointer;
+    int committed = 0;
+    int buf_rd_ptr = 0;    
+    int pos;
+    int rc = 0;
+    const char *line;
+    int line_len;
+
+    AESDSOC_LOG(LOG_DEBUG, "aesdsocket: process_and_save_data: RCV_len = %d, wr_pointer = %d", rcv_data_len, *wr_pointer);
+    while (buf_rd_ptr < rcv_data_len) {
+        pos = aesdsoc_scan_newline(&buffer[buf_rd_ptr], rcv_data_len - buf_rd_ptr);
+        if (pos < 0) {
+            memcpy(&file_buffer[*wr_pointer], &buffer[buf_rd_ptr], rcv_data_len - buf_rd_ptr);
+            *wr_pointer += rcv_data_len - buf_rd_ptr;
+            AESDSOC_LOG(LOG_DEBUG, "aesdsocket: process_and_save_data: saving %d in memory, wr= =%d", rcv_data_len - buf_rd_ptr, *wr_pointer);
+            break;
+        }
+        pos++;
+        if (*wr_pointer == 0) {
+            line = &buffer[buf_rd_ptr];
+            line_len = pos;
+        }
+        else {
+            memcpy(&file_buffer[*wr_pointer], &buffer[buf_rd_ptr], pos); 
+            line = file_buffer;
+            line_len = *wr_pointer + pos;
+        }
+        buf_rd_ptr += pos;
+        *wr_pointer = 0;
+
+        rc = aesdsoc_conn_command(conn, line, line_len);
+        if (rc == -1) {
+            rc = aesdsoc_conn_store(conn, line, line_len);
+            if (rc < 0) {
+                return rc;
             }
+            if (rc == AESDSOC_STORE_PENDING) {
+                /* Neither buffer changes until the commit completes */
+                conn->packet_start = now;
+                conn->rx_next = &buffer[buf_rd_ptr];
+                conn->rx_left = rcv_data_len - buf_rd_ptr;
+                return rc;
+            }
+            rc = 1;
+        }
+        if (rc < 0) {
+            return rc;
+        }
+        committed |= rc;
+        /* The next packet starts with this receive */
+        conn->packet_start = now;
+        if (conn->binary) {
+            /* The rest of the receive is framed */
+            rc = aesdsoc_binary_process(conn, &buffer[buf_rd_ptr], rcv_data_len - buf_rd_ptr);
+            return (rc < 0 || rc == AESDSOC_STORE_PENDING) ? rc : 1;
         }
     }
-    exit_client:
-    close(soc_client);
+    return committed;
+}
 
-    if(buffer) { free(buffer); buffer = NULL;}
-    if(file_buffer) { free(file_buffer); file_buffer = NULL;}
-    buffer_size =  FIXED_RD_BUF_SIZE;
-    wr_pointer = 0;
-   
-    pthread_mutex_lock(&link_list_mutex);
-    th_data->done = 1;
-    pthread_mutex_unlock(&link_list_mutex);
-    return argument;
+/*
+* aesdsoc_conn_init
+* 
+* Parameters:
+*   conn:           Connection state to initialize
+*   soc_client:     Accepted client socket, owned by conn afterwards
+*   aesdsoc_addr:   Peer address
+*   
+* Returns: 0 for success, -1 if the receive buffers cannot be allocated
+*/
+int aesdsoc_conn_init(aesdsoc_conn_t *conn, int soc_client,
+    const struct sockaddr_storage *aesdsoc_addr) {
+    socklen_t type_len = sizeof(int);
+    int type;
+
+    conn->soc_client = soc_client;
+    conn->aesdsoc_addr = *aesdsoc_addr;
+    conn->wr_pointer = 0;
+    conn->incremental = FALSE;
+    conn->seek_pending = FALSE;
+    conn->seek_offset = 0;
+    conn->reply_offset = 0;
+    conn->binary = FALSE;
+    conn->reply_buf = NULL;
+    conn->reply_len = 0;
+    conn->reply_size = 0;
+    conn->tx_active = FALSE;
+    conn->tx_prepared = FALSE;
+    conn->tx_cork = FALSE;
+    conn->tx_snap = NULL;
+    conn->nonblocking = FALSE;
+    conn->rx_next = NULL;
+    conn->rx_left = 0;
+    conn->packet_start = 0;
+    conn->commit_time = 0;
+    conn->commit = NULL;
+    conn->commit_sync = NULL;
+    conn->engine_data = NULL;
+    conn->message = FALSE;
+    conn->admitted = FALSE;
+    conn->mem_charged = 0;
+    conn->buffer = NULL;
+    conn->file_buffer = NULL;
+    conn->buffer_size = 0;
+    conn->byte_allocated = 0;
+    if (aesdsoc_admit_client(conn)) {
+        return -1;
+    }
+    if (aesdsoc_addr->ss_family == AF_UNIX &&
+        getsockopt(soc_client, SOL_SOCKET, SO_TYPE, &type, &type_len) == 0) {
+        conn->message = (type == SOCK_SEQPACKET);
+    }
+    AESDSOC_LOG(LOG_DEBUG, "aesdsocket: allocating buffer");
+    /* A message must fit in one receive, it is not split like a stream */
+    conn->buffer = aesdsoc_buf_get(conn->message ? aesdsoc_buf_max_size() : FIXED_RD_BUF_SIZE,
+        &conn->buffer_size);
+    /* One more byte for the newline written after a packet */
+    conn->file_buffer = aesdsoc_buf_get(FIXED_RD_BUF_SIZE + 1, &conn->byte_allocated);
+    if (conn->file_buffer == NULL || conn->buffer == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: malloc failed %s", strerror(errno));
+        goto error;
+    }
+    if (aesdsoc_mem_charge(conn, conn->buffer_size + conn->byte_allocated)) {
+        aesdsoc_metric_add(AESDSOC_METRIC_REJECTED, 1);
+        AESDSOC_LOG(LOG_WARNING, "aesdsocket: memory budget of %ld bytes reached",
+            aesdsoc_mem_budget);
+        goto error;
+    }
+    /* A client taken over from the previous server gets its session back */
+    if (aesdsoc_handoff_restore(conn)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: restoring handed over client failed");
+        goto error;
+    }
+    return 0;
+
+error:
+    aesdsoc_admit_release(conn);
+    aesdsoc_buf_put(conn->file_buffer, conn->byte_allocated);
+    aesdsoc_buf_put(conn->buffer, conn->buffer_size);
+    conn->file_buffer = NULL;
+    conn->buffer = NULL;
+    return -1;
 }
 
 /*
-* find_ioctl
+* aesdsoc_conn_replied
+* Waits for the rest of the reply on a blocking connection.
 * 
 * Parameters:
-* argument:     data = pointer to buffer. 
-*               length = buffer length in bytes
-*               word =  Return the word offset to the caller
-*               offset = Return the byte offset to the caller
+*   conn:       Connection state
+*   rc:         Result of sendpacket() or aesdsoc_reply_continue()
 *   
-* Returns: 1 if string is found, else 0. 
+* Returns: Same as aesdsoc_conn_receive()
 */
-static int find_ioctl (char *data, int length, int *word, int *offset) {
+static int aesdsoc_conn_replied(aesdsoc_conn_t *conn, int rc) {
+    while (rc == 0 && !conn->nonblocking) {
+        if (aesdsoc_send_wait(conn->soc_client)) {
+            aesdsoc_reply_finish(conn, -1);
+            rc = -1;
+            break;
+        }
+        rc = aesdsoc_reply_continue(conn);
+    }
+    if (rc == 0) {
+        return AESDSOC_CONN_SEND;
+    }
+    if (rc < 0) {
+        aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+        AESDSOC_LOG(LOG_INFO, "aesdsocket: Error Writing to client");
+        return -1;
+    }
+    AESDSOC_LOG(LOG_DEBUG, "aesdsocket: Wrote to client");
+    if (!aesdsoc_conn_keep_open(conn)) {
+        return AESDSOC_CONN_CLOSE;
+    }
+    /* Make room for the next packet */
+    return aesdsoc_conn_grow(conn) ? -1 : AESDSOC_CONN_OPEN;
+}
 
-    char* search_string = "AESDCHAR_IOCSEEKTO:";
-    int search_string_len = strlen(search_string);
-    int i;
-    
-    for (i = 0; i <= length - search_string_len; i++) {
-        if (memcmp(data + i, search_string, search_string_len) == 0) {
-            syslog(LOG_INFO,"Found '%s' at index %d\n", search_string, i);
-            *word = (data[i+search_string_len]) - 0x30;
-            *offset = (data[i+search_string_len+2]) - 0x30; 
-            return 1;
+/*
+* aesdsoc_conn_processed
+* Sends the reply once the received data is processed.
+* 
+* Parameters:
+*   conn:       Connection state
+*   rc:         Result of process_and_save_data()
+*   
+* Returns: Same as aesdsoc_conn_receive()
+*/
+static int aesdsoc_conn_processed(aesdsoc_conn_t *conn, int rc) {
+    if (rc == AESDSOC_STORE_PENDING) {
+        return AESDSOC_CONN_COMMIT;
+    }
+    if (rc < 0) {
+        aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: process_and_save_data return error");
+        return -1;
+    }
+    if (aesdsoc_admit_check(conn)) {
+        return -1;
+    }
+    if (rc > 0) {
+        return aesdsoc_conn_replied(conn, sendpacket(conn));
+    }
+    /* Make room for the rest of the packet */
+    return aesdsoc_conn_grow(conn) ? -1 : AESDSOC_CONN_OPEN;
+}
+
+/*
+* aesdsoc_conn_receive
+* Receives once from the client, saves complete packets and sends the reply.
+* 
+* Parameters:
+*   conn:       Connection state
+*   
+* Returns: AESDSOC_CONN_OPEN when more data is expected, AESDSOC_CONN_AGAIN
+*          when the socket had no data, AESDSOC_CONN_CLOSE when the client
+*          is done and negative value on error. A non-blocking connection
+*          also returns AESDSOC_CONN_COMMIT and AESDSOC_CONN_SEND.
+*/
+int aesdsoc_conn_receive(aesdsoc_conn_t *conn) {
+    char peer[AESDSOC_ADDR_TEXT_SIZE];
+    /* MSG_TRUNC returns the full message length, a stream would drop data */
+    int rcv_data_len = recv(conn->soc_client, conn->buffer, conn->buffer_size,
+        conn->message ? MSG_TRUNC : 0);
+    AESDSOC_LOG(LOG_DEBUG, "aesdsocket: receive %d %d %d", conn->soc_client, conn->buffer_size, rcv_data_len);
+    if (rcv_data_len < 0) {  
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+            AESDSOC_LOG(LOG_INFO,"aesdsocket: recv returned error %s", strerror(errno) );
+            return -1;
         }
+        return AESDSOC_CONN_AGAIN;
     }
-    
-    if (i > length - search_string_len) {
-        syslog(LOG_INFO,"Search string not found\n");
+    else if (rcv_data_len == 0) {
+        AESDSOC_LOG(LOG_INFO, "Closed connection from %s",
+            aesdsoc_addr_text(&conn->aesdsoc_addr, peer, sizeof(peer)));
+        return AESDSOC_CONN_CLOSE;
+    }
+    else if (rcv_data_len > conn->buffer_size) {
+        aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: message of %d bytes above %d", rcv_data_len,
+            conn->buffer_size);
+        return -1;
+    }
+    return aesdsoc_conn_processed(conn, process_and_save_data(conn, conn->buffer,
+        rcv_data_len));
+}
+
+/*
+* aesdsoc_conn_resume
+* Processes the rest of the receive once the pending commit is written.
+* 
+* Parameters:
+*   conn:       Connection state after AESDSOC_CONN_COMMIT
+*   commit_rc:  Result of the commit
+*   
+* Returns: Same as aesdsoc_conn_receive()
+*/
+int aesdsoc_conn_resume(aesdsoc_conn_t *conn, int commit_rc) {
+    const char *data = conn->rx_next;
+    int len = conn->rx_left;
+    int rc = commit_rc;
+
+    conn->rx_next = NULL;
+    conn->rx_left = 0;
+    if (rc < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: saving packet failed");
+    }
+    else if (len > 0) {
+        rc = conn->binary ? aesdsoc_binary_process(conn, data, len) :
+            process_lines(conn, data, len, aesdsoc_metrics_now());
+    }
+    /* The written packet is replied to in any case */
+    if (rc >= 0 && rc != AESDSOC_STORE_PENDING) {
+        rc = 1;
+    }
+    return aesdsoc_conn_processed(conn, rc);
+}
+
+/*
+* aesdsoc_conn_send
+* Continues the reply after AESDSOC_CONN_SEND, once the socket has room.
+* 
+* Parameters:
+*   conn:       Connection state
+*   
+* Returns: Same as aesdsoc_conn_receive()
+*/
+int aesdsoc_conn_send(aesdsoc_conn_t *conn) {
+    return aesdsoc_conn_replied(conn, aesdsoc_reply_continue(conn));
+}
+
+/*
+* aesdsoc_conn_process
+* Saves the complete packets of data received by the engine itself.
+* 
+* Parameters:
+*   conn:       Connection state
+*   data:       Received data, at most FIXED_RD_BUF_SIZE bytes
+*   len:        Number of bytes in data
+*   
+* Returns: 1 when a reply is due, 0 when more data is expected and negative
+*          value on error.
+*/
+int aesdsoc_conn_process(aesdsoc_conn_t *conn, char *data, int len) {
+    int rc = process_and_save_data(conn, data, len);
+    if (rc < 0) {
+        aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+    }
+    if (rc >= 0 && aesdsoc_admit_check(conn)) {
+        return -1;
+    }
+    /* Engine receives are at most FIXED_RD_BUF_SIZE bytes */
+    if (rc >= 0 && aesdsoc_conn_reserve(conn, FIXED_RD_BUF_SIZE)) {
+        return -1;
+    }
+    return rc;
+}
+
+/*
+* aesdsoc_conn_reserve
+* Makes sure the packet buffer can take rx_len more bytes. A larger buffer
+* is taken from the pool and only the partial packet is copied over.
+* 
+* Parameters:
+*   conn:       Connection state
+*   rx_len:     Size of the next receive
+*   
+* Returns: 0 for success, -1 if no buffer can be allocated
+*/
+int aesdsoc_conn_reserve(aesdsoc_conn_t *conn, int rx_len) {
+    char *new_buffer;
+    int capacity;
+    int needed = conn->wr_pointer + rx_len + 1;
+
+    if (needed <= conn->byte_allocated) {
         return 0;
     }
+    if (needed < conn->byte_allocated * 2) {
+        needed = conn->byte_allocated * 2;
+    }
+    AESDSOC_LOG(LOG_DEBUG, "aesdsocket: file_buffer %d", needed);
+    new_buffer = aesdsoc_buf_get(needed, &capacity);
+    if (new_buffer == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: malloc failed %s", strerror(errno));
+        return -1;
+    }
+    if (aesdsoc_mem_charge(conn, capacity - conn->byte_allocated)) {
+        aesdsoc_metric_add(AESDSOC_METRIC_REJECTED, 1);
+        AESDSOC_LOG(LOG_WARNING, "aesdsocket: no memory budget left for a %d byte packet",
+            conn->wr_pointer + rx_len);
+        aesdsoc_buf_put(new_buffer, capacity);
+        return -1;
+    }
+    memcpy(new_buffer, conn->file_buffer, conn->wr_pointer);
+    aesdsoc_buf_put(conn->file_buffer, conn->byte_allocated);
+    conn->file_buffer = new_buffer;
+    conn->byte_allocated = capacity;
     return 0;
 }
 
+/*
+* aesdsoc_conn_grow
+* Doubles the receive buffer while a packet is incomplete, up to the largest
+* pooled buffer and as long as the memory budget allows, and makes room for
+* it in the packet buffer.
+* 
+* Parameters:
+*   conn:       Connection state
+*   
+* Returns: 0 for success, -1 if the buffers cannot be allocated
+*/
+int aesdsoc_conn_grow(aesdsoc_conn_t *conn) {
+    char *new_buffer;
+    int capacity;
+
+    /* Complete packets leave nothing pending, keep-open clients would
+     * otherwise ratchet up to the largest buffer */
+    if (conn->wr_pointer > 0 && conn->buffer_size < aesdsoc_buf_max_size() &&
+        aesdsoc_mem_charge(conn, conn->buffer_size) == 0) {
+        /* The receive buffer holds no data between receives */
+        new_buffer = aesdsoc_buf_get(conn->buffer_size * 2, &capacity);
+        if (new_buffer == NULL) {                    
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: malloc failed %s", strerror(errno));
+            aesdsoc_mem_uncharge(conn, conn->buffer_size);
+            return -1;
+        }
+        aesdsoc_buf_put(conn->buffer, conn->buffer_size);
+        conn->buffer = new_buffer;
+        conn->buffer_size = capacity;
+        AESDSOC_LOG(LOG_DEBUG, "aesdsocket: buffer %d", conn->buffer_size);
+    }
+    return aesdsoc_conn_reserve(conn, conn->buffer_size);
+}
 
+/*
+* aesdsoc_conn_keep_open
+* 
+* Parameters:
+*   conn:       Connection state
+*   
+* Returns: TRUE when the connection stays open after a reply, for
+*          incremental and binary clients
+*/
+int aesdsoc_conn_keep_open(const aesdsoc_conn_t *conn) {
+    return conn->incremental || conn->binary;
+}
+
+/*
+* aesdsoc_conn_release
+* Closes the client socket, frees the receive buffers and returns the
+* connection slot.
+* 
+* Parameters:
+*   conn:       Connection state
+*   
+* Returns: None
+*/
+void aesdsoc_conn_release(aesdsoc_conn_t *conn) {
+    if (conn->tx_active) {
+        aesdsoc_reply_finish(conn, -1);
+    }
+    close(conn->soc_client);
+    conn->soc_client = -1;
+    aesdsoc_admit_release(conn);
+    aesdsoc_buf_put(conn->buffer, conn->buffer_size);
+    aesdsoc_buf_put(conn->file_buffer, conn->byte_allocated);
+    free(conn->reply_buf);
+    conn->buffer = NULL;
+    conn->file_buffer = NULL;
+    conn->reply_buf = NULL;
+    conn->reply_len = 0;
+    conn->reply_size = 0;
+    conn->buffer_size = 0;
+    conn->byte_allocated = 0;
+    conn->wr_pointer = 0;
+}
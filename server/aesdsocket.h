@@ -0,0 +1,362 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket.h
+* @brief Shared definitions between the aesdsocket server and its
+*        connection engines
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define TRUE                        (1)
+#define FALSE                       (0)
+#define FIXED_RD_BUF_SIZE           (1024)
+/* Buffer size of aesdsoc_addr_text() */
+#define AESDSOC_ADDR_TEXT_SIZE      (INET6_ADDRSTRLEN)
+/* Longest wait for the replies in flight when the server stops */
+#define AESDSOC_DRAIN_MS            (2000)
+
+/* Build with -DUSE_AESD_CHAR_DEVICE=0 to store packets in a plain file by default */
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE        (1)
+#endif
+
+/* Build with USE_IO_URING=1 to add the io_uring engine */
+#ifndef USE_IO_URING
+#define USE_IO_URING                (0)
+#endif
+
+/*
+* Messages above AESDSOC_LOG_LEVEL are compiled out, build with
+* -DAESDSOC_LOG_LEVEL=LOG_DEBUG for the per packet traces. Messages above
+* aesdsoc_log_level are skipped at run time before the arguments are
+* evaluated.
+*/
+#ifndef AESDSOC_LOG_LEVEL
+#define AESDSOC_LOG_LEVEL           (LOG_INFO)
+#endif
+
+#define AESDSOC_LOG(level, ...)                                             \
+    do {                                                                    \
+        if ((level) <= AESDSOC_LOG_LEVEL && (level) <= aesdsoc_log_level) { \
+            aesdsoc_log((level), __VA_ARGS__);                              \
+        }                                                                   \
+    } while (0)
+
+/* Return codes of aesdsoc_conn_receive(), negative values are errors */
+#define AESDSOC_CONN_OPEN           (0)
+#define AESDSOC_CONN_AGAIN          (1)
+#define AESDSOC_CONN_CLOSE          (2)
+/* Non-blocking connections only: waiting for a commit, see
+ * aesdsoc_conn_resume(), or for room in the socket, see aesdsoc_conn_send() */
+#define AESDSOC_CONN_COMMIT         (3)
+#define AESDSOC_CONN_SEND           (4)
+
+/* A packet is queued for the group commit, processing of the receive stops
+ * until it is written */
+#define AESDSOC_STORE_PENDING       (2)
+
+/* Storage sync policy of the group commit */
+#define AESDSOC_SYNC_NONE           (0)
+#define AESDSOC_SYNC_BATCH          (1)
+#define AESDSOC_SYNC_ASYNC          (2)
+
+/*
+* Binary framing, negotiated with the AESDSOCKET_BINARY line. Requests and
+* replies are an AESDSOC_BIN_HDR_SIZE header followed by the payload:
+*   byte 0      opcode, a reply has the request opcode | AESDSOC_BIN_REPLY
+*   byte 1..3   zero
+*   byte 4..7   payload length
+* All numbers are in network byte order.
+*/
+#define AESDSOC_BIN_HDR_SIZE        (8)
+#define AESDSOC_BIN_MAX_PAYLOAD     (16 << 20)
+#define AESDSOC_BIN_VERSION         (1)
+#define AESDSOC_BIN_REPLY           (0x80)
+/* Reply to AESDSOCKET_BINARY, payload u32 version */
+#define AESDSOC_BIN_OP_HELLO        (0x00)
+/* Payload is a record stored as is, empty reply once it is saved */
+#define AESDSOC_BIN_OP_APPEND       (0x01)
+/* Payload u32 write_cmd, u32 write_cmd_offset, reply u64 storage offset */
+#define AESDSOC_BIN_OP_SEEKTO       (0x02)
+/* Payload u64 offset, u64 length or 0 up to the end, reply the data */
+#define AESDSOC_BIN_OP_READ         (0x03)
+/* Reply to a failed or unknown request, payload u32 errno */
+#define AESDSOC_BIN_OP_ERROR        (0xff)
+
+/* Counters of aesdsoc_metric_add() */
+#define AESDSOC_METRIC_ACCEPTED     (0)
+#define AESDSOC_METRIC_BYTES_IN     (1)
+#define AESDSOC_METRIC_BYTES_OUT    (2)
+#define AESDSOC_METRIC_COMMITTED    (3)
+#define AESDSOC_METRIC_SEEKS        (4)
+#define AESDSOC_METRIC_REPLIES      (5)
+#define AESDSOC_METRIC_ERRORS       (6)
+#define AESDSOC_METRIC_REJECTED     (7)
+#define AESDSOC_METRIC_COUNT        (8)
+
+/* Latency histograms of aesdsoc_metric_observe() */
+#define AESDSOC_HIST_RECV_COMMIT    (0)
+#define AESDSOC_HIST_COMMIT_REPLY   (1)
+#define AESDSOC_HIST_COUNT          (2)
+
+/*
+* Per client connection state. Owned by whichever engine serves the client.
+*/
+typedef struct aesdsoc_conn aesdsoc_conn_t;
+typedef struct aesdsoc_snapshot aesdsoc_snapshot_t;
+struct aesdsoc_conn {
+    int soc_client;
+    struct sockaddr_storage aesdsoc_addr;
+    /* Receive buffer and packet buffer, both from the buffer pool */
+    char *buffer;
+    char *file_buffer;
+    int buffer_size;
+    int byte_allocated;
+    int wr_pointer;
+    /* Reply session */
+    int incremental;            /* Only appended data is sent, stays open */
+    int seek_pending;           /* Next reply starts at seek_offset */
+    off_t seek_offset;
+    off_t reply_offset;         /* End of the previous reply */
+    int binary;                 /* Length prefixed frames, stays open */
+    int message;                /* SOCK_SEQPACKET, one message per receive */
+    /* Prepared reply, sent instead of the storage contents when not empty */
+    char *reply_buf;
+    int reply_len;
+    int reply_size;
+    /* Reply being sent, from tx_offset to tx_end of the prepared reply, the
+     * snapshot or the storage */
+    int tx_active;
+    int tx_prepared;
+    int tx_cork;
+    off_t tx_start;
+    off_t tx_offset;
+    off_t tx_end;
+    aesdsoc_snapshot_t *tx_snap;
+    /* Replies and commits return instead of waiting, for event loops */
+    int nonblocking;
+    /* Rest of the receive, processed once the pending commit is written */
+    const char *rx_next;
+    int rx_left;
+    /* Latency timestamps, see aesdsoc_metrics_now() */
+    uint64_t packet_start;
+    uint64_t commit_time;
+    /* Admission control, see aesdsocket_admit.c */
+    int admitted;
+    long mem_charged;
+    /* Optional, saves a complete packet instead of the synchronous write,
+     * returns AESDSOC_STORE_PENDING when it completes later */
+    int (*commit)(aesdsoc_conn_t *conn, const char *data, int len);
+    /* Optional, writes what the commit hook holds back, before a command
+     * that looks at the stored data */
+    int (*commit_sync)(aesdsoc_conn_t *conn);
+    void *engine_data;
+};
+
+/*
+* Connection engine. run() owns the accept loop on soc_server and serves
+* clients until exit_aesd_soc is set.
+*/
+typedef struct aesdsoc_engine {
+    const char *name;
+    int (*run)(int soc_server);
+} aesdsoc_engine_t;
+
+/*
+* Storage backend, selected with -t. The group commit appends batches of
+* complete packets, replies read them back by storage offset.
+*/
+typedef struct aesdsoc_storage {
+    const char *name;
+    int timestamps;             /* A timestamp line is appended periodically */
+    int regular_file;           /* fd() is an O_APPEND file io_uring may write */
+    int sendfile;               /* Replies sendfile() fd(), else share a snapshot */
+    int stable_offsets;         /* Offsets survive dropped data, for incremental */
+    int (*open)(void);
+    void (*close)(int keep);    /* keep: the data stays for the next server */
+    int (*append)(struct iovec *iov, int count);
+    /* Bytes read at start, 0 at the end of the storage, -1 on error */
+    int (*read)(off_t start, char *buf, int len);
+    /* End of the complete packets, -1 if reads return complete packets */
+    off_t (*size)(void);
+    int (*seek)(uint32_t word, uint32_t offset, off_t *pos);
+    int (*flush)(void);
+    /* Descriptor for sendfile() and io_uring, -1 if there is none */
+    int (*fd)(void);
+    /* Offset a reply from start begins at, NULL if it is always start */
+    off_t (*first)(off_t start);
+} aesdsoc_storage_t;
+
+/*
+* Storage contents from start to end read at one group commit generation,
+* shared by the replies of that generation. See aesdsocket_snapshot.c.
+*/
+struct aesdsoc_snapshot {
+    unsigned long generation;
+    off_t start;
+    off_t end;
+    int refs;
+    char *data;
+};
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+extern volatile sig_atomic_t exit_aesd_soc;
+extern int aesdsoc_threads;
+extern int aesdsoc_queue_depth;
+extern int aesdsoc_sync_policy;
+extern int aesdsoc_log_level;
+extern const char *aesdsoc_handoff_path;
+extern int aesdsoc_max_clients;
+extern int aesdsoc_conn_budget;
+extern long aesdsoc_mem_budget;
+extern int aesdsoc_index_persist;
+extern long aesdsoc_segment_size;
+extern long aesdsoc_retain_bytes;
+extern int aesdsoc_retain_age;
+extern long aesdsoc_reply_window;
+
+extern const aesdsoc_storage_t *aesdsoc_storage;
+extern const aesdsoc_storage_t aesdsoc_file_storage;
+extern const aesdsoc_storage_t aesdsoc_device_storage;
+extern const aesdsoc_storage_t aesdsoc_mmap_storage;
+extern const aesdsoc_storage_t aesdsoc_segment_storage;
+extern const aesdsoc_storage_t aesdsoc_ring_storage;
+
+extern const aesdsoc_engine_t aesdsoc_pool_engine;
+extern const aesdsoc_engine_t aesdsoc_epoll_engine;
+#if (USE_IO_URING == 1)
+extern const aesdsoc_engine_t aesdsoc_uring_engine;
+#endif
+
+/*******************************************************************************
+ * Prototypes
+*******************************************************************************/
+int aesdsoc_stop_fd(void);
+void aesdsoc_stop_acceptors(void);
+int aesdsoc_drain_expired(void);
+int aesdsoc_accept(int soc_server, struct sockaddr_storage *aesdsoc_addr);
+int aesdsoc_accepted(int soc_client, const struct sockaddr_storage *aesdsoc_addr);
+const char *aesdsoc_addr_text(const struct sockaddr_storage *aesdsoc_addr, char *text,
+    size_t len);
+int aesdsoc_thread_create(pthread_t *thread, void *(*routine)(void *), void *arg);
+int aesdsoc_conn_init(aesdsoc_conn_t *conn, int soc_client,
+    const struct sockaddr_storage *aesdsoc_addr);
+int aesdsoc_conn_receive(aesdsoc_conn_t *conn);
+int aesdsoc_conn_resume(aesdsoc_conn_t *conn, int commit_rc);
+int aesdsoc_conn_send(aesdsoc_conn_t *conn);
+int aesdsoc_conn_process(aesdsoc_conn_t *conn, char *data, int len);
+int aesdsoc_conn_grow(aesdsoc_conn_t *conn);
+int aesdsoc_conn_reserve(aesdsoc_conn_t *conn, int rx_len);
+int aesdsoc_conn_keep_open(const aesdsoc_conn_t *conn);
+int aesdsoc_conn_store(aesdsoc_conn_t *conn, const char *data, int len);
+int aesdsoc_conn_reply_append(aesdsoc_conn_t *conn, const void *data, int len);
+void aesdsoc_conn_release(aesdsoc_conn_t *conn);
+int aesdsoc_seek(aesdsoc_conn_t *conn, uint32_t word, uint32_t offset);
+off_t aesdsoc_reply_start(aesdsoc_conn_t *conn);
+void aesdsoc_reply_done(aesdsoc_conn_t *conn, off_t end);
+int aesdsoc_reply_read(aesdsoc_conn_t *conn, off_t start, char **reply);
+int aesdsoc_storage_read(aesdsoc_conn_t *conn, off_t start, off_t max, char **data);
+void aesdsoc_count_reply(void);
+
+char *aesdsoc_buf_get(int size, int *capacity);
+void aesdsoc_buf_put(char *data, int capacity);
+int aesdsoc_buf_max_size(void);
+void aesdsoc_buf_stats(unsigned long *hits, unsigned long *misses);
+void aesdsoc_buf_pool_release(void);
+
+void aesdsoc_log(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+int aesdsoc_log_start(void);
+void aesdsoc_log_stop(void);
+int aesdsoc_log_parse_level(const char *name);
+
+const aesdsoc_storage_t *aesdsoc_storage_find(const char *name);
+int aesdsoc_storage_writev(int fd, struct iovec *iov, int count);
+int aesdsoc_index_open(int data_fd, off_t end);
+int aesdsoc_index_open_storage(uint32_t base, off_t start, off_t end);
+int aesdsoc_index_rebuild(int data_fd, off_t end);
+void aesdsoc_index_close(int keep);
+uint32_t aesdsoc_index_drop(off_t start);
+void aesdsoc_index_add(const struct iovec *iov, int count);
+void aesdsoc_index_external(void);
+int aesdsoc_index_seek(uint32_t word, uint32_t offset, off_t *pos);
+
+int aesdsoc_group_commit(const char *data, int len);
+int aesdsoc_group_commit_async(const char *data, int len,
+    void (*complete)(void *arg, int rc), void *arg);
+void aesdsoc_commit_stats(unsigned long *batches, unsigned long *records);
+unsigned long aesdsoc_commit_generation(void);
+
+aesdsoc_snapshot_t *aesdsoc_snapshot_get(off_t start);
+void aesdsoc_snapshot_put(aesdsoc_snapshot_t *snap);
+void aesdsoc_snapshot_release(void);
+void aesdsoc_snapshot_stats(unsigned long *hits, unsigned long *misses);
+
+void aesdsoc_metric_add(int metric, unsigned long value);
+void aesdsoc_metric_observe(int hist, uint64_t ns);
+uint64_t aesdsoc_metrics_now(void);
+unsigned long aesdsoc_metric_total(int metric);
+int aesdsoc_metrics_render(char **text);
+
+int aesdsoc_binary_hello(aesdsoc_conn_t *conn);
+int aesdsoc_binary_process(aesdsoc_conn_t *conn, const char *data, int len);
+
+int aesdsoc_timer_start(void);
+void aesdsoc_timer_stop(void);
+const char *aesdsoc_clock_text(time_t now);
+
+int aesdsoc_handoff_init(void);
+int aesdsoc_handoff_listener(int index);
+int aesdsoc_handoff_listener_count(void);
+int aesdsoc_handoff_start(void);
+void aesdsoc_handoff_stop(void);
+int aesdsoc_handoff_active(void);
+int aesdsoc_handoff_client(int soc_client, const struct sockaddr_storage *aesdsoc_addr,
+    const aesdsoc_conn_t *conn);
+int aesdsoc_handoff_send(const int *listeners, int count);
+int aesdsoc_handoff_take(struct sockaddr_storage *aesdsoc_addr);
+int aesdsoc_handoff_restore(aesdsoc_conn_t *conn);
+
+int aesdsoc_admit_client(aesdsoc_conn_t *conn);
+void aesdsoc_admit_release(aesdsoc_conn_t *conn);
+int aesdsoc_mem_charge(aesdsoc_conn_t *conn, long bytes);
+void aesdsoc_mem_uncharge(aesdsoc_conn_t *conn, long bytes);
+int aesdsoc_admit_check(const aesdsoc_conn_t *conn);
+void aesdsoc_admit_stats(int *clients, long *bytes);
+
+int aesdsoc_scan_newline(const char *data, int len);
+int aesdsoc_parse_seek(const char *args, int len, uint32_t *word, uint32_t *offset);
+
+#endif /* AESDSOCKET_H */
@@ -0,0 +1,171 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_admit.c
+* @brief Admission control and buffer memory budgets for aesdsocket
+*
+* Three optional limits, all off by default:
+*   - aesdsoc_max_clients caps the connections being served. A client above
+*     the cap is closed as soon as it is accepted.
+*   - aesdsoc_conn_budget caps the incomplete packet or binary frame one
+*     client may have buffered. A client that goes above it is closed, a
+*     client that never sends '\n' cannot grow its buffers without bound.
+*   - aesdsoc_mem_budget caps the receive, packet and reply buffers of all
+*     connections together, the storage reads behind replies and the shared
+*     reply snapshot included. Receive buffers stop growing once it is
+*     reached, which only costs more receive calls. A snapshot that does not
+*     fit is not taken, the replies are streamed from the storage. A packet
+*     buffer or reply that does not fit closes its client, or is an error
+*     frame for a binary client, a new client is rejected.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#include <stdio.h>
+#include <syslog.h>
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+/* Limits, 0 = unlimited */
+int aesdsoc_max_clients = 0;
+int aesdsoc_conn_budget = 0;
+long aesdsoc_mem_budget = 0;
+
+/* Connections admitted and bytes charged, updated atomically */
+static int admit_clients = 0;
+static long admit_bytes = 0;
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* aesdsoc_admit_client
+* Counts a new connection against aesdsoc_max_clients.
+*
+* Parameters:
+*   conn:       Connection state, conn->admitted is set on success
+*
+* Returns: 0 for success, -1 if the connection limit is reached
+*/
+int aesdsoc_admit_client(aesdsoc_conn_t *conn) {
+    int clients = __atomic_add_fetch(&admit_clients, 1, __ATOMIC_RELAXED);
+
+    if (aesdsoc_max_clients > 0 && clients > aesdsoc_max_clients) {
+        __atomic_sub_fetch(&admit_clients, 1, __ATOMIC_RELAXED);
+        aesdsoc_metric_add(AESDSOC_METRIC_REJECTED, 1);
+        AESDSOC_LOG(LOG_WARNING, "aesdsocket: connection limit of %d reached",
+            aesdsoc_max_clients);
+        return -1;
+    }
+    conn->admitted = TRUE;
+    return 0;
+}
+
+/*
+* aesdsoc_admit_release
+* Returns the connection slot and every byte charged to the connection.
+*
+* Parameters:
+*   conn:       Connection state
+*
+* Returns: None
+*/
+void aesdsoc_admit_release(aesdsoc_conn_t *conn) {
+    aesdsoc_mem_uncharge(conn, conn->mem_charged);
+    if (conn->admitted) {
+        conn->admitted = FALSE;
+        __atomic_sub_fetch(&admit_clients, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+* aesdsoc_mem_charge
+* Charges buffer memory of a connection against aesdsoc_mem_budget.
+*
+* Parameters:
+*   conn:       Connection state, NULL for memory shared by all of them
+*   bytes:      Number of bytes about to be used, <= 0 is always granted
+*
+* Returns: 0 for success, -1 if the server memory budget is exhausted
+*/
+int aesdsoc_mem_charge(aesdsoc_conn_t *conn, long bytes) {
+    long total = __atomic_add_fetch(&admit_bytes, bytes, __ATOMIC_RELAXED);
+
+    if (bytes > 0 && aesdsoc_mem_budget > 0 && total > aesdsoc_mem_budget) {
+        __atomic_sub_fetch(&admit_bytes, bytes, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (conn != NULL) {
+        conn->mem_charged += bytes;
+    }
+    return 0;
+}
+
+/*
+* aesdsoc_mem_uncharge
+*
+* Parameters:
+*   conn:       Connection state, NULL for memory shared by all of them
+*   bytes:      Number of bytes no longer used by the connection
+*
+* Returns: None
+*/
+void aesdsoc_mem_uncharge(aesdsoc_conn_t *conn, long bytes) {
+    __atomic_sub_fetch(&admit_bytes, bytes, __ATOMIC_RELAXED);
+    if (conn != NULL) {
+        conn->mem_charged -= bytes;
+    }
+}
+
+/*
+* aesdsoc_admit_check
+* Enforces aesdsoc_conn_budget on the incomplete packet of a connection.
+* Called after every receive, so the packet buffer is bounded by the
+* budget plus one receive.
+*
+* Parameters:
+*   conn:       Connection state
+*
+* Returns: 0 for success, -1 if the client has to be closed
+*/
+int aesdsoc_admit_check(const aesdsoc_conn_t *conn) {
+    char peer[AESDSOC_ADDR_TEXT_SIZE];
+
+    if (aesdsoc_conn_budget > 0 && conn->wr_pointer > aesdsoc_conn_budget) {
+        aesdsoc_metric_add(AESDSOC_METRIC_REJECTED, 1);
+        AESDSOC_LOG(LOG_WARNING, "aesdsocket: %s has %d bytes buffered, above %d",
+            aesdsoc_addr_text(&conn->aesdsoc_addr, peer, sizeof(peer)),
+            conn->wr_pointer, aesdsoc_conn_budget);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* aesdsoc_admit_stats
+*
+* Parameters:
+*   clients:    Returns the number of connections being served
+*   bytes:      Returns the buffer memory charged to them
+*
+* Returns: None
+*/
+void aesdsoc_admit_stats(int *clients, long *bytes) {
+    *clients = __atomic_load_n(&admit_clients, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&admit_bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,799 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_bench.c
+* @brief Load generator and latency benchmark for aesdsocket
+*
+* Drives many concurrent non-blocking client connections from one epoll
+* loop. Each request sends one newline terminated packet, optionally split
+* over several send() calls, or an AESDCHAR_IOCSEEKTO command, and waits
+* for the complete reply. By default every request uses its own connection
+* and the reply ends when the server closes it. With -k the connections
+* stay open in AESDSOCKET_INCREMENTAL mode and the reply is complete once
+* the packet comes back. With -B the connections stay open in
+* AESDSOCKET_BINARY mode, every packet is sent as an APPEND frame and the
+* reply is complete once its acknowledgment frame arrived.
+*
+* Prints the throughput and the request latency percentiles.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+* CREDIT: Consulted epoll(7) man page
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define TRUE                        (1)
+#define FALSE                       (0)
+#define BENCH_PORT                  (9000)
+#define BENCH_MAX_EVENTS            (256)
+#define BENCH_RX_SIZE               (65536)
+#define BENCH_TIMEOUT_SCAN_MS       (100)
+#define INCREMENTAL_CMD             ("AESDSOCKET_INCREMENTAL\n")
+#define BINARY_CMD                  ("AESDSOCKET_BINARY\n")
+/* Frame header of the binary mode, see AESDSOC_BIN_* in aesdsocket.h */
+#define BIN_HDR_SIZE                (8)
+#define BIN_OP_APPEND               (0x01)
+/* HELLO reply to BINARY_CMD, header and u32 version */
+#define BIN_HELLO_SIZE              (BIN_HDR_SIZE + 4)
+
+#define DIST_FIXED                  (0)
+#define DIST_UNIFORM                (1)
+#define DIST_EXP                    (2)
+
+#define SLOT_IDLE                   (0)
+#define SLOT_CONNECTING             (1)
+#define SLOT_SENDING                (2)
+#define SLOT_WAITING                (3)     /* Gap between two parts */
+#define SLOT_RECEIVING              (4)
+
+typedef struct bench_slot {
+    int fd;
+    int state;
+    int seek;
+    /* Request being sent, packet includes the newline */
+    char *packet;
+    int len;
+    int sent;
+    int part;
+    uint64_t start_ns;
+    uint64_t resume_ns;
+    /* Keep-alive reply matching, bytes of the current line equal to packet */
+    int match;
+    int line_start;
+    /* Binary mode, reply bytes still expected */
+    int pending;
+} bench_slot_t;
+
+typedef struct bench_config {
+    struct sockaddr_in addr;
+    int conns;
+    long requests;
+    int dist;
+    int size;
+    int min_size;
+    int parts;
+    long gap_us;
+    int seek_pct;
+    int keep_alive;
+    int binary;
+    int timeout_s;
+} bench_config_t;
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+static bench_config_t cfg = {
+    .conns = 100,
+    .requests = 10000,
+    .dist = DIST_FIXED,
+    .size = 64,
+    .min_size = 1,
+    .parts = 1,
+    .gap_us = 0,
+    .seek_pct = 0,
+    .keep_alive = FALSE,
+    .binary = FALSE,
+    .timeout_s = 10,
+};
+static int epoll_fd = -1;
+static long started = 0;
+static long completed = 0;
+static long failed = 0;
+static long seeks = 0;
+static unsigned long long rx_bytes = 0;
+static unsigned long long tx_bytes = 0;
+static uint64_t *latencies = NULL;
+static long latency_count = 0;
+static char rx_buf[BENCH_RX_SIZE];
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* bench_now
+*
+* Parameters: None
+*
+* Returns: Monotonic time in nanoseconds
+*/
+static uint64_t bench_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+* bench_packet_size
+* Draws a packet size, newline included, from the configured distribution.
+*
+* Parameters: None
+*
+* Returns: Packet size in bytes
+*/
+static int bench_packet_size(void) {
+    double u;
+    int size = cfg.size;
+
+    switch (cfg.dist) {
+    case DIST_UNIFORM:
+        size = cfg.min_size + rand() % (cfg.size - cfg.min_size + 1);
+        break;
+    case DIST_EXP:
+        /* Mean cfg.size, at least cfg.min_size */
+        u = (rand() + 1.0) / ((double)RAND_MAX + 2.0);
+        size = cfg.min_size + (int)(-(cfg.size - cfg.min_size) * log(u));
+        break;
+    default:
+        break;
+    }
+    return size;
+}
+
+/*
+* bench_make_request
+* Fills the slot with the next request. Packets start with a tag that is
+* unique over the run, so that a keep-alive client finds its own packet in
+* the incremental reply.
+*
+* Parameters:
+*   slot:       Slot
+*   id:         Request number
+*
+* Returns: 0 for success, -1 on allocation failure
+*/
+static int bench_make_request(bench_slot_t *slot, long id) {
+    uint32_t length;
+    int header = cfg.binary ? BIN_HDR_SIZE : 0;
+    int size;
+    int tag;
+
+    free(slot->packet);
+    slot->packet = NULL;
+    slot->seek = !cfg.keep_alive && cfg.seek_pct > 0 && rand() % 100 < cfg.seek_pct;
+    if (slot->seek) {
+        size = 32;
+        slot->packet = (char *)malloc(size);
+        if (slot->packet == NULL) {
+            return -1;
+        }
+        slot->len = snprintf(slot->packet, size, "AESDCHAR_IOCSEEKTO:%d,%d\n",
+            rand() % 10, 0);
+    }
+    else {
+        size = bench_packet_size();
+        slot->packet = (char *)malloc(header + size + 32);
+        if (slot->packet == NULL) {
+            return -1;
+        }
+        tag = snprintf(slot->packet + header, 32, "%ld:", id);
+        if (size < tag + 1) {
+            size = tag + 1;
+        }
+        memset(slot->packet + header + tag, 'a' + id % 26, size - tag - 1);
+        slot->packet[header + size - 1] = '\n';
+        slot->len = header + size;
+        if (cfg.binary) {
+            memset(slot->packet, 0, BIN_HDR_SIZE);
+            slot->packet[0] = BIN_OP_APPEND;
+            length = htonl(size);
+            memcpy(slot->packet + 4, &length, sizeof(length));
+            slot->pending += BIN_HDR_SIZE;
+        }
+    }
+    slot->sent = 0;
+    slot->part = 0;
+    /* Leftovers of the previous reply may end in the middle of a line */
+    slot->match = slot->line_start ? 0 : -1;
+    slot->start_ns = bench_now();
+    return 0;
+}
+
+/*
+* bench_part_end
+*
+* Parameters:
+*   slot:       Slot
+*
+* Returns: Offset in the request where the current part ends
+*/
+static int bench_part_end(bench_slot_t *slot) {
+    int parts = cfg.parts;
+
+    if (slot->seek || parts > slot->len) {
+        parts = slot->seek ? 1 : slot->len;
+    }
+    return (int)((long)slot->len * (slot->part + 1) / parts);
+}
+
+/*
+* bench_watch
+* Changes the socket events a slot waits for.
+*
+* Parameters:
+*   slot:       Slot
+*   events:     epoll events, 0 to stop watching the socket
+*
+* Returns: None
+*/
+static void bench_watch(bench_slot_t *slot, uint32_t events) {
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = slot;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, slot->fd, &ev) < 0) {
+        perror("epoll_ctl");
+    }
+}
+
+/*
+* bench_close
+*
+* Parameters:
+*   slot:       Slot
+*
+* Returns: None
+*/
+static void bench_close(bench_slot_t *slot) {
+    if (slot->fd >= 0) {
+        close(slot->fd);
+    }
+    slot->fd = -1;
+    slot->state = SLOT_IDLE;
+}
+
+/*
+* bench_finish
+* Records a finished request.
+*
+* Parameters:
+*   slot:       Slot
+*   ok:         TRUE when the complete reply was received
+*
+* Returns: None
+*/
+static void bench_finish(bench_slot_t *slot, int ok) {
+    completed++;
+    if (!ok) {
+        failed++;
+        bench_close(slot);
+        return;
+    }
+    latencies[latency_count++] = bench_now() - slot->start_ns;
+    if (slot->seek) {
+        seeks++;
+    }
+}
+
+/*
+* bench_start
+* Starts the next request on a slot, connecting first if needed.
+*
+* Parameters:
+*   slot:       Slot
+*
+* Returns: None
+*/
+static void bench_start(bench_slot_t *slot) {
+    struct epoll_event ev;
+    int one = 1;
+
+    if (bench_make_request(slot, started++)) {
+        fprintf(stderr, "aesdsocket_bench: malloc failed\n");
+        bench_finish(slot, FALSE);
+        return;
+    }
+    if (slot->fd >= 0) {
+        slot->state = SLOT_SENDING;
+        bench_watch(slot, EPOLLOUT);
+        return;
+    }
+    slot->line_start = TRUE;
+    slot->match = 0;
+    /* The request is already counted */
+    slot->pending = cfg.binary ? BIN_HDR_SIZE + BIN_HELLO_SIZE : 0;
+    slot->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (slot->fd < 0) {
+        perror("socket");
+        bench_finish(slot, FALSE);
+        return;
+    }
+    setsockopt(slot->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(slot->fd, (struct sockaddr *)&cfg.addr, sizeof(cfg.addr)) < 0 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        bench_finish(slot, FALSE);
+        return;
+    }
+    slot->state = SLOT_CONNECTING;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = slot;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, slot->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        bench_finish(slot, FALSE);
+    }
+}
+
+/*
+* bench_send
+* Sends the current part of the request.
+*
+* Parameters:
+*   slot:       Slot
+*
+* Returns: None
+*/
+static void bench_send(bench_slot_t *slot) {
+    int end = bench_part_end(slot);
+    ssize_t sent;
+
+    while (slot->sent < end) {
+        sent = send(slot->fd, slot->packet + slot->sent, end - slot->sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return;
+            }
+            bench_finish(slot, FALSE);
+            return;
+        }
+        slot->sent += sent;
+        tx_bytes += sent;
+    }
+    if (slot->sent == slot->len) {
+        slot->state = SLOT_RECEIVING;
+        bench_watch(slot, EPOLLIN);
+        return;
+    }
+    /* Next part on a later pass, so that it goes out as its own segment */
+    slot->part++;
+    if (cfg.gap_us > 0) {
+        slot->state = SLOT_WAITING;
+        slot->resume_ns = bench_now() + cfg.gap_us * 1000;
+        bench_watch(slot, 0);
+    }
+}
+
+/*
+* bench_match
+* Looks for the request packet as a complete line of an incremental reply.
+*
+* Parameters:
+*   slot:       Slot
+*   data:       Received data
+*   len:        Number of bytes in data
+*
+* Returns: TRUE once the packet was found
+*/
+static int bench_match(bench_slot_t *slot, const char *data, ssize_t len) {
+    slot->line_start = (data[len - 1] == '\n');
+    for (ssize_t i = 0; i < len; i++) {
+        if (data[i] == '\n') {
+            if (slot->match == slot->len - 1) {
+                return TRUE;
+            }
+            slot->match = 0;
+        }
+        else if (slot->match >= 0 && slot->match < slot->len - 1 &&
+            data[i] == slot->packet[slot->match]) {
+            slot->match++;
+        }
+        else {
+            slot->match = -1;
+        }
+    }
+    return FALSE;
+}
+
+/*
+* bench_receive
+* Reads the reply. A one-shot reply ends when the server closes the
+* connection.
+*
+* Parameters:
+*   slot:       Slot
+*
+* Returns: None
+*/
+static void bench_receive(bench_slot_t *slot) {
+    ssize_t len;
+
+    while (1) {
+        len = recv(slot->fd, rx_buf, sizeof(rx_buf), 0);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return;
+            }
+            bench_finish(slot, FALSE);
+            return;
+        }
+        if (len == 0) {
+            bench_finish(slot, !cfg.keep_alive);
+            bench_close(slot);
+            return;
+        }
+        rx_bytes += len;
+        if (cfg.binary) {
+            slot->pending -= len;
+            if (slot->pending < 0) {
+                bench_finish(slot, FALSE);
+                return;
+            }
+        }
+        if ((cfg.binary && slot->pending == 0) ||
+            (!cfg.binary && cfg.keep_alive && bench_match(slot, rx_buf, len))) {
+            bench_finish(slot, TRUE);
+            slot->state = SLOT_IDLE;
+            bench_watch(slot, 0);
+            return;
+        }
+    }
+}
+
+/*
+* bench_connected
+* Completes a non-blocking connect.
+*
+* Parameters:
+*   slot:       Slot
+*
+* Returns: None
+*/
+static void bench_connected(bench_slot_t *slot) {
+    const char *mode = cfg.binary ? BINARY_CMD : INCREMENTAL_CMD;
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (getsockopt(slot->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        fprintf(stderr, "aesdsocket_bench: connect failed %s\n", strerror(err));
+        bench_finish(slot, FALSE);
+        return;
+    }
+    if (cfg.keep_alive &&
+        send(slot->fd, mode, strlen(mode), MSG_NOSIGNAL) != (ssize_t)strlen(mode)) {
+        bench_finish(slot, FALSE);
+        return;
+    }
+    slot->state = SLOT_SENDING;
+    bench_send(slot);
+}
+
+/*
+* bench_timers
+* Resumes slots after the gap between two parts and fails requests that
+* took longer than the timeout.
+*
+* Parameters:
+*   slots:      Slots
+*   now:        Current time
+*   scan:       TRUE to check the request timeout too
+*
+* Returns: None
+*/
+static void bench_timers(bench_slot_t *slots, uint64_t now, int scan) {
+    uint64_t timeout_ns = (uint64_t)cfg.timeout_s * 1000000000ULL;
+
+    for (int i = 0; i < cfg.conns; i++) {
+        bench_slot_t *slot = &slots[i];
+
+        if (slot->state == SLOT_WAITING && now >= slot->resume_ns) {
+            slot->state = SLOT_SENDING;
+            bench_watch(slot, EPOLLOUT);
+        }
+        else if (scan && slot->state != SLOT_IDLE && now - slot->start_ns > timeout_ns) {
+            fprintf(stderr, "aesdsocket_bench: request timed out\n");
+            bench_finish(slot, FALSE);
+        }
+    }
+}
+
+/*
+* bench_compare
+* qsort() comparison of two latencies.
+*
+* Parameters:
+*   a:          First latency
+*   b:          Second latency
+*
+* Returns: Negative, zero or positive like strcmp()
+*/
+static int bench_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+* bench_percentile
+*
+* Parameters:
+*   p:          Percentile, 0 to 100
+*
+* Returns: Latency in microseconds, latencies must be sorted
+*/
+static double bench_percentile(double p) {
+    long index = (long)(p / 100.0 * latency_count);
+
+    if (latency_count == 0) {
+        return 0;
+    }
+    if (index >= latency_count) {
+        index = latency_count - 1;
+    }
+    return latencies[index] / 1000.0;
+}
+
+/*
+* bench_report
+*
+* Parameters:
+*   elapsed_ns: Duration of the run
+*
+* Returns: None
+*/
+static void bench_report(uint64_t elapsed_ns) {
+    double seconds = elapsed_ns / 1e9;
+    double sum = 0;
+
+    qsort(latencies, latency_count, sizeof(latencies[0]), bench_compare);
+    for (long i = 0; i < latency_count; i++) {
+        sum += latencies[i];
+    }
+    printf("requests %ld, ok %ld, failed %ld, seeks %ld\n",
+        completed, completed - failed, failed, seeks);
+    printf("elapsed %.3f s, %.1f requests/s, tx %.2f MB/s, rx %.2f MB/s\n",
+        seconds, completed / seconds, tx_bytes / seconds / 1e6, rx_bytes / seconds / 1e6);
+    printf("latency us: mean %.1f, p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+        latency_count ? sum / latency_count / 1000.0 : 0.0, bench_percentile(50),
+        bench_percentile(99), bench_percentile(99.9), bench_percentile(100));
+}
+
+/*
+* bench_raise_fd_limit
+* Allows as many open files as the hard limit, thousands of connections
+* need more than the usual default of 1024.
+*
+* Parameters: None
+*
+* Returns: None
+*/
+static void bench_raise_fd_limit(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/*
+* Main function of the benchmark
+*
+* Parameters:
+*   argc:   Number of arguments
+*   argv:   Options
+*           -H addr     : Server IPv4 address, default 127.0.0.1
+*           -P port     : Server port, default 9000
+*           -c conns    : Concurrent connections, default 100
+*           -n count    : Requests to send, default 10000
+*           -D dist     : Packet size distribution, fixed, uniform or exp
+*           -s size     : Packet size, maximum for uniform, mean for exp,
+*                         newline included, default 64
+*           -m size     : Minimum packet size for uniform and exp, default 1
+*           -p parts    : send() calls per packet, default 1
+*           -g usec     : Gap between the parts of a packet, default 0
+*           -S percent  : Share of AESDCHAR_IOCSEEKTO requests, default 0
+*           -k          : Keep connections open in incremental mode, no seeks
+*           -B          : Keep connections open in binary mode, no seeks
+*           -t sec      : Request timeout, default 10
+*
+* Returns: 0 when all requests succeeded, 1 otherwise
+*/
+int main(int argc, char **argv)
+{
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    bench_slot_t *slots = NULL;
+    uint64_t begin;
+    uint64_t now;
+    uint64_t last_scan;
+    int port = BENCH_PORT;
+    const char *host = "127.0.0.1";
+    int timeout_ms;
+    int count;
+    int opt;
+    int rc = 1;
+
+    while ((opt = getopt(argc, argv, "H:P:c:n:D:s:m:p:g:S:kBt:")) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'P':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            cfg.conns = atoi(optarg);
+            break;
+        case 'n':
+            cfg.requests = atol(optarg);
+            break;
+        case 'D':
+            if (strcmp(optarg, "fixed") == 0) {
+                cfg.dist = DIST_FIXED;
+            }
+            else if (strcmp(optarg, "uniform") == 0) {
+                cfg.dist = DIST_UNIFORM;
+            }
+            else if (strcmp(optarg, "exp") == 0) {
+                cfg.dist = DIST_EXP;
+            }
+            else {
+                goto usage;
+            }
+            break;
+        case 's':
+            cfg.size = atoi(optarg);
+            break;
+        case 'm':
+            cfg.min_size = atoi(optarg);
+            break;
+        case 'p':
+            cfg.parts = atoi(optarg);
+            break;
+        case 'g':
+            cfg.gap_us = atol(optarg);
+            break;
+        case 'S':
+            cfg.seek_pct = atoi(optarg);
+            break;
+        case 'k':
+            cfg.keep_alive = TRUE;
+            break;
+        case 'B':
+            cfg.keep_alive = TRUE;
+            cfg.binary = TRUE;
+            break;
+        case 't':
+            cfg.timeout_s = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (cfg.conns <= 0 || cfg.requests <= 0 || cfg.size <= 0 || cfg.min_size <= 0 ||
+        cfg.min_size > cfg.size || cfg.parts <= 0 || cfg.gap_us < 0 ||
+        cfg.timeout_s <= 0 || port <= 0) {
+        goto usage;
+    }
+    memset(&cfg.addr, 0, sizeof(cfg.addr));
+    cfg.addr.sin_family = AF_INET;
+    cfg.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &cfg.addr.sin_addr) != 1) {
+        fprintf(stderr, "aesdsocket_bench: invalid address %s\n", host);
+        goto usage;
+    }
+
+    bench_raise_fd_limit();
+    srand(1);
+    latencies = (uint64_t *)malloc(cfg.requests * sizeof(uint64_t));
+    slots = (bench_slot_t *)calloc(cfg.conns, sizeof(bench_slot_t));
+    epoll_fd = epoll_create1(0);
+    if (latencies == NULL || slots == NULL || epoll_fd < 0) {
+        perror("aesdsocket_bench");
+        goto error;
+    }
+    for (int i = 0; i < cfg.conns; i++) {
+        slots[i].fd = -1;
+    }
+
+    begin = bench_now();
+    last_scan = begin;
+    while (completed < cfg.requests) {
+        for (int i = 0; i < cfg.conns && started < cfg.requests; i++) {
+            if (slots[i].state == SLOT_IDLE) {
+                bench_start(&slots[i]);
+            }
+        }
+        timeout_ms = (cfg.gap_us > 0) ? 1 : BENCH_TIMEOUT_SCAN_MS;
+        count = epoll_wait(epoll_fd, events, BENCH_MAX_EVENTS, timeout_ms);
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            goto error;
+        }
+        for (int i = 0; i < count; i++) {
+            bench_slot_t *slot = (bench_slot_t *)events[i].data.ptr;
+
+            switch (slot->state) {
+            case SLOT_CONNECTING:
+                bench_connected(slot);
+                break;
+            case SLOT_SENDING:
+                bench_send(slot);
+                break;
+            case SLOT_RECEIVING:
+                bench_receive(slot);
+                break;
+            default:
+                break;
+            }
+        }
+        now = bench_now();
+        if (cfg.gap_us > 0 || now - last_scan >= BENCH_TIMEOUT_SCAN_MS * 1000000ULL) {
+            bench_timers(slots, now, now - last_scan >= BENCH_TIMEOUT_SCAN_MS * 1000000ULL);
+            if (now - last_scan >= BENCH_TIMEOUT_SCAN_MS * 1000000ULL) {
+                last_scan = now;
+            }
+        }
+    }
+    bench_report(bench_now() - begin);
+    rc = (failed == 0) ? 0 : 1;
+
+error:
+    if (slots != NULL) {
+        for (int i = 0; i < cfg.conns; i++) {
+            bench_close(&slots[i]);
+            free(slots[i].packet);
+        }
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    free(slots);
+    free(latencies);
+    return rc;
+
+usage:
+    fprintf(stderr, "Usage: %s [-H addr] [-P port] [-c conns] [-n count] "
+        "[-D fixed|uniform|exp] [-s size] [-m size] [-p parts] [-g usec] "
+        "[-S percent] [-k] [-B] [-t sec]\n", argv[0]);
+    return 1;
+}
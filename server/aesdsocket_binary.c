@@ -0,0 +1,337 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_binary.c
+* @brief Length prefixed binary framing of aesdsocket
+*
+* A client sends the AESDSOCKET_BINARY line to switch its connection to
+* frames, see AESDSOC_BIN_* in aesdsocket.h. The server answers with a HELLO
+* frame and keeps the connection open. Frames need no scanning for a
+* delimiter and records may contain any byte. Every request gets exactly
+* one reply frame, so a client can pipeline requests and match the replies
+* in order.
+*
+* A frame received in one piece is handled straight from the receive
+* buffer, a partial frame is collected in the packet buffer of the
+* connection like a partial line.
+*
+* The char device completes a write command at a newline only, so records
+* appended to it should end with one to be visible to READ and SEEKTO.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define BIN_SEEKTO_SIZE             (8)
+#define BIN_READ_SIZE               (16)
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* aesdsoc_binary_length
+*
+* Parameters:
+*   header:     Frame header, AESDSOC_BIN_HDR_SIZE bytes
+*
+* Returns: Payload length, or -1 if it is above AESDSOC_BIN_MAX_PAYLOAD
+*/
+static int aesdsoc_binary_length(const char *header) {
+    uint32_t len;
+
+    memcpy(&len, header + 4, sizeof(len));
+    len = ntohl(len);
+    if (len > AESDSOC_BIN_MAX_PAYLOAD) {
+        return -1;
+    }
+    return (int)len;
+}
+
+/*
+* aesdsoc_binary_reply
+* Adds a reply frame to the prepared reply of the connection.
+*
+* Parameters:
+*   conn:       Connection state
+*   opcode:     AESDSOC_BIN_OP_* of the request
+*   payload:    Reply payload, may be NULL when len is 0
+*   len:        Payload length in bytes
+*
+* Returns: 0 for success, -1 on allocation failure
+*/
+static int aesdsoc_binary_reply(aesdsoc_conn_t *conn, int opcode,
+    const void *payload, int len) {
+
+    char header[AESDSOC_BIN_HDR_SIZE];
+    uint32_t length = htonl((uint32_t)len);
+
+    memset(header, 0, sizeof(header));
+    header[0] = (char)(opcode | AESDSOC_BIN_REPLY);
+    memcpy(header + 4, &length, sizeof(length));
+    if (aesdsoc_conn_reply_append(conn, header, sizeof(header))) {
+        return -1;
+    }
+    if (len > 0 && aesdsoc_conn_reply_append(conn, payload, len)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* aesdsoc_binary_error
+*
+* Parameters:
+*   conn:       Connection state
+*   error:      errno value reported to the client
+*
+* Returns: 0 for success, -1 on allocation failure
+*/
+static int aesdsoc_binary_error(aesdsoc_conn_t *conn, int error) {
+    uint32_t code = htonl((uint32_t)error);
+
+    aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+    return aesdsoc_binary_reply(conn, AESDSOC_BIN_OP_ERROR, &code, sizeof(code));
+}
+
+/*
+* aesdsoc_binary_seekto
+* Runs AESDCHAR_IOCSEEKTO and returns the resulting storage offset.
+*
+* Parameters:
+*   conn:       Connection state
+*   payload:    u32 write_cmd, u32 write_cmd_offset
+*   len:        Payload length in bytes
+*
+* Returns: 0 for success, -1 on allocation failure
+*/
+static int aesdsoc_binary_seekto(aesdsoc_conn_t *conn, const char *payload, int len) {
+    uint32_t word;
+    uint32_t offset;
+    uint64_t position;
+    int rc;
+
+    if (len != BIN_SEEKTO_SIZE) {
+        return aesdsoc_binary_error(conn, EINVAL);
+    }
+    memcpy(&word, payload, sizeof(word));
+    memcpy(&offset, payload + 4, sizeof(offset));
+    rc = aesdsoc_seek(conn, ntohl(word), ntohl(offset));
+    /* The offset is in the reply, the next READ says where to start */
+    conn->seek_pending = FALSE;
+    if (rc < 0) {
+        return aesdsoc_binary_error(conn, EINVAL);
+    }
+    position = htobe64((uint64_t)conn->seek_offset);
+    return aesdsoc_binary_reply(conn, AESDSOC_BIN_OP_SEEKTO, &position, sizeof(position));
+}
+
+/*
+* aesdsoc_binary_read
+* Returns a range of the storage, at most AESDSOC_BIN_MAX_PAYLOAD bytes.
+*
+* Parameters:
+*   conn:       Connection state
+*   payload:    u64 offset, u64 length or 0 up to the end
+*   len:        Payload length in bytes
+*
+* Returns: 0 for success, -1 on allocation failure
+*/
+static int aesdsoc_binary_read(aesdsoc_conn_t *conn, const char *payload, int len) {
+    uint64_t offset;
+    uint64_t length;
+    char *data;
+    int data_len;
+    int rc;
+
+    if (len != BIN_READ_SIZE) {
+        return aesdsoc_binary_error(conn, EINVAL);
+    }
+    memcpy(&offset, payload, sizeof(offset));
+    memcpy(&length, payload + 8, sizeof(length));
+    offset = be64toh(offset);
+    length = be64toh(length);
+    if (offset > INT64_MAX) {
+        return aesdsoc_binary_error(conn, EINVAL);
+    }
+    if (length == 0 || length > AESDSOC_BIN_MAX_PAYLOAD) {
+        length = AESDSOC_BIN_MAX_PAYLOAD;
+    }
+    data_len = aesdsoc_storage_read(conn, (off_t)offset, (off_t)length, &data);
+    if (data_len < 0) {
+        return aesdsoc_binary_error(conn, (errno == ENOBUFS) ? ENOBUFS : EIO);
+    }
+    rc = aesdsoc_binary_reply(conn, AESDSOC_BIN_OP_READ, data, data_len);
+    free(data);
+    aesdsoc_mem_uncharge(conn, data_len);
+    return rc;
+}
+
+/*
+* aesdsoc_binary_frame
+* Handles one complete request frame.
+*
+* Parameters:
+*   conn:       Connection state
+*   frame:      Header and payload
+*   len:        Payload length in bytes
+*
+* Returns: 0 for success, AESDSOC_STORE_PENDING while an appended payload
+*          waits for its commit and negative value on error
+*/
+static int aesdsoc_binary_frame(aesdsoc_conn_t *conn, const char *frame, int len) {
+    const char *payload = frame + AESDSOC_BIN_HDR_SIZE;
+    int opcode = (unsigned char)frame[0];
+    int rc;
+
+    switch (opcode) {
+    case AESDSOC_BIN_OP_APPEND:
+        rc = 0;
+        if (len > 0) {
+            rc = aesdsoc_conn_store(conn, payload, len);
+            if (rc < 0) {
+                return rc;
+            }
+        }
+        /* Sent once the payload is written */
+        if (aesdsoc_binary_reply(conn, opcode, NULL, 0) < 0) {
+            return -1;
+        }
+        return rc;
+    case AESDSOC_BIN_OP_SEEKTO:
+        return aesdsoc_binary_seekto(conn, payload, len);
+    case AESDSOC_BIN_OP_READ:
+        return aesdsoc_binary_read(conn, payload, len);
+    default:
+        AESDSOC_LOG(LOG_INFO, "aesdsocket: unknown binary opcode %d", opcode);
+        return aesdsoc_binary_error(conn, EINVAL);
+    }
+}
+
+/*
+* aesdsoc_binary_hello
+* Prepares the HELLO frame that confirms the switch to binary framing.
+*
+* Parameters:
+*   conn:       Connection state
+*
+* Returns: 0 for success, -1 on allocation failure
+*/
+int aesdsoc_binary_hello(aesdsoc_conn_t *conn) {
+    uint32_t version = htonl(AESDSOC_BIN_VERSION);
+
+    return aesdsoc_binary_reply(conn, AESDSOC_BIN_OP_HELLO, &version, sizeof(version));
+}
+
+/*
+* aesdsoc_binary_process
+* Splits received data into frames and prepares their replies. The partial
+* frame is kept in file_buffer at index wr_pointer.
+*
+* Parameters:
+*   conn:       Connection state
+*   data:       Received data
+*   len:        Number of bytes in data
+*
+* Returns: 1 when a reply is prepared, 0 when more data is expected,
+*          AESDSOC_STORE_PENDING when an appended payload waits for its
+*          commit, the rest of the data is kept in rx_next, and negative
+*          value on error
+*/
+int aesdsoc_binary_process(aesdsoc_conn_t *conn, const char *data, int len) {
+    char *file_buffer = conn->file_buffer;
+    int *wr_pointer = &conn->wr_pointer;
+    int replied = 0;
+    int payload_len;
+    int needed;
+    int rc;
+
+    while (len > 0) {
+        if (*wr_pointer == 0 && len >= AESDSOC_BIN_HDR_SIZE) {
+            payload_len = aesdsoc_binary_length(data);
+            if (payload_len < 0) {
+                goto oversize;
+            }
+            if (len >= AESDSOC_BIN_HDR_SIZE + payload_len) {
+                /* Complete frame in the receive buffer */
+                rc = aesdsoc_binary_frame(conn, data, payload_len);
+                if (rc < 0) {
+                    return rc;
+                }
+                replied = 1;
+                data += AESDSOC_BIN_HDR_SIZE + payload_len;
+                len -= AESDSOC_BIN_HDR_SIZE + payload_len;
+                if (rc == AESDSOC_STORE_PENDING) {
+                    goto pending;
+                }
+                continue;
+            }
+        }
+
+        /* Collect the header first, then the rest of the frame */
+        needed = AESDSOC_BIN_HDR_SIZE - *wr_pointer;
+        if (*wr_pointer >= AESDSOC_BIN_HDR_SIZE) {
+            payload_len = aesdsoc_binary_length(file_buffer);
+            needed = AESDSOC_BIN_HDR_SIZE + payload_len - *wr_pointer;
+        }
+        if (needed > len) {
+            needed = len;
+        }
+        memcpy(&file_buffer[*wr_pointer], data, needed);
+        *wr_pointer += needed;
+        data += needed;
+        len -= needed;
+        if (*wr_pointer < AESDSOC_BIN_HDR_SIZE) {
+            break;
+        }
+        payload_len = aesdsoc_binary_length(file_buffer);
+        if (payload_len < 0) {
+            goto oversize;
+        }
+        if (*wr_pointer == AESDSOC_BIN_HDR_SIZE + payload_len) {
+            rc = aesdsoc_binary_frame(conn, file_buffer, payload_len);
+            if (rc < 0) {
+                return rc;
+            }
+            replied = 1;
+            *wr_pointer = 0;
+            if (rc == AESDSOC_STORE_PENDING) {
+                goto pending;
+            }
+        }
+    }
+    return replied;
+
+pending:
+    /* A READ frame further on has to see the payload */
+    conn->rx_next = data;
+    conn->rx_left = len;
+    return AESDSOC_STORE_PENDING;
+
+oversize:
+    AESDSOC_LOG(LOG_ERR, "aesdsocket: binary frame above %d bytes", AESDSOC_BIN_MAX_PAYLOAD);
+    return -1;
+}
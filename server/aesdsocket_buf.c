@@ -0,0 +1,208 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_buf.c
+* @brief Receive and packet buffer pool for aesdsocket connections
+*
+* Buffers come in power of two size classes from FIXED_RD_BUF_SIZE up to
+* BUF_POOL_MAX_SIZE. A released buffer is kept on the free list of its class
+* and handed to the next connection, so a busy server stops calling malloc()
+* and free() for every client. Larger buffers bypass the pool.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define BUF_POOL_CLASSES            (8)
+#define BUF_POOL_MAX_SIZE           (FIXED_RD_BUF_SIZE << (BUF_POOL_CLASSES - 1))
+/* Free buffers kept per class, the rest goes back to malloc */
+#define BUF_POOL_MAX_FREE           (64)
+
+/* A free buffer stores the free list link in its own first bytes */
+typedef struct aesdsoc_buf_free {
+    struct aesdsoc_buf_free *next;
+} aesdsoc_buf_free_t;
+
+typedef struct aesdsoc_buf_class {
+    pthread_mutex_t mutex;
+    aesdsoc_buf_free_t *free_list;
+    int free_count;
+} aesdsoc_buf_class_t;
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+static aesdsoc_buf_class_t buf_classes[BUF_POOL_CLASSES] = {
+    [0 ... BUF_POOL_CLASSES - 1] = { .mutex = PTHREAD_MUTEX_INITIALIZER },
+};
+static unsigned long buf_hits = 0;
+static unsigned long buf_misses = 0;
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* aesdsoc_buf_class
+*
+* Parameters:
+*   size:       Requested size in bytes
+*
+* Returns: Index of the smallest class holding size, or -1 if it is too large
+*/
+static int aesdsoc_buf_class(int size) {
+    int index = 0;
+    int class_size = FIXED_RD_BUF_SIZE;
+
+    while (class_size < size) {
+        if (++index == BUF_POOL_CLASSES) {
+            return -1;
+        }
+        class_size <<= 1;
+    }
+    return index;
+}
+
+/*
+* aesdsoc_buf_get
+* Takes a buffer of at least size bytes from the pool.
+*
+* Parameters:
+*   size:       Requested size in bytes
+*   capacity:   Returns the real size of the buffer, needed by aesdsoc_buf_put
+*
+* Returns: Buffer, or NULL if it cannot be allocated
+*/
+char *aesdsoc_buf_get(int size, int *capacity) {
+    aesdsoc_buf_class_t *buf_class;
+    aesdsoc_buf_free_t *buf = NULL;
+    int index = aesdsoc_buf_class(size);
+
+    if (index < 0) {
+        __atomic_add_fetch(&buf_misses, 1, __ATOMIC_RELAXED);
+        *capacity = size;
+        return (char *)malloc(size);
+    }
+    buf_class = &buf_classes[index];
+    pthread_mutex_lock(&buf_class->mutex);
+    buf = buf_class->free_list;
+    if (buf != NULL) {
+        buf_class->free_list = buf->next;
+        buf_class->free_count--;
+    }
+    pthread_mutex_unlock(&buf_class->mutex);
+
+    *capacity = FIXED_RD_BUF_SIZE << index;
+    if (buf != NULL) {
+        __atomic_add_fetch(&buf_hits, 1, __ATOMIC_RELAXED);
+        return (char *)buf;
+    }
+    __atomic_add_fetch(&buf_misses, 1, __ATOMIC_RELAXED);
+    return (char *)malloc(*capacity);
+}
+
+/*
+* aesdsoc_buf_put
+* Returns a buffer from aesdsoc_buf_get() to the pool.
+*
+* Parameters:
+*   data:       Buffer, NULL is ignored
+*   capacity:   Capacity returned by aesdsoc_buf_get
+*
+* Returns: None
+*/
+void aesdsoc_buf_put(char *data, int capacity) {
+    aesdsoc_buf_class_t *buf_class;
+    aesdsoc_buf_free_t *buf = (aesdsoc_buf_free_t *)data;
+    int index = aesdsoc_buf_class(capacity);
+
+    if (data == NULL) {
+        return;
+    }
+    if (index < 0 || (FIXED_RD_BUF_SIZE << index) != capacity) {
+        free(data);
+        return;
+    }
+    buf_class = &buf_classes[index];
+    pthread_mutex_lock(&buf_class->mutex);
+    if (buf_class->free_count < BUF_POOL_MAX_FREE) {
+        buf->next = buf_class->free_list;
+        buf_class->free_list = buf;
+        buf_class->free_count++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&buf_class->mutex);
+    free(buf);
+}
+
+/*
+* aesdsoc_buf_max_size
+*
+* Parameters: None
+*
+* Returns: Size of the largest pooled buffer
+*/
+int aesdsoc_buf_max_size(void) {
+    return BUF_POOL_MAX_SIZE;
+}
+
+/*
+* aesdsoc_buf_stats
+*
+* Parameters:
+*   hits:       Returns the number of requests served from a free list
+*   misses:     Returns the number of requests that needed malloc()
+*
+* Returns: None
+*/
+void aesdsoc_buf_stats(unsigned long *hits, unsigned long *misses) {
+    *hits = __atomic_load_n(&buf_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&buf_misses, __ATOMIC_RELAXED);
+}
+
+/*
+* aesdsoc_buf_pool_release
+* Logs the pool statistics and frees all cached buffers. Called at exit once
+* no connection is left.
+*
+* Parameters: None
+*
+* Returns: None
+*/
+void aesdsoc_buf_pool_release(void) {
+    aesdsoc_buf_free_t *buf;
+    unsigned long hits;
+    unsigned long misses;
+
+    aesdsoc_buf_stats(&hits, &misses);
+    AESDSOC_LOG(LOG_INFO, "aesdsocket: buffer pool %lu hits, %lu misses", hits, misses);
+    for (int i = 0; i < BUF_POOL_CLASSES; i++) {
+        pthread_mutex_lock(&buf_classes[i].mutex);
+        while ((buf = buf_classes[i].free_list) != NULL) {
+            buf_classes[i].free_list = buf->next;
+            free(buf);
+        }
+        buf_classes[i].free_count = 0;
+        pthread_mutex_unlock(&buf_classes[i].mutex);
+    }
+}
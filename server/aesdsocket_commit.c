@@ -0,0 +1,345 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_commit.c
+* @brief Group commit of complete packets to the storage
+*
+* A client thread with a complete packet queues it and waits. If no flush
+* is running, the thread becomes the flusher: it takes every packet queued
+* so far, appends them to the storage backend in one call, a writev() for
+* the file and the char device, and optionally flushes it, then wakes all
+* their owners. Packets queued meanwhile go out with the next
+* batch, so the number of write system calls follows the load instead of
+* the number of packets.
+*
+* The packet data is not copied, it stays in the connection buffer of the
+* waiting client until the batch is written. On the char device writev()
+* calls the driver write once per packet, so every packet is still one
+* write command.
+*
+* Event loops queue their packets without waiting, and are completed
+* through a callback. A flusher writes one batch only, so an event loop
+* thread that found no flush running is back in its loop after it. Packets
+* queued without waiting meanwhile are written by the commit thread, since
+* no waiting thread may be left to take over for them.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "queue.h"
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+/* Packets written by one writev() call */
+#define COMMIT_MAX_IOV              (256)
+
+typedef struct aesdsoc_commit_req {
+    const char *data;
+    int len;
+    int done;
+    int rc;
+    /* Asynchronous request, freed after the callback */
+    void (*complete)(void *arg, int rc);
+    void *arg;
+    STAILQ_ENTRY(aesdsoc_commit_req) entries;
+} aesdsoc_commit_req_t;
+
+STAILQ_HEAD(commit_queue, aesdsoc_commit_req);
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+int aesdsoc_sync_policy = AESDSOC_SYNC_NONE;
+
+static pthread_mutex_t commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static struct commit_queue commit_pending = STAILQ_HEAD_INITIALIZER(commit_pending);
+static int commit_flushing = FALSE;
+/* Asynchronous requests in commit_pending, the commit thread takes them */
+static int commit_async = 0;
+static pthread_cond_t commit_wake = PTHREAD_COND_INITIALIZER;
+static int commit_thread_running = FALSE;
+static unsigned long commit_batches = 0;
+static unsigned long commit_records = 0;
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* aesdsoc_commit_flush
+* Writes a batch of packets to the storage.
+*
+* Parameters:
+*   batch:      Packets to write
+*
+* Returns: 0 for success, -1 on error
+*/
+static int aesdsoc_commit_flush(struct commit_queue *batch) {
+    struct iovec iov[COMMIT_MAX_IOV];
+    aesdsoc_commit_req_t *req;
+    int count = 0;
+    int rc = 0;
+
+    STAILQ_FOREACH(req, batch, entries) {
+        iov[count].iov_base = (void *)req->data;
+        iov[count].iov_len = req->len;
+        if (++count == COMMIT_MAX_IOV) {
+            rc = aesdsoc_storage->append(iov, count);
+            count = 0;
+            if (rc) {
+                break;
+            }
+        }
+    }
+    if (rc == 0 && count > 0) {
+        rc = aesdsoc_storage->append(iov, count);
+    }
+    if (rc == 0 && aesdsoc_sync_policy != AESDSOC_SYNC_NONE) {
+        rc = aesdsoc_storage->flush();
+    }
+    return rc;
+}
+
+/*
+* aesdsoc_commit_run
+* Writes everything queued so far as one batch, by the thread that found
+* no flush running. Called and returns with commit_mutex held.
+*
+* Parameters: None
+*
+* Returns: None
+*/
+static void aesdsoc_commit_run(void) {
+    struct commit_queue batch;
+    struct commit_queue completed;
+    aesdsoc_commit_req_t *entry;
+    int rc;
+
+    commit_flushing = TRUE;
+    STAILQ_INIT(&batch);
+    STAILQ_CONCAT(&batch, &commit_pending);
+    commit_async = 0;
+    pthread_mutex_unlock(&commit_mutex);
+
+    rc = aesdsoc_commit_flush(&batch);
+
+    pthread_mutex_lock(&commit_mutex);
+    /* Also the generation, read without the lock */
+    __atomic_add_fetch(&commit_batches, 1, __ATOMIC_RELEASE);
+    STAILQ_INIT(&completed);
+    /* A waiting request is gone once done is set */
+    while ((entry = STAILQ_FIRST(&batch)) != NULL) {
+        STAILQ_REMOVE_HEAD(&batch, entries);
+        entry->rc = rc;
+        commit_records++;
+        if (entry->complete != NULL) {
+            STAILQ_INSERT_TAIL(&completed, entry, entries);
+        }
+        else {
+            entry->done = TRUE;
+        }
+    }
+    if (!STAILQ_EMPTY(&completed)) {
+        pthread_mutex_unlock(&commit_mutex);
+        while ((entry = STAILQ_FIRST(&completed)) != NULL) {
+            STAILQ_REMOVE_HEAD(&completed, entries);
+            entry->complete(entry->arg, entry->rc);
+            free(entry);
+        }
+        pthread_mutex_lock(&commit_mutex);
+    }
+    commit_flushing = FALSE;
+    /* Waiting threads take over for their own requests */
+    pthread_cond_broadcast(&commit_done);
+    if (commit_async > 0) {
+        pthread_cond_signal(&commit_wake);
+    }
+}
+
+/*
+* aesdsoc_commit_thread
+* Writes the requests queued without waiting while another flush ran.
+*
+* Parameters:
+*   arg:        Unused
+*
+* Returns: Never
+*/
+static void *aesdsoc_commit_thread(void *arg) {
+    pthread_mutex_lock(&commit_mutex);
+    while (TRUE) {
+        if (commit_flushing || commit_async == 0) {
+            pthread_cond_wait(&commit_wake, &commit_mutex);
+            continue;
+        }
+        aesdsoc_commit_run();
+    }
+    return NULL;
+}
+
+/*
+* aesdsoc_commit_thread_start
+* Starts the commit thread on first use. Called with commit_mutex held.
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+static int aesdsoc_commit_thread_start(void) {
+    pthread_t thread;
+
+    if (commit_thread_running) {
+        return 0;
+    }
+    if (aesdsoc_thread_create(&thread, aesdsoc_commit_thread, NULL)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: pthread_create failed");
+        return -1;
+    }
+    pthread_detach(thread);
+    commit_thread_running = TRUE;
+    return 0;
+}
+
+/*
+* aesdsoc_group_commit
+* Saves one complete packet and returns once it is written, together with
+* whatever other clients queued in the meantime.
+*
+* Parameters:
+*   data:       Packet, must stay valid until the function returns
+*   len:        Packet length in bytes
+*
+* Returns: 0 for success, -1 on error
+*/
+int aesdsoc_group_commit(const char *data, int len) {
+    aesdsoc_commit_req_t req;
+
+    req.data = data;
+    req.len = len;
+    req.done = FALSE;
+    req.rc = 0;
+    req.complete = NULL;
+    req.arg = NULL;
+
+    pthread_mutex_lock(&commit_mutex);
+    STAILQ_INSERT_TAIL(&commit_pending, &req, entries);
+    while (!req.done) {
+        if (commit_flushing) {
+            pthread_cond_wait(&commit_done, &commit_mutex);
+            continue;
+        }
+        /* No flush running, write everything queued so far */
+        aesdsoc_commit_run();
+    }
+    pthread_mutex_unlock(&commit_mutex);
+    return req.rc;
+}
+
+/*
+* aesdsoc_group_commit_async
+* Saves one complete packet without waiting for another thread's flush.
+* With no flush running the caller writes the batch itself, as with
+* aesdsoc_group_commit(), otherwise the packet joins the next batch. Without
+* the commit thread the caller waits like aesdsoc_group_commit().
+*
+* Parameters:
+*   data:       Packet, must stay valid until it is written
+*   len:        Packet length in bytes
+*   complete:   Called with arg and the result once a queued packet is
+*               written, by the flushing thread
+*   arg:        Argument of complete
+*
+* Returns: 0 when the packet is written, AESDSOC_STORE_PENDING when it is
+*          queued and -1 on error
+*/
+int aesdsoc_group_commit_async(const char *data, int len,
+    void (*complete)(void *arg, int rc), void *arg) {
+    aesdsoc_commit_req_t *req;
+    int rc;
+
+    req = (aesdsoc_commit_req_t *)malloc(sizeof(aesdsoc_commit_req_t));
+    if (req == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+        return -1;
+    }
+    req->data = data;
+    req->len = len;
+    req->done = FALSE;
+    req->rc = 0;
+    req->complete = complete;
+    req->arg = arg;
+
+    pthread_mutex_lock(&commit_mutex);
+    STAILQ_INSERT_TAIL(&commit_pending, req, entries);
+    if (commit_flushing && aesdsoc_commit_thread_start() == 0) {
+        /* Taken by the next flush, at the latest the commit thread's */
+        commit_async++;
+        pthread_mutex_unlock(&commit_mutex);
+        return AESDSOC_STORE_PENDING;
+    }
+    req->complete = NULL;
+    while (!req->done) {
+        if (commit_flushing) {
+            pthread_cond_wait(&commit_done, &commit_mutex);
+            continue;
+        }
+        /* No flush running, write everything queued so far */
+        aesdsoc_commit_run();
+    }
+    rc = req->rc;
+    pthread_mutex_unlock(&commit_mutex);
+    free(req);
+    return rc;
+}
+
+/*
+* aesdsoc_commit_stats
+*
+* Parameters:
+*   batches:    Returns the number of batches written
+*   records:    Returns the number of packets written
+*
+* Returns: None
+*/
+void aesdsoc_commit_stats(unsigned long *batches, unsigned long *records) {
+    pthread_mutex_lock(&commit_mutex);
+    *batches = commit_batches;
+    *records = commit_records;
+    pthread_mutex_unlock(&commit_mutex);
+}
+
+/*
+* aesdsoc_commit_generation
+* Advances with every group commit batch, replies at the same generation
+* see the same storage contents.
+*
+* Parameters: None
+*
+* Returns: Current generation
+*/
+unsigned long aesdsoc_commit_generation(void) {
+    return __atomic_load_n(&commit_batches, __ATOMIC_ACQUIRE);
+}
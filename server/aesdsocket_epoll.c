@@ -0,0 +1,463 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_epoll.c
+* @brief epoll based connection engine for aesdsocket
+*
+* The accept loop hands every client to one of a fixed set of event loop
+* threads in round robin order. Each event loop owns an epoll instance and
+* only calls into the packet processing code when a client socket is
+* readable, so idle clients cost no CPU.
+*
+* A loop thread never waits for one client. A reply that does not fit in
+* the socket continues on EPOLLOUT, and a packet queued behind another
+* thread's group commit takes the client out of the epoll set until the
+* flusher signals the loop through its wake event.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+* CREDIT: Consulted epoll(7) man page
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "queue.h"
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define EPOLL_MAX_EVENTS            (64)
+/* Interval at which a stopping loop checks the drain time */
+#define EPOLL_DRAIN_POLL_MS         (100)
+
+typedef struct aesdsoc_epoll_loop aesdsoc_epoll_loop_t;
+
+typedef struct aesdsoc_epoll_client {
+    aesdsoc_conn_t conn;
+    aesdsoc_epoll_loop_t *loop;
+    /* Events the socket is registered for, 0 while it is out of the set */
+    uint32_t events;
+    int commit_rc;
+    LIST_ENTRY(aesdsoc_epoll_client) entries;
+    STAILQ_ENTRY(aesdsoc_epoll_client) committed;
+} aesdsoc_epoll_client_t;
+
+struct aesdsoc_epoll_loop {
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;
+    int started;
+    /* Accepted clients owned by this loop */
+    pthread_mutex_t clients_mutex;
+    LIST_HEAD(epoll_client_head, aesdsoc_epoll_client) clients;
+    /* Clients whose commit completed, also guarded by clients_mutex */
+    STAILQ_HEAD(epoll_commit_head, aesdsoc_epoll_client) committed;
+    /* Clients waiting for a commit */
+    int commits;
+    /* Clients with a reply in flight, waiting for EPOLLOUT */
+    int sending;
+};
+
+/*******************************************************************************
+ * Prototypes
+*******************************************************************************/
+static int aesdsoc_epoll_engine_run(int soc_server);
+static void *aesdsoc_epoll_loop_thread(void *argument);
+static void aesdsoc_epoll_client_close(aesdsoc_epoll_loop_t *loop,
+    aesdsoc_epoll_client_t *client);
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+const aesdsoc_engine_t aesdsoc_epoll_engine = {
+    .name = "epoll",
+    .run  = aesdsoc_epoll_engine_run,
+};
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* aesdsoc_epoll_client_close
+* Removes the client from its loop and frees it.
+*
+* Parameters:
+*   loop:       Event loop owning the client
+*   client:     Client to close
+*
+* Returns: None
+*/
+static void aesdsoc_epoll_client_close(aesdsoc_epoll_loop_t *loop,
+    aesdsoc_epoll_client_t *client) {
+
+    pthread_mutex_lock(&loop->clients_mutex);
+    LIST_REMOVE(client, entries);
+    pthread_mutex_unlock(&loop->clients_mutex);
+    loop->sending -= (client->events == EPOLLOUT);
+    /* Closing the socket also removes it from the epoll set */
+    aesdsoc_conn_release(&client->conn);
+    free(client);
+}
+
+/*
+* aesdsoc_epoll_commit_done
+* Group commit callback, runs on the flushing thread.
+*
+* Parameters:
+*   arg:        Client waiting for the commit
+*   rc:         Commit result
+*
+* Returns: None
+*/
+static void aesdsoc_epoll_commit_done(void *arg, int rc) {
+    aesdsoc_epoll_client_t *client = (aesdsoc_epoll_client_t *)arg;
+    aesdsoc_epoll_loop_t *loop = client->loop;
+    uint64_t wake = 1;
+
+    pthread_mutex_lock(&loop->clients_mutex);
+    client->commit_rc = rc;
+    STAILQ_INSERT_TAIL(&loop->committed, client, committed);
+    pthread_mutex_unlock(&loop->clients_mutex);
+    if (write(loop->wake_fd, &wake, sizeof(wake)) < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: eventfd write failed %s", strerror(errno));
+    }
+}
+
+/*
+* aesdsoc_epoll_commit
+* Commit hook, queues the packet instead of waiting for a running flush.
+*
+* Parameters:
+*   conn:       Connection state
+*   data:       Complete packet
+*   len:        Packet length
+*
+* Returns: 0 when written, AESDSOC_STORE_PENDING when queued and -1 on error
+*/
+static int aesdsoc_epoll_commit(aesdsoc_conn_t *conn, const char *data, int len) {
+    return aesdsoc_group_commit_async(data, len, aesdsoc_epoll_commit_done,
+        conn->engine_data);
+}
+
+/*
+* aesdsoc_epoll_client_watch
+* Changes the events a client socket is registered for.
+*
+* Parameters:
+*   loop:       Event loop owning the client
+*   client:     Client
+*   events:     New events, 0 to take the socket out of the set
+*
+* Returns: 0 for success, -1 on error
+*/
+static int aesdsoc_epoll_client_watch(aesdsoc_epoll_loop_t *loop,
+    aesdsoc_epoll_client_t *client, uint32_t events) {
+    struct epoll_event event;
+    int op;
+
+    if (events == client->events) {
+        return 0;
+    }
+    op = (client->events == 0) ? EPOLL_CTL_ADD : (events == 0) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    event.events = events;
+    event.data.ptr = client;
+    if (epoll_ctl(loop->epoll_fd, op, client->conn.soc_client, &event) < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: epoll_ctl failed %s", strerror(errno));
+        return -1;
+    }
+    loop->sending += (events == EPOLLOUT) - (client->events == EPOLLOUT);
+    client->events = events;
+    return 0;
+}
+
+/*
+* aesdsoc_epoll_client_next
+* Waits for what the client needs next, or closes it.
+*
+* Parameters:
+*   loop:       Event loop owning the client
+*   client:     Client
+*   rc:         Result of the last aesdsoc_conn_* call
+*
+* Returns: None
+*/
+static void aesdsoc_epoll_client_next(aesdsoc_epoll_loop_t *loop,
+    aesdsoc_epoll_client_t *client, int rc) {
+    switch (rc) {
+    case AESDSOC_CONN_OPEN:
+    case AESDSOC_CONN_AGAIN:
+        /* A stopping loop reads nothing more, the client is handed off */
+        rc = aesdsoc_epoll_client_watch(loop, client,
+            exit_aesd_soc ? 0 : EPOLLIN | EPOLLRDHUP);
+        break;
+    case AESDSOC_CONN_COMMIT:
+        /* Nothing is read until the flusher calls back */
+        loop->commits++;
+        rc = aesdsoc_epoll_client_watch(loop, client, 0);
+        break;
+    case AESDSOC_CONN_SEND:
+        rc = aesdsoc_epoll_client_watch(loop, client, EPOLLOUT);
+        break;
+    default:
+        rc = -1;
+        break;
+    }
+    if (rc) {
+        aesdsoc_epoll_client_close(loop, client);
+    }
+}
+
+/*
+* aesdsoc_epoll_loop_committed
+* Resumes the clients whose commit completed.
+*
+* Parameters:
+*   loop:       Event loop
+*
+* Returns: None
+*/
+static void aesdsoc_epoll_loop_committed(aesdsoc_epoll_loop_t *loop) {
+    struct epoll_commit_head committed;
+    aesdsoc_epoll_client_t *client;
+    uint64_t wake;
+
+    /* The counter is only reset, the lists tell what completed */
+    if (read(loop->wake_fd, &wake, sizeof(wake)) < 0 && errno != EAGAIN) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: eventfd read failed %s", strerror(errno));
+    }
+    STAILQ_INIT(&committed);
+    pthread_mutex_lock(&loop->clients_mutex);
+    STAILQ_CONCAT(&committed, &loop->committed);
+    pthread_mutex_unlock(&loop->clients_mutex);
+    while ((client = STAILQ_FIRST(&committed)) != NULL) {
+        STAILQ_REMOVE_HEAD(&committed, committed);
+        loop->commits--;
+        aesdsoc_epoll_client_next(loop, client,
+            aesdsoc_conn_resume(&client->conn, client->commit_rc));
+    }
+}
+
+/*
+* aesdsoc_epoll_loop_thread
+* Event loop, serves readable clients until the wake event is signalled.
+* The commits in flight are waited for, their packets point into the
+* client buffers. The replies in flight are finished until the drain time
+* is over.
+*
+* Parameters:
+*   argument:   Pointer to aesdsoc_epoll_loop_t
+*
+* Returns: argument
+*/
+static void *aesdsoc_epoll_loop_thread(void *argument) {
+    aesdsoc_epoll_loop_t *loop = (aesdsoc_epoll_loop_t *)argument;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    aesdsoc_epoll_client_t *client;
+    int woken;
+    int count;
+    int rc;
+
+    AESDSOC_LOG(LOG_INFO, "aesdsocket: epoll loop started");
+    while (exit_aesd_soc == FALSE || loop->commits > 0 ||
+        (loop->sending > 0 && !aesdsoc_drain_expired())) {
+        count = epoll_wait(loop->epoll_fd, events, EPOLL_MAX_EVENTS,
+            exit_aesd_soc ? EPOLL_DRAIN_POLL_MS : -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: epoll_wait failed %s", strerror(errno));
+            break;
+        }
+        woken = FALSE;
+        for (int i = 0; i < count; i++) {
+            client = (aesdsoc_epoll_client_t *)events[i].data.ptr;
+            if (client == NULL) {
+                /* Wake event, exit_aesd_soc is checked by the loop */
+                woken = TRUE;
+                continue;
+            }
+            if (exit_aesd_soc && !client->conn.tx_active) {
+                /* Left out of the set until it is handed off */
+                aesdsoc_epoll_client_next(loop, client, AESDSOC_CONN_OPEN);
+                continue;
+            }
+            if (client->conn.tx_active) {
+                rc = aesdsoc_conn_send(&client->conn);
+            }
+            else {
+                rc = aesdsoc_conn_receive(&client->conn);
+            }
+            aesdsoc_epoll_client_next(loop, client, rc);
+        }
+        /* After the batch, a resumed client may be closed */
+        if (woken) {
+            aesdsoc_epoll_loop_committed(loop);
+        }
+    }
+    return argument;
+}
+
+/*
+* epoll engine accept loop
+*
+* Parameters:
+*   soc_server: Listening socket
+*
+* Returns: 0 on exit request, otherwise error code
+*/
+static int aesdsoc_epoll_engine_run(int soc_server) {
+    int rc = 0;
+    int loop_count = aesdsoc_threads;
+    int next_loop = 0;
+    int soc_client;
+    uint64_t wake = 1;
+    struct sockaddr_storage aesdsoc_addr;
+    struct epoll_event event;
+    aesdsoc_epoll_loop_t *loops;
+    aesdsoc_epoll_loop_t *loop;
+    aesdsoc_epoll_client_t *client;
+
+    if (loop_count <= 0) {
+        loop_count = sysconf(_SC_NPROCESSORS_ONLN);
+        if (loop_count <= 0) {
+            loop_count = 1;
+        }
+    }
+    loops = (aesdsoc_epoll_loop_t *)calloc(loop_count, sizeof(aesdsoc_epoll_loop_t));
+    if (loops == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+        return -1;
+    }
+
+    for (int i = 0; i < loop_count; i++) {
+        loop = &loops[i];
+        loop->epoll_fd = -1;
+        loop->wake_fd = -1;
+        LIST_INIT(&loop->clients);
+        STAILQ_INIT(&loop->committed);
+        pthread_mutex_init(&loop->clients_mutex, NULL);
+    }
+
+    for (int i = 0; i < loop_count; i++) {
+        loop = &loops[i];
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: epoll_create1 failed %s", strerror(errno));
+            rc = -1;
+            goto cleanup;
+        }
+        loop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (loop->wake_fd < 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: eventfd failed %s", strerror(errno));
+            rc = -1;
+            goto cleanup;
+        }
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) < 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: epoll_ctl failed %s", strerror(errno));
+            rc = -1;
+            goto cleanup;
+        }
+        if (aesdsoc_thread_create(&loop->thread, aesdsoc_epoll_loop_thread, loop) != 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: pthread_create failed");
+            rc = -1;
+            goto cleanup;
+        }
+        loop->started = 1;
+    }
+
+    AESDSOC_LOG(LOG_INFO,"**** AESDSOCKET application: Staring epoll mode, %d loops ****",
+        loop_count);
+    while (exit_aesd_soc == FALSE) {
+        soc_client = aesdsoc_accept(soc_server, &aesdsoc_addr);
+        if (soc_client < 0) {
+            if (errno == ECONNABORTED) {
+                continue;
+            }
+            rc = -1;
+            break;
+        }
+        client = (aesdsoc_epoll_client_t *)malloc(sizeof(aesdsoc_epoll_client_t));
+        if (client == NULL) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+            close(soc_client);
+            continue;
+        }
+        if (aesdsoc_conn_init(&client->conn, soc_client, &aesdsoc_addr)) {
+            close(soc_client);
+            free(client);
+            continue;
+        }
+
+        loop = &loops[next_loop];
+        next_loop = (next_loop + 1) % loop_count;
+        client->loop = loop;
+        client->conn.nonblocking = TRUE;
+        client->conn.commit = aesdsoc_epoll_commit;
+        client->conn.engine_data = client;
+        pthread_mutex_lock(&loop->clients_mutex);
+        LIST_INSERT_HEAD(&loop->clients, client, entries);
+        pthread_mutex_unlock(&loop->clients_mutex);
+
+        /* Set first, the loop may serve the client before epoll_ctl returns */
+        client->events = EPOLLIN | EPOLLRDHUP;
+        event.events = client->events;
+        event.data.ptr = client;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, soc_client, &event) < 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: epoll_ctl failed %s", strerror(errno));
+            aesdsoc_epoll_client_close(loop, client);
+        }
+    }
+
+cleanup:
+    for (int i = 0; i < loop_count; i++) {
+        loop = &loops[i];
+        if (loop->started) {
+            if (write(loop->wake_fd, &wake, sizeof(wake)) < 0) {
+                AESDSOC_LOG(LOG_ERR, "aesdsocket: eventfd write failed %s", strerror(errno));
+            }
+            pthread_join(loop->thread, NULL);
+        }
+        while (!LIST_EMPTY(&loop->clients)) {
+            client = LIST_FIRST(&loop->clients);
+            /* Only clients between two packets, a reply still in flight
+             * after the drain time is lost */
+            if (!client->conn.tx_active) {
+                aesdsoc_handoff_client(client->conn.soc_client, &client->conn.aesdsoc_addr,
+                    &client->conn);
+            }
+            aesdsoc_epoll_client_close(loop, client);
+        }
+        if (loop->wake_fd >= 0) {
+            close(loop->wake_fd);
+        }
+        if (loop->epoll_fd >= 0) {
+            close(loop->epoll_fd);
+        }
+        pthread_mutex_destroy(&loop->clients_mutex);
+    }
+    free(loops);
+    return rc;
+}
@@ -0,0 +1,850 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_handoff.c
+* @brief Listening socket handoff and socket activation of aesdsocket
+*
+* Started with "-u path", the server listens for an upgrade request on a
+* Unix socket at path. A new aesdsocket started with the same option
+* connects to it and the running server:
+*   - stops accepting and stops its engines,
+*   - passes its listening sockets and its open clients, with their reply
+*     session, prepared reply and partial packet, over SCM_RIGHTS,
+*   - exits without closing the listeners or removing the data file.
+* Connections that arrive meanwhile wait in the listen backlog of the
+* shared sockets, so no client is dropped. The new server takes over the
+* control socket for the next upgrade.
+*
+* Without a running server, listening sockets passed by the service manager
+* (LISTEN_PID and LISTEN_FDS, starting at descriptor 3) are used instead of
+* new ones.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+* CREDIT: Consulted unix(7), cmsg(3) and sd_listen_fds(3) man pages
+*
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "queue.h"
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+/* Bumped whenever handoff_record_t changes */
+#define HANDOFF_VERSION             (3)
+#define HANDOFF_MAX_LISTENERS       (64)
+#define HANDOFF_TIMEOUT_SEC         (30)
+/* Partial packets and prepared replies are sent in chunks of this size */
+#define HANDOFF_CHUNK_SIZE          (65536)
+#define LISTEN_FDS_START            (3)
+
+#define HANDOFF_LISTENER            (1)
+#define HANDOFF_CLIENT              (2)
+#define HANDOFF_END                 (3)
+
+/* One SOCK_SEQPACKET message, the descriptor travels in its ancillary data */
+typedef struct handoff_record {
+    uint32_t type;
+    uint32_t index;
+    struct sockaddr_storage aesdsoc_addr;
+    int32_t incremental;
+    int32_t binary;
+    int64_t reply_offset;
+    int32_t seek_pending;
+    int64_t seek_offset;
+    /* Followed by partial_len bytes of partial packet, then reply_len bytes
+     * of prepared reply */
+    int32_t partial_len;
+    int32_t reply_len;
+} handoff_record_t;
+
+typedef struct handoff_client handoff_client_t;
+struct handoff_client {
+    handoff_record_t record;
+    int soc_client;
+    char *partial;
+    char *reply;
+    STAILQ_ENTRY(handoff_client) entries;
+};
+STAILQ_HEAD(handoff_client_head, handoff_client);
+
+/*******************************************************************************
+ * Prototypes
+*******************************************************************************/
+static void *aesdsoc_handoff_thread(void *argument);
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+/* Control socket path, NULL = no upgrade support */
+const char *aesdsoc_handoff_path = NULL;
+
+static int inherited[HANDOFF_MAX_LISTENERS];
+static int inherited_count = 0;
+static int ctl_fd = -1;
+static int peer_fd = -1;
+static int wake_fd = -1;
+static pthread_t handoff_thread;
+static pthread_t main_thread;
+static int thread_running = FALSE;
+static volatile sig_atomic_t handoff_active = FALSE;
+
+/* Clients collected for the new server, or received from the old one */
+static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct handoff_client_head clients = STAILQ_HEAD_INITIALIZER(clients);
+/* Clients returned by aesdsoc_handoff_take(), until aesdsoc_conn_init() */
+static struct handoff_client_head restoring = STAILQ_HEAD_INITIALIZER(restoring);
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* handoff_client_free
+*
+* Parameters:
+*   client:     Client record, its socket is closed when still set
+*
+* Returns: None
+*/
+static void handoff_client_free(handoff_client_t *client) {
+    if (client->soc_client >= 0) {
+        close(client->soc_client);
+    }
+    free(client->partial);
+    free(client->reply);
+    free(client);
+}
+
+/*
+* handoff_send_record
+*
+* Parameters:
+*   fd:         Control connection
+*   record:     Record to send
+*   pass_fd:    Descriptor passed along, or -1
+*
+* Returns: 0 for success, -1 on error
+*/
+static int handoff_send_record(int fd, const handoff_record_t *record, int pass_fd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)record;
+    iov.iov_len = sizeof(*record);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (pass_fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(*record)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: handoff sendmsg failed %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* handoff_recv_record
+*
+* Parameters:
+*   fd:         Control connection
+*   record:     Returns the record
+*   pass_fd:    Returns the descriptor passed along, or -1
+*
+* Returns: 0 for success, -1 on error or when the sender is gone
+*/
+static int handoff_recv_record(int fd, handoff_record_t *record, int *pass_fd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t len;
+
+    *pass_fd = -1;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = record;
+    iov.iov_len = sizeof(*record);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    do {
+        len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (len < 0 && errno == EINTR);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (len > 0 && cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(pass_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (len != sizeof(*record)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: handoff receive failed %s",
+            (len < 0) ? strerror(errno) : "short record");
+        if (*pass_fd >= 0) {
+            close(*pass_fd);
+            *pass_fd = -1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* handoff_recv_data
+* Receives the partial packet or the prepared reply following a client
+* record.
+*
+* Parameters:
+*   fd:         Control connection
+*   data:       Returns the allocated data, left NULL when len is 0
+*   len:        Number of bytes
+*
+* Returns: 0 for success, -1 on error
+*/
+static int handoff_recv_data(int fd, char **data, int len) {
+    int done = 0;
+    ssize_t rx_len;
+
+    if (len <= 0) {
+        return 0;
+    }
+    *data = (char *)malloc(len);
+    if (*data == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+        return -1;
+    }
+    while (done < len) {
+        rx_len = recv(fd, *data + done, len - done, 0);
+        if (rx_len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rx_len <= 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: handoff client data lost");
+            return -1;
+        }
+        done += rx_len;
+    }
+    return 0;
+}
+
+/*
+* handoff_send_data
+*
+* Parameters:
+*   fd:         Control connection
+*   data:       Partial packet or prepared reply
+*   len:        Number of bytes in data
+*
+* Returns: 0 for success, -1 on error
+*/
+static int handoff_send_data(int fd, const char *data, int len) {
+    ssize_t tx_len;
+    int chunk;
+
+    for (int done = 0; done < len; ) {
+        chunk = len - done;
+        chunk = (chunk > HANDOFF_CHUNK_SIZE) ? HANDOFF_CHUNK_SIZE : chunk;
+        tx_len = send(fd, data + done, chunk, MSG_NOSIGNAL);
+        if (tx_len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (tx_len <= 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: handoff send failed %s", strerror(errno));
+            return -1;
+        }
+        done += tx_len;
+    }
+    return 0;
+}
+
+/*
+* handoff_receive
+* Requests the handoff from the running server and collects its listening
+* sockets and clients.
+*
+* Parameters:
+*   fd:         Connected control socket
+*
+* Returns: 0 for success, -1 when the transfer broke off. The sockets
+*          received until then are used.
+*/
+static int handoff_receive(int fd) {
+    struct timeval timeout;
+    handoff_record_t record;
+    handoff_client_t *client;
+    uint8_t version = HANDOFF_VERSION;
+    int pass_fd;
+    int client_count = 0;
+
+    timeout.tv_sec = HANDOFF_TIMEOUT_SEC;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (send(fd, &version, sizeof(version), MSG_NOSIGNAL) != sizeof(version)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: handoff request failed %s", strerror(errno));
+        return -1;
+    }
+    while (handoff_recv_record(fd, &record, &pass_fd) == 0) {
+        switch (record.type) {
+        case HANDOFF_LISTENER:
+            if (pass_fd < 0 || record.index >= HANDOFF_MAX_LISTENERS ||
+                inherited[record.index] >= 0) {
+                break;
+            }
+            inherited[record.index] = pass_fd;
+            pass_fd = -1;
+            if ((int)record.index >= inherited_count) {
+                inherited_count = record.index + 1;
+            }
+            break;
+        case HANDOFF_CLIENT:
+            client = (handoff_client_t *)calloc(1, sizeof(handoff_client_t));
+            if (client == NULL) {
+                AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+                break;
+            }
+            client->record = record;
+            client->soc_client = pass_fd;
+            pass_fd = -1;
+            if (handoff_recv_data(fd, &client->partial, record.partial_len) ||
+                handoff_recv_data(fd, &client->reply, record.reply_len) ||
+                client->soc_client < 0) {
+                handoff_client_free(client);
+                return -1;
+            }
+            STAILQ_INSERT_TAIL(&clients, client, entries);
+            client_count++;
+            break;
+        case HANDOFF_END:
+            AESDSOC_LOG(LOG_INFO, "aesdsocket: took over %d listeners and %d clients",
+                inherited_count, client_count);
+            return 0;
+        default:
+            break;
+        }
+        if (pass_fd >= 0) {
+            close(pass_fd);
+        }
+    }
+    return -1;
+}
+
+/*
+* handoff_activation
+* Picks up the listening sockets passed by the service manager.
+*
+* Parameters: None
+*
+* Returns: Number of sockets found
+*/
+static int handoff_activation(void) {
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    int accepting;
+    socklen_t len;
+    int count;
+    int fd;
+
+    if (pid == NULL || fds == NULL || atol(pid) != (long)getpid()) {
+        return 0;
+    }
+    count = atoi(fds);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    for (int i = 0; i < count && inherited_count < HANDOFF_MAX_LISTENERS; i++) {
+        fd = LISTEN_FDS_START + i;
+        len = sizeof(accepting);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) < 0 || !accepting) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: inherited descriptor %d is not listening", fd);
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        inherited[inherited_count++] = fd;
+    }
+    AESDSOC_LOG(LOG_INFO, "aesdsocket: %d listening sockets from socket activation",
+        inherited_count);
+    return inherited_count;
+}
+
+/*
+* aesdsoc_handoff_init
+* Collects the listening sockets passed by the service manager or, with
+* aesdsoc_handoff_path set, takes over a running server. Called before
+* daemon(), LISTEN_PID holds the pid before the fork.
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 when a running server could not be taken over
+*          completely
+*/
+int aesdsoc_handoff_init(void) {
+    struct sockaddr_un addr;
+    int fd;
+    int rc;
+
+    for (int i = 0; i < HANDOFF_MAX_LISTENERS; i++) {
+        inherited[i] = -1;
+    }
+    if (handoff_activation() > 0 || aesdsoc_handoff_path == NULL) {
+        return 0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, aesdsoc_handoff_path, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Socket creation failed %s", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        /* No server running */
+        close(fd);
+        return 0;
+    }
+    AESDSOC_LOG(LOG_INFO, "aesdsocket: taking over the server on %s", aesdsoc_handoff_path);
+    rc = handoff_receive(fd);
+    close(fd);
+    return rc;
+}
+
+/*
+* aesdsoc_handoff_listener
+* Hands out an inherited listening socket.
+*
+* Parameters:
+*   index:      Listener index, the shard number
+*
+* Returns: Listening socket, owned by the caller, or -1 if none was inherited
+*/
+int aesdsoc_handoff_listener(int index) {
+    int fd;
+
+    if (index < 0 || index >= HANDOFF_MAX_LISTENERS) {
+        return -1;
+    }
+    fd = inherited[index];
+    inherited[index] = -1;
+    return fd;
+}
+
+/*
+* aesdsoc_handoff_listener_count
+*
+* Parameters: None
+*
+* Returns: Number of inherited listener slots, the server runs at least as
+*          many shards so that none of them is left without an acceptor
+*/
+int aesdsoc_handoff_listener_count(void) {
+    return inherited_count;
+}
+
+/*
+* aesdsoc_handoff_start
+* Opens the control socket and starts the thread waiting for an upgrade
+* request. Called after daemon(), threads do not survive the fork.
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+int aesdsoc_handoff_start(void) {
+    struct sockaddr_un addr;
+
+    if (aesdsoc_handoff_path == NULL) {
+        return 0;
+    }
+    main_thread = pthread_self();
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ctl_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (wake_fd < 0 || ctl_fd < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: handoff socket creation failed %s", strerror(errno));
+        goto error;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, aesdsoc_handoff_path, sizeof(addr.sun_path) - 1);
+    /* Left behind by the server taken over, or by a crash */
+    unlink(addr.sun_path);
+    if (bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(addr.sun_path, S_IRUSR | S_IWUSR) < 0 ||
+        listen(ctl_fd, 1) < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: handoff socket %s failed %s", aesdsoc_handoff_path,
+            strerror(errno));
+        goto error;
+    }
+    if (aesdsoc_thread_create(&handoff_thread, aesdsoc_handoff_thread, NULL) != 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: handoff thread cannot be started");
+        goto error;
+    }
+    thread_running = TRUE;
+    return 0;
+
+error:
+    if (ctl_fd >= 0) {
+        close(ctl_fd);
+    }
+    if (wake_fd >= 0) {
+        close(wake_fd);
+    }
+    ctl_fd = -1;
+    wake_fd = -1;
+    return -1;
+}
+
+/*
+* aesdsoc_handoff_thread
+* Waits for the upgrade request of a new server, then stops this one.
+*
+* Parameters:
+*   argument:   Unused
+*
+* Returns: argument
+*/
+static void *aesdsoc_handoff_thread(void *argument) {
+    struct pollfd pfds[2];
+    uint8_t version;
+    int fd;
+    int rc;
+
+    pfds[0].fd = ctl_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = wake_fd;
+    pfds[1].events = POLLIN;
+    while (exit_aesd_soc == FALSE) {
+        rc = poll(pfds, 2, -1);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: poll failed %s", strerror(errno));
+            break;
+        }
+        if (pfds[1].revents) {
+            break;
+        }
+        fd = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if (recv(fd, &version, sizeof(version), 0) != sizeof(version) ||
+            version != HANDOFF_VERSION) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: rejected handoff request");
+            close(fd);
+            continue;
+        }
+        AESDSOC_LOG(LOG_INFO, "aesdsocket: handing over to the new server");
+        /* The path now belongs to the new server */
+        close(ctl_fd);
+        ctl_fd = -1;
+        peer_fd = fd;
+        handoff_active = TRUE;
+        exit_aesd_soc = TRUE;
+        /* Wakes the acceptors, then the main thread like a SIGTERM */
+        aesdsoc_stop_acceptors();
+        pthread_kill(main_thread, SIGTERM);
+        break;
+    }
+    return argument;
+}
+
+/*
+* aesdsoc_handoff_active
+*
+* Parameters: None
+*
+* Returns: TRUE once a new server is taking over. The listening sockets
+*          must not be shut down and the data file must be kept then.
+*/
+int aesdsoc_handoff_active(void) {
+    return handoff_active;
+}
+
+/*
+* aesdsoc_handoff_client
+* Keeps an open client for the new server. The caller still closes its own
+* descriptor. Called by the engines for the clients they hold when they
+* stop, between two receives.
+*
+* Parameters:
+*   soc_client:     Client socket
+*   aesdsoc_addr:   Peer address
+*   conn:           Connection state, or NULL for a client not served yet
+*
+* Returns: TRUE when the client is passed on, FALSE otherwise
+*/
+int aesdsoc_handoff_client(int soc_client, const struct sockaddr_storage *aesdsoc_addr,
+    const aesdsoc_conn_t *conn) {
+    handoff_client_t *client;
+
+    if (!handoff_active || soc_client < 0) {
+        return FALSE;
+    }
+    client = (handoff_client_t *)calloc(1, sizeof(handoff_client_t));
+    if (client == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+        return FALSE;
+    }
+    client->record.type = HANDOFF_CLIENT;
+    client->record.aesdsoc_addr = *aesdsoc_addr;
+    if (conn != NULL) {
+        client->record.incremental = conn->incremental;
+        client->record.binary = conn->binary;
+        client->record.reply_offset = conn->reply_offset;
+        client->record.seek_pending = conn->seek_pending;
+        client->record.seek_offset = conn->seek_offset;
+        if (conn->wr_pointer > 0) {
+            client->partial = (char *)malloc(conn->wr_pointer);
+            if (client->partial == NULL) {
+                AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+                free(client);
+                return FALSE;
+            }
+            memcpy(client->partial, conn->file_buffer, conn->wr_pointer);
+            client->record.partial_len = conn->wr_pointer;
+        }
+        if (conn->reply_len > 0) {
+            client->reply = (char *)malloc(conn->reply_len);
+            if (client->reply == NULL) {
+                AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+                client->soc_client = -1;
+                handoff_client_free(client);
+                return FALSE;
+            }
+            memcpy(client->reply, conn->reply_buf, conn->reply_len);
+            client->record.reply_len = conn->reply_len;
+        }
+    }
+    client->soc_client = fcntl(soc_client, F_DUPFD_CLOEXEC, 0);
+    if (client->soc_client < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: dup failed %s", strerror(errno));
+        handoff_client_free(client);
+        return FALSE;
+    }
+    pthread_mutex_lock(&clients_mutex);
+    STAILQ_INSERT_TAIL(&clients, client, entries);
+    pthread_mutex_unlock(&clients_mutex);
+    return TRUE;
+}
+
+/*
+* aesdsoc_handoff_send
+* Passes the listening sockets and the kept clients to the new server,
+* once the engines have stopped.
+*
+* Parameters:
+*   listeners:  Listening sockets, indexed by shard
+*   count:      Number of listening sockets
+*
+* Returns: 0 for success or when no handoff is pending, -1 on error
+*/
+int aesdsoc_handoff_send(const int *listeners, int count) {
+    handoff_record_t record;
+    handoff_client_t *client;
+    int sent = 0;
+    int rc = 0;
+
+    if (!handoff_active || peer_fd < 0) {
+        return 0;
+    }
+    memset(&record, 0, sizeof(record));
+    record.type = HANDOFF_LISTENER;
+    for (int i = 0; i < count && rc == 0; i++) {
+        record.index = i;
+        rc = handoff_send_record(peer_fd, &record, listeners[i]);
+    }
+    pthread_mutex_lock(&clients_mutex);
+    while (rc == 0 && (client = STAILQ_FIRST(&clients)) != NULL) {
+        STAILQ_REMOVE_HEAD(&clients, entries);
+        rc = handoff_send_record(peer_fd, &client->record, client->soc_client);
+        if (rc == 0) {
+            rc = handoff_send_data(peer_fd, client->partial, client->record.partial_len);
+        }
+        if (rc == 0) {
+            rc = handoff_send_data(peer_fd, client->reply, client->record.reply_len);
+        }
+        sent += (rc == 0);
+        handoff_client_free(client);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    if (rc == 0) {
+        memset(&record, 0, sizeof(record));
+        record.type = HANDOFF_END;
+        rc = handoff_send_record(peer_fd, &record, -1);
+    }
+    AESDSOC_LOG(LOG_INFO, "aesdsocket: handed over %d listeners and %d clients", count, sent);
+    close(peer_fd);
+    peer_fd = -1;
+    return rc;
+}
+
+/*
+* aesdsoc_handoff_take
+* Hands out the next client taken over from the previous server. The
+* acceptors serve these before accepting new clients.
+*
+* Parameters:
+*   aesdsoc_addr:   Returns the peer address
+*
+* Returns: Client socket, or -1 if there is none left
+*/
+int aesdsoc_handoff_take(struct sockaddr_storage *aesdsoc_addr) {
+    handoff_client_t *client;
+    int soc_client = -1;
+
+    pthread_mutex_lock(&clients_mutex);
+    client = STAILQ_FIRST(&clients);
+    if (client != NULL && !handoff_active) {
+        STAILQ_REMOVE_HEAD(&clients, entries);
+        soc_client = client->soc_client;
+        *aesdsoc_addr = client->record.aesdsoc_addr;
+        STAILQ_INSERT_TAIL(&restoring, client, entries);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return soc_client;
+}
+
+/*
+* aesdsoc_handoff_restore
+* Restores the reply session, the prepared reply and the partial packet of
+* a client taken over from the previous server. Called by
+* aesdsoc_conn_init().
+*
+* Parameters:
+*   conn:       Freshly initialized connection state
+*
+* Returns: 0 for success, -1 if the partial packet or the prepared reply
+*          cannot be stored
+*/
+int aesdsoc_handoff_restore(aesdsoc_conn_t *conn) {
+    handoff_client_t *client;
+    int rc = 0;
+
+    pthread_mutex_lock(&clients_mutex);
+    STAILQ_FOREACH(client, &restoring, entries) {
+        /* The address guards against a descriptor number reused meanwhile */
+        if (client->soc_client == conn->soc_client &&
+            memcmp(&client->record.aesdsoc_addr, &conn->aesdsoc_addr,
+            sizeof(conn->aesdsoc_addr)) == 0) {
+            STAILQ_REMOVE(&restoring, client, handoff_client, entries);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    if (client == NULL) {
+        return 0;
+    }
+    conn->incremental = client->record.incremental;
+    conn->binary = client->record.binary;
+    conn->reply_offset = client->record.reply_offset;
+    conn->seek_pending = client->record.seek_pending;
+    conn->seek_offset = client->record.seek_offset;
+    if (client->record.partial_len > 0) {
+        rc = aesdsoc_conn_reserve(conn, client->record.partial_len);
+        if (rc == 0) {
+            memcpy(conn->file_buffer, client->partial, client->record.partial_len);
+            conn->wr_pointer = client->record.partial_len;
+        }
+    }
+    if (rc == 0 && client->record.reply_len > 0) {
+        rc = aesdsoc_conn_reply_append(conn, client->reply, client->record.reply_len);
+    }
+    /* The socket belongs to conn now */
+    client->soc_client = -1;
+    handoff_client_free(client);
+    return rc;
+}
+
+/*
+* aesdsoc_handoff_stop
+* Stops the control thread. The control socket path is removed unless a
+* new server took it over.
+*
+* Parameters: None
+*
+* Returns: None
+*/
+void aesdsoc_handoff_stop(void) {
+    handoff_client_t *client;
+    uint64_t one = 1;
+
+    if (thread_running) {
+        thread_running = FALSE;
+        if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: eventfd write failed %s", strerror(errno));
+        }
+        pthread_join(handoff_thread, NULL);
+    }
+    if (ctl_fd >= 0) {
+        close(ctl_fd);
+        ctl_fd = -1;
+        if (!handoff_active) {
+            unlink(aesdsoc_handoff_path);
+        }
+    }
+    if (peer_fd >= 0) {
+        close(peer_fd);
+        peer_fd = -1;
+    }
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    for (int i = 0; i < inherited_count; i++) {
+        if (inherited[i] >= 0) {
+            close(inherited[i]);
+            inherited[i] = -1;
+        }
+    }
+    /* Clients nobody served or passed on */
+    while ((client = STAILQ_FIRST(&clients)) != NULL) {
+        STAILQ_REMOVE_HEAD(&clients, entries);
+        handoff_client_free(client);
+    }
+    while ((client = STAILQ_FIRST(&restoring)) != NULL) {
+        STAILQ_REMOVE_HEAD(&restoring, entries);
+        handoff_client_free(client);
+    }
+}
@@ -0,0 +1,550 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_index.c
+* @brief Write command index of the aesdsocket data file
+*
+* The "file" and "mmap" backends record the offset every write command
+* starts at, so that AESDCHAR_IOCSEEKTO resolves to a data file offset with
+* one array lookup. A write command ends after each '\n' byte, whether the
+* bytes are indexed as they are appended or scanned from the data file.
+* Write command 0 starts the file, timestamp lines count as write commands.
+*
+* With aesdsoc_index_persist set the offsets are also appended to
+* INDEX_FILE_PATH as 64 bit values. A server reopening the data file, after
+* a handoff or a crash, loads them and only scans the data written after
+* the last one. Without it, or if the saved index does not match the data
+* file, the index is rebuilt by scanning the data file for '\n'.
+*
+* The "segment" backend has no single data file. Its index is read through
+* the storage and starts at the oldest segment. Retention drops the write
+* commands of the removed segments with aesdsoc_index_drop(), the write
+* command numbers of the rest stay, counted from idx_base.
+*
+* The io_uring engine writes the data file itself. In that case
+* aesdsoc_index_external() switches the index to scanning the bytes added
+* since the last seek, each byte is still scanned only once.
+*
+* If the offsets cannot be recorded, on allocation failure, the index only
+* keeps following the end of the data and the next seek rebuilds it.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define INDEX_FILE_PATH             ("/var/tmp/aesdsocketdata.idx")
+#define INDEX_SCAN_SIZE             (64 * 1024)
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+int aesdsoc_index_persist = FALSE;
+
+/* Start offset of every write command and the end of the last one */
+static off_t *idx_starts = NULL;
+static uint32_t idx_count = 0;
+static uint32_t idx_capacity = 0;
+static off_t idx_end = 0;
+/* Write command number of idx_starts[0] and the storage offset it starts
+ * at, advanced by aesdsoc_index_drop() */
+static uint32_t idx_base = 0;
+static off_t idx_origin = 0;
+/* The last write command has no '\n' yet, the next packet continues it */
+static int idx_open = FALSE;
+static int idx_fd = -1;
+/* Data file, -1 to read through the storage, and whether it is written
+ * behind aesdsoc_index_add() */
+static int idx_data_fd = -1;
+static int idx_external = FALSE;
+/* Write commands are missing, idx_end is still the end of the data */
+static int idx_invalid = FALSE;
+static pthread_mutex_t idx_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* index_push
+* Adds a write command. Called with idx_mutex held.
+*
+* Parameters:
+*   start:      Data file offset of the write command
+*
+* Returns: 0 for success, -1 on allocation failure
+*/
+static int index_push(off_t start) {
+    uint32_t capacity;
+    off_t *new_starts;
+
+    if (idx_count == idx_capacity) {
+        capacity = idx_capacity ? idx_capacity * 2 : 1024;
+        new_starts = (off_t *)realloc(idx_starts, capacity * sizeof(off_t));
+        if (new_starts == NULL) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: realloc failed %s", strerror(errno));
+            return -1;
+        }
+        idx_starts = new_starts;
+        idx_capacity = capacity;
+    }
+    idx_starts[idx_count++] = start;
+    return 0;
+}
+
+/*
+* index_save
+* Appends write command offsets to the saved index.
+*
+* Parameters:
+*   first:      Index of the first write command to save
+*
+* Returns: None, the saved index is dropped on a write error
+*/
+static void index_save(uint32_t first) {
+    uint64_t offsets[256];
+    uint32_t n;
+
+    while (idx_fd >= 0 && first < idx_count) {
+        for (n = 0; n < 256 && first + n < idx_count; n++) {
+            offsets[n] = idx_starts[first + n];
+        }
+        if (write(idx_fd, offsets, n * sizeof(uint64_t)) != (ssize_t)(n * sizeof(uint64_t))) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: saving the index failed %s", strerror(errno));
+            close(idx_fd);
+            idx_fd = -1;
+            unlink(INDEX_FILE_PATH);
+        }
+        first += n;
+    }
+}
+
+/*
+* index_invalidate
+* Drops the write commands after a failure, the saved index too, so that
+* no server loads an incomplete one. Called with idx_mutex held.
+*
+* Parameters: None
+*
+* Returns: None
+*/
+static void index_invalidate(void) {
+    AESDSOC_LOG(LOG_WARNING, "aesdsocket: write command index dropped, rebuilt on the next seek");
+    idx_invalid = TRUE;
+    idx_count = 0;
+    if (idx_fd >= 0) {
+        close(idx_fd);
+        idx_fd = -1;
+        unlink(INDEX_FILE_PATH);
+    }
+}
+
+/*
+* index_scan
+* Indexes the write commands of the data file from idx_end on. Called with
+* idx_mutex held.
+*
+* Parameters:
+*   data_fd:    Data file, -1 to read through the storage
+*   end:        End of the data in the file
+*
+* Returns: 0 for success, -1 on error, the index is invalid then
+*/
+static int index_scan(int data_fd, off_t end) {
+    char *buf = (char *)malloc(INDEX_SCAN_SIZE);
+    ssize_t rd_len;
+    int len;
+    int rc = 0;
+
+    if (buf == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+        rc = -1;
+    }
+    while (rc == 0 && idx_end < end) {
+        len = (end - idx_end < INDEX_SCAN_SIZE) ? end - idx_end : INDEX_SCAN_SIZE;
+        if (data_fd >= 0) {
+            rd_len = pread(data_fd, buf, len, idx_end);
+        }
+        else if ((rd_len = aesdsoc_storage->read(idx_end, buf, len)) == 0) {
+            /* Dropped meanwhile */
+            errno = ENODATA;
+        }
+        if (rd_len <= 0) {
+            if (rd_len < 0 && errno == EINTR) {
+                continue;
+            }
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: index scan failed %s", strerror(errno));
+            rc = -1;
+            break;
+        }
+        for (ssize_t i = 0; i < rd_len && rc == 0; i++) {
+            if (!idx_open) {
+                rc = index_push(idx_end + i);
+            }
+            idx_open = (buf[i] != '\n');
+        }
+        idx_end += rd_len;
+    }
+    free(buf);
+    if (rc) {
+        index_invalidate();
+        idx_end = end;
+    }
+    return rc;
+}
+
+/*
+* index_load
+* Loads the saved index, if it matches the data file. Called with idx_mutex
+* held.
+*
+* Parameters:
+*   end:        End of the data in the data file
+*
+* Returns: None
+*/
+static void index_load(off_t end) {
+    uint64_t offsets[256];
+    struct stat st;
+    ssize_t rd_len;
+    off_t pos = 0;
+    int fd = open(INDEX_FILE_PATH, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) == 0) {
+        while (pos + (off_t)sizeof(uint64_t) <= st.st_size) {
+            rd_len = pread(fd, offsets, sizeof(offsets), pos);
+            if (rd_len < (ssize_t)sizeof(uint64_t)) {
+                break;
+            }
+            for (int i = 0; i < rd_len / (ssize_t)sizeof(uint64_t); i++) {
+                /* Offsets only grow and stay within the data */
+                if ((off_t)offsets[i] >= end || (idx_count == 0 && offsets[i] != 0) ||
+                    (idx_count > 0 && (off_t)offsets[i] <= idx_starts[idx_count - 1]) ||
+                    index_push(offsets[i])) {
+                    idx_count = 0;
+                    goto done;
+                }
+            }
+            pos += rd_len - rd_len % sizeof(uint64_t);
+        }
+    }
+done:
+    close(fd);
+    /* The scan goes on from the start of the last saved write command */
+    if (idx_count > 0) {
+        idx_count--;
+        idx_end = idx_starts[idx_count];
+    }
+}
+
+/*
+* index_build_locked
+* Indexes the whole data file from idx_origin on and rewrites the saved
+* index, which drops a partly saved or stale one. Called with idx_mutex held.
+*
+* Parameters:
+*   data_fd:    Data file, -1 to read through the storage, never saved
+*   end:        End of the data in the file
+*   load:       TRUE to start from the saved index
+*
+* Returns: 0 for success, -1 on error
+*/
+static int index_build_locked(int data_fd, off_t end, int load) {
+    int rc;
+
+    idx_data_fd = data_fd;
+    idx_count = 0;
+    idx_end = idx_origin;
+    idx_open = FALSE;
+    idx_invalid = FALSE;
+    if (load && aesdsoc_index_persist && data_fd >= 0) {
+        index_load(end);
+    }
+    rc = index_scan(data_fd, end);
+    if (rc == 0 && aesdsoc_index_persist && data_fd >= 0) {
+        if (idx_fd >= 0) {
+            close(idx_fd);
+        }
+        idx_fd = open(INDEX_FILE_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+            0666);
+        if (idx_fd < 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: open %s failed %s", INDEX_FILE_PATH,
+                strerror(errno));
+        }
+        index_save(0);
+    }
+    AESDSOC_LOG(LOG_DEBUG, "aesdsocket: %u write commands in the data file", idx_count);
+    return rc;
+}
+
+/*
+* index_build
+*
+* Parameters:
+*   data_fd:    Data file
+*   end:        End of the data in the file
+*   load:       TRUE to start from the saved index
+*
+* Returns: 0 for success, -1 on error
+*/
+static int index_build(int data_fd, off_t end, int load) {
+    int rc;
+
+    pthread_mutex_lock(&idx_mutex);
+    rc = index_build_locked(data_fd, end, load);
+    pthread_mutex_unlock(&idx_mutex);
+    return rc;
+}
+
+/*
+* aesdsoc_index_open
+* Builds the index of an opened data file.
+*
+* Parameters:
+*   data_fd:    Data file
+*   end:        End of the data in the file
+*
+* Returns: 0 for success, -1 on error
+*/
+int aesdsoc_index_open(int data_fd, off_t end) {
+    return index_build(data_fd, end, TRUE);
+}
+
+/*
+* aesdsoc_index_open_storage
+* Builds the index of a storage without a single data file, reading it
+* through aesdsoc_storage->read(). Nothing is saved.
+*
+* Parameters:
+*   base:       Write command number of the first write command
+*   start:      Storage offset of the oldest data, where it starts
+*   end:        End of the data
+*
+* Returns: 0 for success, -1 on error
+*/
+int aesdsoc_index_open_storage(uint32_t base, off_t start, off_t end) {
+    int rc;
+
+    pthread_mutex_lock(&idx_mutex);
+    idx_base = base;
+    idx_origin = start;
+    rc = index_build_locked(-1, end, FALSE);
+    pthread_mutex_unlock(&idx_mutex);
+    return rc;
+}
+
+/*
+* aesdsoc_index_rebuild
+* Builds the index again after a failed append left it out of step with
+* the data file.
+*
+* Parameters:
+*   data_fd:    Data file, -1 to read through the storage
+*   end:        End of the data in the file
+*
+* Returns: 0 for success, -1 on error
+*/
+int aesdsoc_index_rebuild(int data_fd, off_t end) {
+    return index_build(data_fd, end, FALSE);
+}
+
+/*
+* aesdsoc_index_close
+*
+* Parameters:
+*   keep:       TRUE to leave the saved index for the next server
+*
+* Returns: None
+*/
+void aesdsoc_index_close(int keep) {
+    pthread_mutex_lock(&idx_mutex);
+    if (idx_fd >= 0) {
+        close(idx_fd);
+        idx_fd = -1;
+        if (!keep) {
+            unlink(INDEX_FILE_PATH);
+        }
+    }
+    free(idx_starts);
+    idx_starts = NULL;
+    idx_count = 0;
+    idx_capacity = 0;
+    idx_end = 0;
+    idx_base = 0;
+    idx_origin = 0;
+    idx_open = FALSE;
+    idx_data_fd = -1;
+    idx_external = FALSE;
+    idx_invalid = FALSE;
+    pthread_mutex_unlock(&idx_mutex);
+}
+
+/*
+* aesdsoc_index_external
+* Tells the index that the data file is also written without
+* aesdsoc_index_add(), it catches up by scanning on every seek from now on.
+*
+* Parameters: None
+*
+* Returns: None
+*/
+void aesdsoc_index_external(void) {
+    pthread_mutex_lock(&idx_mutex);
+    idx_external = TRUE;
+    pthread_mutex_unlock(&idx_mutex);
+}
+
+/*
+* aesdsoc_index_drop
+* Drops the write commands that end before start, the oldest data now.
+* A write command running across start is kept, from start on.
+*
+* Parameters:
+*   start:      Storage offset of the oldest data kept
+*
+* Returns: Write command number of the write command holding start
+*/
+uint32_t aesdsoc_index_drop(off_t start) {
+    uint32_t drop = 0;
+    uint32_t base;
+
+    pthread_mutex_lock(&idx_mutex);
+    /* An invalid index is rebuilt from the new origin, numbered from base */
+    while (!idx_invalid && drop < idx_count &&
+        ((drop + 1 < idx_count) ? idx_starts[drop + 1] : idx_end) <= start) {
+        drop++;
+    }
+    memmove(idx_starts, idx_starts + drop, (idx_count - drop) * sizeof(off_t));
+    idx_count -= drop;
+    idx_base += drop;
+    if (idx_count > 0 && idx_starts[0] < start) {
+        idx_starts[0] = start;
+    }
+    idx_origin = start;
+    base = idx_base;
+    pthread_mutex_unlock(&idx_mutex);
+    return base;
+}
+
+/*
+* aesdsoc_index_add
+* Indexes packets about to be appended. A write command ends after each
+* '\n' byte, as in index_scan(), so a binary record holding several lines
+* is several write commands. Called before the append, which may modify iov.
+*
+* Parameters:
+*   iov:        Packets
+*   count:      Number of entries in iov
+*
+* Returns: None
+*/
+void aesdsoc_index_add(const struct iovec *iov, int count) {
+    const char *data;
+    const char *nl;
+    size_t pos;
+    uint32_t first;
+
+    pthread_mutex_lock(&idx_mutex);
+    if (idx_external) {
+        pthread_mutex_unlock(&idx_mutex);
+        return;
+    }
+    first = idx_count;
+    for (int i = 0; i < count; i++) {
+        data = (const char *)iov[i].iov_base;
+        for (pos = 0; pos < iov[i].iov_len; pos = nl - data + 1) {
+            /* The append writes every packet, the end has to follow all of them */
+            if (!idx_open && !idx_invalid && index_push(idx_end + pos)) {
+                index_invalidate();
+            }
+            nl = memchr(data + pos, '\n', iov[i].iov_len - pos);
+            idx_open = (nl == NULL);
+            if (nl == NULL) {
+                break;
+            }
+        }
+        idx_end += iov[i].iov_len;
+    }
+    if (!idx_invalid) {
+        index_save(first);
+    }
+    pthread_mutex_unlock(&idx_mutex);
+}
+
+/*
+* aesdsoc_index_seek
+* Resolves AESDCHAR_IOCSEEKTO with the index, after rebuilding an invalid
+* one. Write commands before idx_base were dropped.
+*
+* Parameters:
+*   word:       Write command index
+*   offset:     Byte offset within the write command
+*   pos:        Returns the data file offset
+*
+* Returns: 0 for success, -1 if there is no such write command or offset
+*/
+int aesdsoc_index_seek(uint32_t word, uint32_t offset, off_t *pos) {
+    struct stat st;
+    uint32_t first;
+    off_t end;
+    off_t len;
+    int rc = -1;
+
+    pthread_mutex_lock(&idx_mutex);
+    end = idx_end;
+    if (idx_external && fstat(idx_data_fd, &st) == 0 && st.st_size > end) {
+        end = st.st_size;
+    }
+    if (idx_invalid) {
+        index_build_locked(idx_data_fd, end, FALSE);
+    }
+    else if (end > idx_end) {
+        first = idx_count;
+        if (index_scan(idx_data_fd, end) == 0) {
+            index_save(first);
+        }
+    }
+    if (!idx_invalid && word >= idx_base && word - idx_base < idx_count) {
+        word -= idx_base;
+        len = ((word + 1 < idx_count) ? idx_starts[word + 1] : idx_end) - idx_starts[word];
+        if (offset < len) {
+            *pos = idx_starts[word] + offset;
+            rc = 0;
+        }
+    }
+    pthread_mutex_unlock(&idx_mutex);
+    if (rc) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: seek to %u,%u is outside the data file", word, offset);
+        errno = EINVAL;
+    }
+    return rc;
+}
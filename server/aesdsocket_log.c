@@ -0,0 +1,315 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_log.c
+* @brief Asynchronous logging for aesdsocket
+*
+* AESDSOC_LOG() drops messages above AESDSOC_LOG_LEVEL at compile time and
+* above aesdsoc_log_level at run time, before the arguments are evaluated.
+* The remaining messages are formatted into a ring owned by the calling
+* thread. Each ring has a single producer and a single consumer, so a
+* message costs a vsnprintf() and two atomic operations. A background
+* thread moves the messages to syslog.
+*
+* When the ring is full the message is dropped and counted. Before
+* aesdsoc_log_start() and after aesdsoc_log_stop() messages go to syslog
+* directly.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "queue.h"
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+/* Messages per thread ring, power of two */
+#define LOG_RING_SLOTS              (512)
+#define LOG_MSG_SIZE                (240)
+#define LOG_DRAIN_PERIOD_MS         (10)
+
+typedef struct aesdsoc_log_msg {
+    int level;
+    char text[LOG_MSG_SIZE];
+} aesdsoc_log_msg_t;
+
+typedef struct aesdsoc_log_ring {
+    /* Written by the owner thread only */
+    unsigned head;
+    /* Written by the drain thread only */
+    unsigned tail;
+    /* Set when the owner thread exits, the ring is freed once drained */
+    int orphaned;
+    aesdsoc_log_msg_t msgs[LOG_RING_SLOTS];
+    LIST_ENTRY(aesdsoc_log_ring) entries;
+} aesdsoc_log_ring_t;
+
+/*******************************************************************************
+ * Prototypes
+*******************************************************************************/
+static void *aesdsoc_log_thread(void *argument);
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+int aesdsoc_log_level = AESDSOC_LOG_LEVEL;
+
+static __thread aesdsoc_log_ring_t *log_ring = NULL;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(log_ring_head, aesdsoc_log_ring) log_rings =
+    LIST_HEAD_INITIALIZER(log_rings);
+static pthread_t log_thread;
+static int log_running = FALSE;
+static volatile int log_stop = FALSE;
+static unsigned long log_dropped = 0;
+
+static const char *log_level_names[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug",
+};
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* aesdsoc_log_ring_exit
+* Thread specific data destructor, hands the ring of an exiting thread over
+* to the drain thread.
+*
+* Parameters:
+*   argument:   Ring of the exiting thread
+*
+* Returns: None
+*/
+static void aesdsoc_log_ring_exit(void *argument) {
+    aesdsoc_log_ring_t *ring = (aesdsoc_log_ring_t *)argument;
+    __atomic_store_n(&ring->orphaned, TRUE, __ATOMIC_RELEASE);
+}
+
+/*
+* aesdsoc_log_key_init
+*
+* Parameters: None
+*
+* Returns: None
+*/
+static void aesdsoc_log_key_init(void) {
+    pthread_key_create(&log_ring_key, aesdsoc_log_ring_exit);
+}
+
+/*
+* aesdsoc_log_ring_get
+*
+* Parameters: None
+*
+* Returns: Ring of the calling thread, created on first use, or NULL
+*/
+static aesdsoc_log_ring_t *aesdsoc_log_ring_get(void) {
+    aesdsoc_log_ring_t *ring = log_ring;
+
+    if (ring != NULL) {
+        return ring;
+    }
+    ring = (aesdsoc_log_ring_t *)calloc(1, sizeof(aesdsoc_log_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    pthread_once(&log_key_once, aesdsoc_log_key_init);
+    pthread_setspecific(log_ring_key, ring);
+    pthread_mutex_lock(&log_rings_mutex);
+    LIST_INSERT_HEAD(&log_rings, ring, entries);
+    pthread_mutex_unlock(&log_rings_mutex);
+    log_ring = ring;
+    return ring;
+}
+
+/*
+* aesdsoc_log
+* Queues a message for syslog. Use AESDSOC_LOG(), which filters by level
+* first.
+*
+* Parameters:
+*   level:      syslog level
+*   format:     printf format
+*
+* Returns: None
+*/
+void aesdsoc_log(int level, const char *format, ...) {
+    aesdsoc_log_ring_t *ring;
+    aesdsoc_log_msg_t *msg;
+    unsigned head;
+    va_list args;
+
+    va_start(args, format);
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE) ||
+        (ring = aesdsoc_log_ring_get()) == NULL) {
+        vsyslog(level, format, args);
+        va_end(args);
+        return;
+    }
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
+    }
+    msg = &ring->msgs[head & (LOG_RING_SLOTS - 1)];
+    msg->level = level;
+    vsnprintf(msg->text, sizeof(msg->text), format, args);
+    va_end(args);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+* aesdsoc_log_drain
+* Moves all queued messages to syslog and frees the rings of exited threads.
+*
+* Parameters: None
+*
+* Returns: None
+*/
+static void aesdsoc_log_drain(void) {
+    aesdsoc_log_ring_t *ring;
+    aesdsoc_log_ring_t *next;
+    aesdsoc_log_msg_t *msg;
+    unsigned head;
+    unsigned tail;
+    unsigned long dropped;
+    int orphaned;
+
+    pthread_mutex_lock(&log_rings_mutex);
+    for (ring = LIST_FIRST(&log_rings); ring != NULL; ring = next) {
+        next = LIST_NEXT(ring, entries);
+        /* Read orphaned first, the owner does not log after setting it */
+        orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail; tail != head; tail++) {
+            msg = &ring->msgs[tail & (LOG_RING_SLOTS - 1)];
+            syslog(msg->level, "%s", msg->text);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        if (orphaned) {
+            LIST_REMOVE(ring, entries);
+            free(ring);
+        }
+    }
+    pthread_mutex_unlock(&log_rings_mutex);
+
+    dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        syslog(LOG_WARNING, "aesdsocket: %lu log messages dropped", dropped);
+    }
+}
+
+/*
+* aesdsoc_log_thread
+* Drains the rings every LOG_DRAIN_PERIOD_MS until aesdsoc_log_stop().
+*
+* Parameters:
+*   argument:   Unused
+*
+* Returns: argument
+*/
+static void *aesdsoc_log_thread(void *argument) {
+    struct timespec period = {
+        .tv_sec = 0,
+        .tv_nsec = LOG_DRAIN_PERIOD_MS * 1000000L,
+    };
+
+    while (!log_stop) {
+        nanosleep(&period, NULL);
+        aesdsoc_log_drain();
+    }
+    return argument;
+}
+
+/*
+* aesdsoc_log_start
+* Starts the drain thread. Called after daemon(), threads do not survive
+* the fork.
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 if the thread cannot be started
+*/
+int aesdsoc_log_start(void) {
+    log_stop = FALSE;
+    if (aesdsoc_thread_create(&log_thread, aesdsoc_log_thread, NULL) != 0) {
+        syslog(LOG_ERR, "aesdsocket: log thread cannot be started");
+        return -1;
+    }
+    __atomic_store_n(&log_running, TRUE, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+* aesdsoc_log_stop
+* Stops the drain thread and flushes the queued messages. Later messages
+* go to syslog directly. Called once all other threads have exited.
+*
+* Parameters: None
+*
+* Returns: None
+*/
+void aesdsoc_log_stop(void) {
+    aesdsoc_log_ring_t *ring;
+
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&log_running, FALSE, __ATOMIC_RELEASE);
+    log_stop = TRUE;
+    pthread_join(log_thread, NULL);
+    aesdsoc_log_drain();
+
+    /* Every thread but the caller has exited by now */
+    pthread_mutex_lock(&log_rings_mutex);
+    while ((ring = LIST_FIRST(&log_rings)) != NULL) {
+        LIST_REMOVE(ring, entries);
+        if (ring == log_ring) {
+            pthread_setspecific(log_ring_key, NULL);
+            log_ring = NULL;
+        }
+        free(ring);
+    }
+    pthread_mutex_unlock(&log_rings_mutex);
+}
+
+/*
+* aesdsoc_log_parse_level
+*
+* Parameters:
+*   name:       Level name, "emerg" to "debug"
+*
+* Returns: syslog level, or -1 if the name is unknown
+*/
+int aesdsoc_log_parse_level(const char *name) {
+    for (int i = 0; i < (int)(sizeof(log_level_names) / sizeof(log_level_names[0])); i++) {
+        if (strcmp(name, log_level_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,390 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_metrics.c
+* @brief Counters and latency histograms of aesdsocket
+*
+* Every thread updates its own block of counters, so the hot path never
+* shares a cache line or takes a lock. The blocks are only summed when a
+* client asks for the metrics with the AESDSOCKET_METRICS command. The
+* counts of exited threads are folded into a retired block.
+*
+* Latency histograms use power of two buckets in microseconds.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+* CREDIT: Prometheus text exposition format
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "queue.h"
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+/* Bucket i counts latencies below 2^i us, the last one is +Inf */
+#define METRICS_HIST_BUCKETS        (22)
+#define METRICS_TEXT_SIZE           (8192)
+
+typedef struct aesdsoc_metrics_block {
+    unsigned long counters[AESDSOC_METRIC_COUNT];
+    unsigned long hist[AESDSOC_HIST_COUNT][METRICS_HIST_BUCKETS];
+    unsigned long hist_sum_ns[AESDSOC_HIST_COUNT];
+    LIST_ENTRY(aesdsoc_metrics_block) entries;
+} aesdsoc_metrics_block_t;
+
+typedef struct aesdsoc_metrics_text {
+    char *text;
+    int len;
+    int size;
+} aesdsoc_metrics_text_t;
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+static __thread aesdsoc_metrics_block_t *metrics_block = NULL;
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(metrics_block_head, aesdsoc_metrics_block) metrics_blocks =
+    LIST_HEAD_INITIALIZER(metrics_blocks);
+/* Counts of exited threads, protected by metrics_mutex */
+static aesdsoc_metrics_block_t metrics_retired;
+
+static const char *metric_names[AESDSOC_METRIC_COUNT] = {
+    [AESDSOC_METRIC_ACCEPTED]   = "aesdsocket_connections_accepted_total",
+    [AESDSOC_METRIC_BYTES_IN]   = "aesdsocket_received_bytes_total",
+    [AESDSOC_METRIC_BYTES_OUT]  = "aesdsocket_sent_bytes_total",
+    [AESDSOC_METRIC_COMMITTED]  = "aesdsocket_packets_committed_total",
+    [AESDSOC_METRIC_SEEKS]      = "aesdsocket_seeks_total",
+    [AESDSOC_METRIC_REPLIES]    = "aesdsocket_replies_total",
+    [AESDSOC_METRIC_ERRORS]     = "aesdsocket_errors_total",
+    [AESDSOC_METRIC_REJECTED]   = "aesdsocket_connections_rejected_total",
+};
+
+static const char *hist_names[AESDSOC_HIST_COUNT] = {
+    [AESDSOC_HIST_RECV_COMMIT]  = "aesdsocket_recv_to_commit_seconds",
+    [AESDSOC_HIST_COMMIT_REPLY] = "aesdsocket_commit_to_reply_seconds",
+};
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* aesdsoc_metrics_fold
+* Adds the counts of one block to another.
+*
+* Parameters:
+*   to:         Block to add to
+*   from:       Block to add
+*
+* Returns: None
+*/
+static void aesdsoc_metrics_fold(aesdsoc_metrics_block_t *to,
+    aesdsoc_metrics_block_t *from) {
+    for (int i = 0; i < AESDSOC_METRIC_COUNT; i++) {
+        to->counters[i] += __atomic_load_n(&from->counters[i], __ATOMIC_RELAXED);
+    }
+    for (int h = 0; h < AESDSOC_HIST_COUNT; h++) {
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            to->hist[h][b] += __atomic_load_n(&from->hist[h][b], __ATOMIC_RELAXED);
+        }
+        to->hist_sum_ns[h] += __atomic_load_n(&from->hist_sum_ns[h], __ATOMIC_RELAXED);
+    }
+}
+
+/*
+* aesdsoc_metrics_exit
+* Thread specific data destructor, keeps the counts of an exiting thread.
+*
+* Parameters:
+*   argument:   Block of the exiting thread
+*
+* Returns: None
+*/
+static void aesdsoc_metrics_exit(void *argument) {
+    aesdsoc_metrics_block_t *block = (aesdsoc_metrics_block_t *)argument;
+
+    pthread_mutex_lock(&metrics_mutex);
+    LIST_REMOVE(block, entries);
+    aesdsoc_metrics_fold(&metrics_retired, block);
+    pthread_mutex_unlock(&metrics_mutex);
+    free(block);
+}
+
+/*
+* aesdsoc_metrics_key_init
+*
+* Parameters: None
+*
+* Returns: None
+*/
+static void aesdsoc_metrics_key_init(void) {
+    pthread_key_create(&metrics_key, aesdsoc_metrics_exit);
+}
+
+/*
+* aesdsoc_metrics_get
+*
+* Parameters: None
+*
+* Returns: Block of the calling thread, created on first use, or NULL
+*/
+static aesdsoc_metrics_block_t *aesdsoc_metrics_get(void) {
+    aesdsoc_metrics_block_t *block = metrics_block;
+
+    if (block != NULL) {
+        return block;
+    }
+    block = (aesdsoc_metrics_block_t *)calloc(1, sizeof(aesdsoc_metrics_block_t));
+    if (block == NULL) {
+        return NULL;
+    }
+    pthread_once(&metrics_key_once, aesdsoc_metrics_key_init);
+    pthread_setspecific(metrics_key, block);
+    pthread_mutex_lock(&metrics_mutex);
+    LIST_INSERT_HEAD(&metrics_blocks, block, entries);
+    pthread_mutex_unlock(&metrics_mutex);
+    metrics_block = block;
+    return block;
+}
+
+/*
+* aesdsoc_metrics_inc
+* Increments a counter of the calling thread. Only the owner writes it, so
+* a relaxed load and store is enough.
+*
+* Parameters:
+*   counter:    Counter
+*   value:      Increment
+*
+* Returns: None
+*/
+static inline void aesdsoc_metrics_inc(unsigned long *counter, unsigned long value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+        __ATOMIC_RELAXED);
+}
+
+/*
+* aesdsoc_metric_add
+*
+* Parameters:
+*   metric:     AESDSOC_METRIC_*
+*   value:      Increment
+*
+* Returns: None
+*/
+void aesdsoc_metric_add(int metric, unsigned long value) {
+    aesdsoc_metrics_block_t *block = aesdsoc_metrics_get();
+
+    if (block != NULL) {
+        aesdsoc_metrics_inc(&block->counters[metric], value);
+    }
+}
+
+/*
+* aesdsoc_metric_observe
+* Records a latency in a histogram.
+*
+* Parameters:
+*   hist:       AESDSOC_HIST_*
+*   ns:         Latency in nanoseconds
+*
+* Returns: None
+*/
+void aesdsoc_metric_observe(int hist, uint64_t ns) {
+    aesdsoc_metrics_block_t *block = aesdsoc_metrics_get();
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+
+    if (block == NULL) {
+        return;
+    }
+    if (us > 0) {
+        /* Smallest i with us < 2^i */
+        bucket = 64 - __builtin_clzll(us);
+    }
+    if (bucket >= METRICS_HIST_BUCKETS) {
+        bucket = METRICS_HIST_BUCKETS - 1;
+    }
+    aesdsoc_metrics_inc(&block->hist[hist][bucket], 1);
+    aesdsoc_metrics_inc(&block->hist_sum_ns[hist], ns);
+}
+
+/*
+* aesdsoc_metrics_now
+*
+* Parameters: None
+*
+* Returns: Monotonic time in nanoseconds
+*/
+uint64_t aesdsoc_metrics_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+* aesdsoc_metrics_sum
+* Adds up the blocks of all threads.
+*
+* Parameters:
+*   total:      Returns the sum
+*
+* Returns: None
+*/
+static void aesdsoc_metrics_sum(aesdsoc_metrics_block_t *total) {
+    aesdsoc_metrics_block_t *block;
+
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&metrics_mutex);
+    aesdsoc_metrics_fold(total, &metrics_retired);
+    LIST_FOREACH(block, &metrics_blocks, entries) {
+        aesdsoc_metrics_fold(total, block);
+    }
+    pthread_mutex_unlock(&metrics_mutex);
+}
+
+/*
+* aesdsoc_metric_total
+*
+* Parameters:
+*   metric:     AESDSOC_METRIC_*
+*
+* Returns: Sum of the counter over all threads
+*/
+unsigned long aesdsoc_metric_total(int metric) {
+    aesdsoc_metrics_block_t total;
+
+    aesdsoc_metrics_sum(&total);
+    return total.counters[metric];
+}
+
+/*
+* aesdsoc_metrics_printf
+* Appends to the metrics text, growing it as needed.
+*
+* Parameters:
+*   out:        Text
+*   format:     printf format
+*
+* Returns: 0 for success, -1 on allocation failure
+*/
+static int aesdsoc_metrics_printf(aesdsoc_metrics_text_t *out, const char *format, ...) {
+    va_list args;
+    char *new_text;
+    int len;
+
+    while (1) {
+        va_start(args, format);
+        len = vsnprintf(out->text + out->len, out->size - out->len, format, args);
+        va_end(args);
+        if (len < out->size - out->len) {
+            out->len += len;
+            return 0;
+        }
+        new_text = (char *)realloc(out->text, out->size * 2);
+        if (new_text == NULL) {
+            return -1;
+        }
+        out->text = new_text;
+        out->size *= 2;
+    }
+}
+
+/*
+* aesdsoc_metrics_render
+* Formats all metrics in the Prometheus text format.
+*
+* Parameters:
+*   text:       Returns a malloc'ed buffer with the text, freed by the caller
+*
+* Returns: Text length in bytes, or -1 on allocation failure
+*/
+int aesdsoc_metrics_render(char **text) {
+    aesdsoc_metrics_block_t total;
+    aesdsoc_metrics_text_t out;
+    unsigned long count;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long batches;
+    unsigned long records;
+    unsigned long snap_hits;
+    unsigned long snap_misses;
+    long buffered;
+    int clients;
+    int rc = 0;
+
+    out.size = METRICS_TEXT_SIZE;
+    out.len = 0;
+    out.text = (char *)malloc(out.size);
+    if (out.text == NULL) {
+        return -1;
+    }
+    aesdsoc_metrics_sum(&total);
+    aesdsoc_buf_stats(&hits, &misses);
+    aesdsoc_commit_stats(&batches, &records);
+    aesdsoc_admit_stats(&clients, &buffered);
+    aesdsoc_snapshot_stats(&snap_hits, &snap_misses);
+
+    for (int i = 0; i < AESDSOC_METRIC_COUNT; i++) {
+        rc |= aesdsoc_metrics_printf(&out, "# TYPE %s counter\n%s %lu\n",
+            metric_names[i], metric_names[i], total.counters[i]);
+    }
+    rc |= aesdsoc_metrics_printf(&out,
+        "# TYPE aesdsocket_buffer_pool_hits_total counter\n"
+        "aesdsocket_buffer_pool_hits_total %lu\n"
+        "# TYPE aesdsocket_buffer_pool_misses_total counter\n"
+        "aesdsocket_buffer_pool_misses_total %lu\n"
+        "# TYPE aesdsocket_commit_batches_total counter\n"
+        "aesdsocket_commit_batches_total %lu\n"
+        "# TYPE aesdsocket_reply_snapshot_hits_total counter\n"
+        "aesdsocket_reply_snapshot_hits_total %lu\n"
+        "# TYPE aesdsocket_reply_snapshot_misses_total counter\n"
+        "aesdsocket_reply_snapshot_misses_total %lu\n"
+        "# TYPE aesdsocket_connections gauge\n"
+        "aesdsocket_connections %d\n"
+        "# TYPE aesdsocket_buffered_bytes gauge\n"
+        "aesdsocket_buffered_bytes %ld\n",
+        hits, misses, batches, snap_hits, snap_misses, clients, buffered);
+
+    for (int h = 0; h < AESDSOC_HIST_COUNT; h++) {
+        rc |= aesdsoc_metrics_printf(&out, "# TYPE %s histogram\n", hist_names[h]);
+        count = 0;
+        for (int b = 0; b < METRICS_HIST_BUCKETS - 1; b++) {
+            count += total.hist[h][b];
+            rc |= aesdsoc_metrics_printf(&out, "%s_bucket{le=\"%.9g\"} %lu\n",
+                hist_names[h], (double)(1UL << b) / 1e6, count);
+        }
+        count += total.hist[h][METRICS_HIST_BUCKETS - 1];
+        rc |= aesdsoc_metrics_printf(&out,
+            "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9f\n%s_count %lu\n",
+            hist_names[h], count, hist_names[h],
+            (double)total.hist_sum_ns[h] / 1e9, hist_names[h], count);
+    }
+    if (rc) {
+        free(out.text);
+        return -1;
+    }
+    *text = out.text;
+    return out.len;
+}
@@ -0,0 +1,438 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_mmap.c
+* @brief Memory mapped log storage of aesdsocket
+*
+* The "mmap" backend keeps /var/tmp/aesdsocketdata like the "file" backend,
+* but grows it by MMAP_EXTENT_SIZE extents with fallocate() and maps every
+* extent once. Appends are a memcpy() into the mapping followed by a release
+* store of the tail offset, replies read the tail and copy straight out of
+* the mapping. Readers take no lock: an extent is mapped before the tail
+* moves into it and stays mapped until the server exits.
+*
+* A server holds an exclusive flock() on the file while it uses it, so a new
+* server taking over with -u waits until the old one has written its last
+* timestamp and cut the file back before it looks for the tail.
+*
+* AESDCHAR_IOCSEEKTO is resolved with the index of aesdsocket_index.c.
+*
+* The sync policy (-f) picks msync(MS_SYNC) or msync(MS_ASYNC) of the bytes
+* appended since the last batch. The file is cut back to the tail on exit
+* and the tail is saved in the MMAP_TAIL_XATTR attribute, so records ending
+* in '\0' survive. After a crash the file ends with the zeroed rest of an
+* extent, which is dropped when the file is opened again.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define MMAP_FILE_PATH              ("/var/tmp/aesdsocketdata")
+/* Size of one fallocate() and mmap() step, a multiple of the page size */
+#define MMAP_EXTENT_SIZE            (4 * 1024 * 1024)
+/* Extents of one log, 64GB */
+#define MMAP_MAX_EXTENTS            (16384)
+/* Tail of a cleanly closed log, removed while a server uses it */
+#define MMAP_TAIL_XATTR             ("user.aesdsocket.tail")
+
+/*******************************************************************************
+ * Prototypes
+*******************************************************************************/
+static int mmap_open(void);
+static void mmap_close(int keep);
+static int mmap_append(struct iovec *iov, int count);
+static int mmap_read(off_t start, char *buf, int len);
+static off_t mmap_size(void);
+static int mmap_seek(uint32_t word, uint32_t offset, off_t *pos);
+static int mmap_flush(void);
+static int mmap_fd(void);
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+const aesdsoc_storage_t aesdsoc_mmap_storage = {
+    .name         = "mmap",
+    .timestamps   = TRUE,
+    .regular_file = FALSE,
+    .sendfile     = TRUE,
+    .stable_offsets = TRUE,
+    .open         = mmap_open,
+    .close        = mmap_close,
+    .append       = mmap_append,
+    .read         = mmap_read,
+    .size         = mmap_size,
+    .seek         = mmap_seek,
+    .flush        = mmap_flush,
+    .fd           = mmap_fd,
+};
+
+static int mmap_desc = -1;
+/* Mapped extents, mmap_extent[i] maps file offset i * MMAP_EXTENT_SIZE */
+static char *mmap_extent[MMAP_MAX_EXTENTS];
+static int mmap_extents = 0;
+/* End of the complete packets, published with a release store */
+static off_t mmap_tail = 0;
+/* Tail at the last msync() */
+static off_t mmap_synced = 0;
+/* Serializes appends and flushes, never taken by readers */
+static pthread_mutex_t mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* mmap_extend
+* Allocates and maps one more extent at the end of the file.
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+static int mmap_extend(void) {
+    off_t start = (off_t)mmap_extents * MMAP_EXTENT_SIZE;
+    struct stat st;
+    char *map;
+    int rc;
+
+    if (mmap_extents == MMAP_MAX_EXTENTS) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: %s is full", MMAP_FILE_PATH);
+        errno = EFBIG;
+        return -1;
+    }
+    if (fstat(mmap_desc, &st)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: fstat failed %s", strerror(errno));
+        return -1;
+    }
+    if (st.st_size < start + MMAP_EXTENT_SIZE) {
+        rc = fallocate(mmap_desc, 0, start, MMAP_EXTENT_SIZE);
+        if (rc && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+            /* Sparse extent, blocks are allocated by the page faults */
+            rc = ftruncate(mmap_desc, start + MMAP_EXTENT_SIZE);
+        }
+        if (rc) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: fallocate failed %s", strerror(errno));
+            return -1;
+        }
+    }
+    map = mmap(NULL, MMAP_EXTENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mmap_desc, start);
+    if (map == MAP_FAILED) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: mmap failed %s", strerror(errno));
+        return -1;
+    }
+    mmap_extent[mmap_extents] = map;
+    mmap_extents++;
+    return 0;
+}
+
+/*
+* mmap_unmap
+*
+* Parameters: None
+*
+* Returns: None
+*/
+static void mmap_unmap(void) {
+    for (int i = 0; i < mmap_extents; i++) {
+        munmap(mmap_extent[i], MMAP_EXTENT_SIZE);
+        mmap_extent[i] = NULL;
+    }
+    mmap_extents = 0;
+}
+
+/*
+* mmap_find_tail
+* Finds the end of the complete packets of the log just mapped. A clean close
+* cut the file back to the tail and saved it, otherwise the zeroed rest of the
+* last extent is dropped.
+*
+* Parameters:
+*   size:       File size
+*
+* Returns: Tail offset
+*/
+static off_t mmap_find_tail(off_t size) {
+    int64_t saved;
+    off_t tail = size;
+
+    if (fgetxattr(mmap_desc, MMAP_TAIL_XATTR, &saved, sizeof(saved)) == sizeof(saved)) {
+        /* A crash of this server must not find the old tail */
+        fremovexattr(mmap_desc, MMAP_TAIL_XATTR);
+        if (saved == size) {
+            return size;
+        }
+    }
+    /* Extents are only allocated whole, a cut back file is not aligned */
+    if (size % MMAP_EXTENT_SIZE != 0) {
+        return size;
+    }
+    while (tail > 0 &&
+        mmap_extent[(tail - 1) / MMAP_EXTENT_SIZE][(tail - 1) % MMAP_EXTENT_SIZE] == '\0') {
+        tail--;
+        if (size - tail == MMAP_EXTENT_SIZE) {
+            break;
+        }
+    }
+    return tail;
+}
+
+/*
+* mmap_open
+* Maps the existing log and finds its tail.
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+static int mmap_open(void) {
+    struct stat st;
+    off_t tail;
+
+    mmap_desc = open(MMAP_FILE_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (mmap_desc < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: File open Error %s", strerror(errno));
+        return -1;
+    }
+    while (flock(mmap_desc, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: flock failed %s", strerror(errno));
+            goto error;
+        }
+    }
+    if (fstat(mmap_desc, &st)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: fstat failed %s", strerror(errno));
+        goto error;
+    }
+    while ((off_t)mmap_extents * MMAP_EXTENT_SIZE < st.st_size) {
+        if (mmap_extend()) {
+            goto error;
+        }
+    }
+    tail = mmap_find_tail(st.st_size);
+    mmap_tail = tail;
+    mmap_synced = tail;
+    if (aesdsoc_index_open(mmap_desc, tail)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: indexing %s failed", MMAP_FILE_PATH);
+        goto error;
+    }
+    return 0;
+
+error:
+    mmap_unmap();
+    close(mmap_desc);
+    mmap_desc = -1;
+    return -1;
+}
+
+/*
+* mmap_close
+* Unmaps the log, cuts the file back to the tail and saves the tail. Closing
+* the file releases the lock for the next server.
+*
+* Parameters:
+*   keep:       TRUE to leave the data file for the next server
+*
+* Returns: None
+*/
+static void mmap_close(int keep) {
+    int64_t saved;
+
+    aesdsoc_index_close(keep);
+    mmap_unmap();
+    if (keep && ftruncate(mmap_desc, mmap_tail)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: ftruncate failed %s", strerror(errno));
+    }
+    else if (keep) {
+        saved = mmap_tail;
+        /* Without it an extent aligned tail is scanned for again */
+        if (fsetxattr(mmap_desc, MMAP_TAIL_XATTR, &saved, sizeof(saved), 0) &&
+            errno != ENOTSUP) {
+            AESDSOC_LOG(LOG_WARNING, "aesdsocket: saving the tail failed %s", strerror(errno));
+        }
+    }
+    close(mmap_desc);
+    mmap_desc = -1;
+    mmap_tail = 0;
+    mmap_synced = 0;
+    if (!keep && remove(MMAP_FILE_PATH)) {
+        printf("Error file removal\n");
+    }
+}
+
+/*
+* mmap_append
+* Copies the packets behind the tail, then moves the tail past all of them.
+*
+* Parameters:
+*   iov:        Packets
+*   count:      Number of entries in iov
+*
+* Returns: 0 for success, -1 on error
+*/
+static int mmap_append(struct iovec *iov, int count) {
+    off_t tail;
+    size_t done;
+    size_t len;
+    size_t room;
+    int rc = 0;
+
+    pthread_mutex_lock(&mmap_mutex);
+    aesdsoc_index_add(iov, count);
+    tail = mmap_tail;
+    for (int i = 0; i < count && rc == 0; i++) {
+        for (done = 0; done < iov[i].iov_len; done += len) {
+            if (tail == (off_t)mmap_extents * MMAP_EXTENT_SIZE && mmap_extend()) {
+                rc = -1;
+                break;
+            }
+            len = iov[i].iov_len - done;
+            room = MMAP_EXTENT_SIZE - tail % MMAP_EXTENT_SIZE;
+            if (len > room) {
+                len = room;
+            }
+            memcpy(mmap_extent[tail / MMAP_EXTENT_SIZE] + tail % MMAP_EXTENT_SIZE,
+                (char *)iov[i].iov_base + done, len);
+            tail += len;
+        }
+    }
+    /* A failed batch is not published, the next one overwrites it */
+    if (rc == 0) {
+        __atomic_store_n(&mmap_tail, tail, __ATOMIC_RELEASE);
+    }
+    else {
+        aesdsoc_index_rebuild(mmap_desc, mmap_tail);
+    }
+    pthread_mutex_unlock(&mmap_mutex);
+    return rc;
+}
+
+/*
+* mmap_read
+* Copies from the mapping, up to the end of the extent holding start.
+*
+* Parameters:
+*   start:      Storage offset
+*   buf:        Destination
+*   len:        Size of buf
+*
+* Returns: Number of bytes read, 0 at the end
+*/
+static int mmap_read(off_t start, char *buf, int len) {
+    off_t tail = __atomic_load_n(&mmap_tail, __ATOMIC_ACQUIRE);
+    off_t room = MMAP_EXTENT_SIZE - start % MMAP_EXTENT_SIZE;
+
+    if (start >= tail) {
+        return 0;
+    }
+    if (len > tail - start) {
+        len = tail - start;
+    }
+    if (len > room) {
+        len = room;
+    }
+    memcpy(buf, mmap_extent[start / MMAP_EXTENT_SIZE] + start % MMAP_EXTENT_SIZE, len);
+    return len;
+}
+
+/*
+* mmap_size
+*
+* Parameters: None
+*
+* Returns: Tail of the log, always at the end of a complete packet
+*/
+static off_t mmap_size(void) {
+    return __atomic_load_n(&mmap_tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+* mmap_seek
+*
+* Parameters:
+*   word:       Write command index
+*   offset:     Byte offset within the write command
+*   pos:        Returns the data file offset
+*
+* Returns: 0 for success, -1 if the seek failed
+*/
+static int mmap_seek(uint32_t word, uint32_t offset, off_t *pos) {
+    return aesdsoc_index_seek(word, offset, pos);
+}
+
+/*
+* mmap_flush
+* Writes back the pages appended since the last flush, waiting for them
+* unless the sync policy is "async".
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+static int mmap_flush(void) {
+    int flags = (aesdsoc_sync_policy == AESDSOC_SYNC_ASYNC) ? MS_ASYNC : MS_SYNC;
+    long page = sysconf(_SC_PAGESIZE);
+    off_t start;
+    off_t end;
+    int rc = 0;
+
+    pthread_mutex_lock(&mmap_mutex);
+    start = mmap_synced - mmap_synced % page;
+    while (start < mmap_tail) {
+        end = start - start % MMAP_EXTENT_SIZE + MMAP_EXTENT_SIZE;
+        if (end > mmap_tail) {
+            end = mmap_tail;
+        }
+        if (msync(mmap_extent[start / MMAP_EXTENT_SIZE] + start % MMAP_EXTENT_SIZE,
+            end - start, flags)) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: msync failed %s", strerror(errno));
+            rc = -1;
+            break;
+        }
+        start = end;
+    }
+    if (rc == 0) {
+        mmap_synced = mmap_tail;
+    }
+    pthread_mutex_unlock(&mmap_mutex);
+    return rc;
+}
+
+/*
+* mmap_fd
+*
+* Parameters: None
+*
+* Returns: Descriptor of the data file, replies may sendfile() it up to the tail
+*/
+static int mmap_fd(void) {
+    return mmap_desc;
+}
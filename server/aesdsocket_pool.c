@@ -0,0 +1,434 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_pool.c
+* @brief Worker pool connection engine for aesdsocket
+*
+* A fixed number of worker threads is started once. The accept loop puts
+* every accepted client into a bounded job queue and the next idle worker
+* serves it. Job slots come from a preallocated array and are recycled
+* through a free list, so queueing and dequeueing a client is O(1) and no
+* thread is created or joined per connection. When all slots are in use the
+* accept loop waits, which pushes back on the listen backlog.
+*
+* A worker serves a client until its socket has no more data and then gives
+* it to a shared epoll poller. The poller queues the client again once it
+* is readable, so idle keep-open clients do not hold on to the workers and
+* a new client is served even when there are more open clients than
+* workers.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "queue.h"
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define POOL_WORKERS_PER_CPU        (4)
+#define POOL_DEFAULT_QUEUE_DEPTH    (64)
+/* Interval at which blocked workers and the accept loop check for exit */
+#define POOL_EXIT_POLL_MS           (100)
+#define POOL_MAX_EVENTS             (64)
+
+typedef struct aesdsoc_pool_client {
+    aesdsoc_conn_t conn;
+    /* In the epoll set, disarmed while a worker serves it */
+    int registered;
+    LIST_ENTRY(aesdsoc_pool_client) entries;
+} aesdsoc_pool_client_t;
+
+typedef struct aesdsoc_pool_job {
+    /* A new client, or a served one that is readable again */
+    int soc_client;
+    struct sockaddr_storage aesdsoc_addr;
+    aesdsoc_pool_client_t *client;
+    STAILQ_ENTRY(aesdsoc_pool_job) queue_entries;
+    SLIST_ENTRY(aesdsoc_pool_job) free_entries;
+} aesdsoc_pool_job_t;
+
+typedef struct aesdsoc_pool {
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_ready;
+    pthread_cond_t slot_free;
+    aesdsoc_pool_job_t *slots;
+    STAILQ_HEAD(pool_job_queue, aesdsoc_pool_job) jobs;
+    SLIST_HEAD(pool_free_list, aesdsoc_pool_job) free_slots;
+    /* Idle clients between two requests */
+    int epoll_fd;
+    /* Every open client, also guarded by mutex */
+    LIST_HEAD(pool_client_list, aesdsoc_pool_client) clients;
+} aesdsoc_pool_t;
+
+/*******************************************************************************
+ * Prototypes
+*******************************************************************************/
+static int aesdsoc_pool_engine_run(int soc_server);
+static void *aesdsoc_pool_worker(void *argument);
+static void *aesdsoc_pool_poller(void *argument);
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+/* Capacity of the accepted client queue, 0 = POOL_DEFAULT_QUEUE_DEPTH */
+int aesdsoc_queue_depth = 0;
+
+const aesdsoc_engine_t aesdsoc_pool_engine = {
+    .name = "pool",
+    .run  = aesdsoc_pool_engine_run,
+};
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* aesdsoc_pool_timeout
+* Computes the absolute deadline for a timed condition wait.
+*
+* Parameters:
+*   deadline:   Returns now + POOL_EXIT_POLL_MS
+*
+* Returns: None
+*/
+static void aesdsoc_pool_timeout(struct timespec *deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_nsec += POOL_EXIT_POLL_MS * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+* aesdsoc_pool_queue
+* Queues a job for the workers, waits while all slots are in use.
+*
+* Parameters:
+*   pool:           Worker pool
+*   soc_client:     New client socket, or -1
+*   aesdsoc_addr:   Peer address of a new client, or NULL
+*   client:         Served client that is readable again, or NULL
+*
+* Returns: 0 for success, -1 when the pool stops first
+*/
+static int aesdsoc_pool_queue(aesdsoc_pool_t *pool, int soc_client,
+    const struct sockaddr_storage *aesdsoc_addr, aesdsoc_pool_client_t *client) {
+    aesdsoc_pool_job_t *job;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (SLIST_EMPTY(&pool->free_slots) && exit_aesd_soc == FALSE && !pool->stop) {
+        aesdsoc_pool_timeout(&deadline);
+        pthread_cond_timedwait(&pool->slot_free, &pool->mutex, &deadline);
+    }
+    job = (exit_aesd_soc == FALSE && !pool->stop) ? SLIST_FIRST(&pool->free_slots) : NULL;
+    if (job == NULL) {
+        pthread_mutex_unlock(&pool->mutex);
+        return -1;
+    }
+    SLIST_REMOVE_HEAD(&pool->free_slots, free_entries);
+    job->soc_client = soc_client;
+    if (aesdsoc_addr != NULL) {
+        job->aesdsoc_addr = *aesdsoc_addr;
+    }
+    job->client = client;
+    STAILQ_INSERT_TAIL(&pool->jobs, job, queue_entries);
+    pthread_cond_signal(&pool->job_ready);
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+/*
+* aesdsoc_pool_client_close
+*
+* Parameters:
+*   pool:       Worker pool
+*   client:     Client to close and free
+*
+* Returns: None
+*/
+static void aesdsoc_pool_client_close(aesdsoc_pool_t *pool, aesdsoc_pool_client_t *client) {
+    pthread_mutex_lock(&pool->mutex);
+    LIST_REMOVE(client, entries);
+    pthread_mutex_unlock(&pool->mutex);
+    /* Closing the socket also removes it from the epoll set */
+    aesdsoc_conn_release(&client->conn);
+    free(client);
+}
+
+/*
+* aesdsoc_pool_serve
+* Serves a client until its socket has no more data, then hands it to the
+* poller, armed for one readable event.
+*
+* Parameters:
+*   pool:       Worker pool
+*   client:     Client
+*
+* Returns: None
+*/
+static void aesdsoc_pool_serve(aesdsoc_pool_t *pool, aesdsoc_pool_client_t *client) {
+    struct epoll_event event;
+    int op;
+    int rc;
+
+    do {
+        rc = aesdsoc_conn_receive(&client->conn);
+    } while (rc == AESDSOC_CONN_OPEN && exit_aesd_soc == FALSE && !pool->stop);
+    if (rc != AESDSOC_CONN_OPEN && rc != AESDSOC_CONN_AGAIN) {
+        aesdsoc_pool_client_close(pool, client);
+        return;
+    }
+    /* Data arriving before the rearm is reported by it */
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = client;
+    op = client->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    /* Another worker may own the client as soon as it is armed */
+    client->registered = TRUE;
+    if (epoll_ctl(pool->epoll_fd, op, client->conn.soc_client, &event) < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: epoll_ctl failed %s", strerror(errno));
+        aesdsoc_pool_client_close(pool, client);
+    }
+}
+
+/*
+* aesdsoc_pool_poller
+* Queues idle clients again once they are readable.
+*
+* Parameters:
+*   argument:   Pointer to aesdsoc_pool_t
+*
+* Returns: argument
+*/
+static void *aesdsoc_pool_poller(void *argument) {
+    aesdsoc_pool_t *pool = (aesdsoc_pool_t *)argument;
+    struct epoll_event events[POOL_MAX_EVENTS];
+    int count;
+
+    while (exit_aesd_soc == FALSE && !pool->stop) {
+        count = epoll_wait(pool->epoll_fd, events, POOL_MAX_EVENTS, POOL_EXIT_POLL_MS);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: epoll_wait failed %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            /* Left in the client list for the cleanup when stopping */
+            if (aesdsoc_pool_queue(pool, -1, NULL, events[i].data.ptr)) {
+                break;
+            }
+        }
+    }
+    return argument;
+}
+
+/*
+* aesdsoc_pool_worker
+* Takes clients from the job queue and serves them one at a time.
+*
+* Parameters:
+*   argument:   Pointer to aesdsoc_pool_t
+*
+* Returns: argument
+*/
+static void *aesdsoc_pool_worker(void *argument) {
+    aesdsoc_pool_t *pool = (aesdsoc_pool_t *)argument;
+    aesdsoc_pool_job_t *job;
+    aesdsoc_pool_client_t *client;
+    struct timespec deadline;
+    struct sockaddr_storage aesdsoc_addr;
+    int soc_client;
+
+    AESDSOC_LOG(LOG_INFO, "aesdsocket: pool worker started");
+    while (exit_aesd_soc == FALSE && !pool->stop) {
+        pthread_mutex_lock(&pool->mutex);
+        while (STAILQ_EMPTY(&pool->jobs) && exit_aesd_soc == FALSE && !pool->stop) {
+            aesdsoc_pool_timeout(&deadline);
+            pthread_cond_timedwait(&pool->job_ready, &pool->mutex, &deadline);
+        }
+        job = STAILQ_FIRST(&pool->jobs);
+        if (job == NULL || exit_aesd_soc || pool->stop) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        STAILQ_REMOVE_HEAD(&pool->jobs, queue_entries);
+        soc_client = job->soc_client;
+        aesdsoc_addr = job->aesdsoc_addr;
+        client = job->client;
+        SLIST_INSERT_HEAD(&pool->free_slots, job, free_entries);
+        pthread_cond_signal(&pool->slot_free);
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (client == NULL) {
+            client = (aesdsoc_pool_client_t *)calloc(1, sizeof(aesdsoc_pool_client_t));
+            if (client == NULL) {
+                AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+                close(soc_client);
+                continue;
+            }
+            if (aesdsoc_conn_init(&client->conn, soc_client, &aesdsoc_addr)) {
+                close(soc_client);
+                free(client);
+                continue;
+            }
+            pthread_mutex_lock(&pool->mutex);
+            LIST_INSERT_HEAD(&pool->clients, client, entries);
+            pthread_mutex_unlock(&pool->mutex);
+        }
+        aesdsoc_pool_serve(pool, client);
+    }
+    return argument;
+}
+
+/*
+* Worker pool engine accept loop
+*
+* Parameters:
+*   soc_server: Listening socket
+*
+* Returns: 0 on exit request, otherwise error code
+*/
+static int aesdsoc_pool_engine_run(int soc_server) {
+    aesdsoc_pool_t pool;
+    aesdsoc_pool_job_t *job;
+    aesdsoc_pool_client_t *client;
+    pthread_t *workers;
+    pthread_t poller;
+    struct sockaddr_storage aesdsoc_addr;
+    int worker_count = aesdsoc_threads;
+    int queue_depth = aesdsoc_queue_depth;
+    int started = 0;
+    int polling = FALSE;
+    int soc_client;
+    int rc = 0;
+
+    if (worker_count <= 0) {
+        worker_count = sysconf(_SC_NPROCESSORS_ONLN) * POOL_WORKERS_PER_CPU;
+        if (worker_count <= 0) {
+            worker_count = POOL_WORKERS_PER_CPU;
+        }
+    }
+    if (queue_depth <= 0) {
+        queue_depth = POOL_DEFAULT_QUEUE_DEPTH;
+    }
+
+    pool.stop = 0;
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.job_ready, NULL);
+    pthread_cond_init(&pool.slot_free, NULL);
+    STAILQ_INIT(&pool.jobs);
+    SLIST_INIT(&pool.free_slots);
+    LIST_INIT(&pool.clients);
+    pool.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool.epoll_fd < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: epoll_create1 failed %s", strerror(errno));
+    }
+    pool.slots = (aesdsoc_pool_job_t *)calloc(queue_depth, sizeof(aesdsoc_pool_job_t));
+    workers = (pthread_t *)calloc(worker_count, sizeof(pthread_t));
+    if (pool.epoll_fd < 0) {
+        rc = -1;
+        goto cleanup;
+    }
+    if (pool.slots == NULL || workers == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+        rc = -1;
+        goto cleanup;
+    }
+    for (int i = 0; i < queue_depth; i++) {
+        SLIST_INSERT_HEAD(&pool.free_slots, &pool.slots[i], free_entries);
+    }
+    for (started = 0; started < worker_count; started++) {
+        if (aesdsoc_thread_create(&workers[started], aesdsoc_pool_worker, &pool) != 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: pthread_create failed");
+            rc = -1;
+            goto cleanup;
+        }
+    }
+    if (aesdsoc_thread_create(&poller, aesdsoc_pool_poller, &pool) != 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: pthread_create failed");
+        rc = -1;
+        goto cleanup;
+    }
+    polling = TRUE;
+
+    AESDSOC_LOG(LOG_INFO,"**** AESDSOCKET application: Staring pool mode, %d workers, queue %d ****",
+        worker_count, queue_depth);
+    while (exit_aesd_soc == FALSE) {
+        soc_client = aesdsoc_accept(soc_server, &aesdsoc_addr);
+        if (soc_client < 0) {
+            if (errno == ECONNABORTED) {
+                continue;
+            }
+            rc = -1;
+            break;
+        }
+        if (aesdsoc_pool_queue(&pool, soc_client, &aesdsoc_addr, NULL)) {
+            aesdsoc_handoff_client(soc_client, &aesdsoc_addr, NULL);
+            close(soc_client);
+            break;
+        }
+    }
+
+cleanup:
+    /* Workers notice the stop flag within POOL_EXIT_POLL_MS */
+    pthread_mutex_lock(&pool.mutex);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.job_ready);
+    pthread_mutex_unlock(&pool.mutex);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    if (polling) {
+        pthread_join(poller, NULL);
+    }
+    /* New clients still waiting in the queue */
+    STAILQ_FOREACH(job, &pool.jobs, queue_entries) {
+        if (job->client == NULL) {
+            aesdsoc_handoff_client(job->soc_client, &job->aesdsoc_addr, NULL);
+            close(job->soc_client);
+        }
+    }
+    /* Served clients, all between two requests once the workers stopped */
+    while (!LIST_EMPTY(&pool.clients)) {
+        client = LIST_FIRST(&pool.clients);
+        aesdsoc_handoff_client(client->conn.soc_client, &client->conn.aesdsoc_addr,
+            &client->conn);
+        aesdsoc_pool_client_close(&pool, client);
+    }
+    if (pool.epoll_fd >= 0) {
+        close(pool.epoll_fd);
+    }
+    free(workers);
+    free(pool.slots);
+    pthread_cond_destroy(&pool.slot_free);
+    pthread_cond_destroy(&pool.job_ready);
+    pthread_mutex_destroy(&pool.mutex);
+    return rc;
+}
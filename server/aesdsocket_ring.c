@@ -0,0 +1,310 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_ring.c
+* @brief In-process ring storage of aesdsocket
+*
+* The "ring" backend keeps the last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+* write commands in the circular buffer of the aesdchar driver, without the
+* kernel module. It behaves like /dev/aesdchar: one packet is one write
+* command, a write without '\n' is held back until one arrives, the oldest
+* command is dropped when the ring is full and AESDCHAR_IOCSEEKTO offsets are
+* resolved by aesd_circular_buffer_return_char_offset().
+*
+* Storage offsets count every byte appended since open, so that the reply
+* cursors of incremental clients stay valid when the oldest command is
+* dropped. ring_base is the offset of the oldest command still kept.
+*
+* Packets are copied outside the lock. Appends take the ring lock exclusively
+* only to swap the entries, replies and seeks share it, so concurrent replies
+* do not serialize each other. The contents are lost on exit and on upgrade.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "./../aesd-char-driver/aesd-circular-buffer.h"
+
+/*******************************************************************************
+ * Prototypes
+*******************************************************************************/
+static int ring_open(void);
+static void ring_close(int keep);
+static int ring_append(struct iovec *iov, int count);
+static int ring_read(off_t start, char *buf, int len);
+static off_t ring_size(void);
+static int ring_seek(uint32_t word, uint32_t offset, off_t *pos);
+static int ring_flush(void);
+static int ring_fd(void);
+static off_t ring_first(off_t start);
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+const aesdsoc_storage_t aesdsoc_ring_storage = {
+    .name         = "ring",
+    .timestamps   = FALSE,
+    .regular_file = FALSE,
+    .sendfile     = FALSE,
+    .stable_offsets = TRUE,
+    .open         = ring_open,
+    .close        = ring_close,
+    .append       = ring_append,
+    .read         = ring_read,
+    .size         = ring_size,
+    .seek         = ring_seek,
+    .flush        = ring_flush,
+    .fd           = ring_fd,
+    .first        = ring_first,
+};
+
+/* Write commands, their total size and the held back partial write */
+static struct aesd_circular_buffer ring_buffer;
+static size_t ring_bytes = 0;
+/* Bytes of the dropped commands, the storage offset of the oldest one */
+static off_t ring_base = 0;
+static char *ring_partial = NULL;
+static size_t ring_partial_len = 0;
+/* Exclusive for appends, shared for replies and seeks */
+static pthread_rwlock_t ring_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* ring_open
+*
+* Parameters: None
+*
+* Returns: 0
+*/
+static int ring_open(void) {
+    aesd_circular_buffer_init(&ring_buffer);
+    ring_bytes = 0;
+    ring_base = 0;
+    return 0;
+}
+
+/*
+* ring_close
+* Frees every write command, there is nothing to hand over.
+*
+* Parameters:
+*   keep:       Unused, the ring lives in this process only
+*
+* Returns: None
+*/
+static void ring_close(int keep) {
+    struct aesd_buffer_entry *entry;
+    uint32_t index;
+
+    pthread_rwlock_wrlock(&ring_lock);
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &ring_buffer, index) {
+        free((char *)entry->buffptr);
+    }
+    aesd_circular_buffer_init(&ring_buffer);
+    ring_bytes = 0;
+    ring_base = 0;
+    free(ring_partial);
+    ring_partial = NULL;
+    ring_partial_len = 0;
+    pthread_rwlock_unlock(&ring_lock);
+}
+
+/*
+* ring_append
+* Adds every packet as one write command, like a write() to the driver.
+*
+* Parameters:
+*   iov:        Packets
+*   count:      Number of entries in iov
+*
+* Returns: 0 for success, -1 on error
+*/
+static int ring_append(struct iovec *iov, int count) {
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry *oldest;
+    const char *dropped;
+    char *data;
+    int full;
+
+    for (int i = 0; i < count; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        /* The partial write is only changed by appends, which the group
+         * commit runs one at a time */
+        data = (char *)malloc(ring_partial_len + iov[i].iov_len);
+        if (data == NULL) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+            return -1;
+        }
+        memcpy(data, ring_partial, ring_partial_len);
+        memcpy(data + ring_partial_len, iov[i].iov_base, iov[i].iov_len);
+        entry.buffptr = data;
+        entry.size = ring_partial_len + iov[i].iov_len;
+
+        dropped = NULL;
+        pthread_rwlock_wrlock(&ring_lock);
+        free(ring_partial);
+        ring_partial = NULL;
+        ring_partial_len = 0;
+        if (memchr(iov[i].iov_base, '\n', iov[i].iov_len) == NULL) {
+            ring_partial = data;
+            ring_partial_len = entry.size;
+        }
+        else {
+            oldest = aesd_circular_buffer_return_full_pointer(&ring_buffer, &full);
+            if (full) {
+                dropped = oldest->buffptr;
+                ring_bytes -= oldest->size;
+                ring_base += oldest->size;
+            }
+            aesd_circular_buffer_add_entry(&ring_buffer, &entry);
+            ring_bytes += entry.size;
+        }
+        pthread_rwlock_unlock(&ring_lock);
+        free((char *)dropped);
+    }
+    return 0;
+}
+
+/*
+* ring_read
+* Copies write commands from start on, across entries while buf has room.
+*
+* Parameters:
+*   start:      Storage offset
+*   buf:        Destination
+*   len:        Size of buf
+*
+* Returns: Number of bytes read, 0 at the end or if start was dropped
+*/
+static int ring_read(off_t start, char *buf, int len) {
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset;
+    size_t copy;
+    int rd_len = 0;
+
+    pthread_rwlock_rdlock(&ring_lock);
+    while (rd_len < len && start >= ring_base) {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&ring_buffer,
+            start - ring_base + rd_len, &entry_offset);
+        if (entry == NULL) {
+            break;
+        }
+        copy = entry->size - entry_offset;
+        if (copy > (size_t)(len - rd_len)) {
+            copy = len - rd_len;
+        }
+        memcpy(buf + rd_len, entry->buffptr + entry_offset, copy);
+        rd_len += copy;
+    }
+    pthread_rwlock_unlock(&ring_lock);
+    return rd_len;
+}
+
+/*
+* ring_size
+*
+* Parameters: None
+*
+* Returns: Storage offset after the newest write command
+*/
+static off_t ring_size(void) {
+    off_t end;
+
+    pthread_rwlock_rdlock(&ring_lock);
+    end = ring_base + ring_bytes;
+    pthread_rwlock_unlock(&ring_lock);
+    return end;
+}
+
+/*
+* ring_seek
+* AESDCHAR_IOCSEEKTO on the ring, with the same bounds as the driver.
+*
+* Parameters:
+*   word:       Write command index
+*   offset:     Byte offset within the write command
+*   pos:        Returns the storage offset
+*
+* Returns: 0 for success, -1 if the seek failed
+*/
+static int ring_seek(uint32_t word, uint32_t offset, off_t *pos) {
+    size_t entry_offset;
+    off_t base;
+    int rc;
+
+    pthread_rwlock_rdlock(&ring_lock);
+    rc = aesd_circular_buffer_return_char_offset(&ring_buffer, word, offset, &entry_offset);
+    base = ring_base;
+    pthread_rwlock_unlock(&ring_lock);
+    if (rc) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: seek to %u,%u is outside the ring", word, offset);
+        errno = EINVAL;
+        return -1;
+    }
+    *pos = base + entry_offset;
+    return 0;
+}
+
+/*
+* ring_flush
+*
+* Parameters: None
+*
+* Returns: 0, the ring is kept in memory
+*/
+static int ring_flush(void) {
+    return 0;
+}
+
+/*
+* ring_fd
+*
+* Parameters: None
+*
+* Returns: -1, replies are copied out of the ring
+*/
+static int ring_fd(void) {
+    return -1;
+}
+
+/*
+* ring_first
+* Moves a reply start past the dropped write commands.
+*
+* Parameters:
+*   start:      Storage offset the reply would start from
+*
+* Returns: Storage offset the reply starts from
+*/
+static off_t ring_first(off_t start) {
+    off_t first;
+
+    pthread_rwlock_rdlock(&ring_lock);
+    first = ring_base;
+    pthread_rwlock_unlock(&ring_lock);
+    return (start > first) ? start : first;
+}
@@ -0,0 +1,237 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_scan.c
+* @brief Packet tokenizer of aesdsocket
+*
+* aesdsoc_scan_newline() finds the end of the next packet. On x86 it
+* compares 32 bytes per step with AVX2 when the CPU has it and 16 bytes with
+* SSE2 otherwise. Other targets compare 8 bytes per step in a general
+* purpose register. Every received byte is scanned once, the packet
+* processing only looks at a line again to recognize the commands, which
+* are identified by their first bytes.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+* CREDIT: Bit Twiddling Hacks, "Determine if a word has a byte equal to n"
+*
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "aesdsocket.h"
+
+/* Build with -DUSE_SIMD_SCAN=0 to use the portable scanner only */
+#ifndef USE_SIMD_SCAN
+#define USE_SIMD_SCAN               (1)
+#endif
+
+#if (USE_SIMD_SCAN == 1) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_SSE2                   (1)
+#else
+#define SCAN_SSE2                   (0)
+#endif
+
+#if (SCAN_SSE2 == 1) && defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SCAN_AVX2                   (1)
+#else
+#define SCAN_AVX2                   (0)
+#endif
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define SCAN_ONES                   (0x0101010101010101ULL)
+#define SCAN_HIGHS                  (0x8080808080808080ULL)
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+#if (SCAN_AVX2 == 1)
+/* -1 until the CPU was checked */
+static int scan_use_avx2 = -1;
+#endif
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* aesdsoc_scan_word
+* Scans 8 bytes at a time, then the tail byte by byte.
+*
+* Parameters:
+*   data:       Data to scan
+*   len:        Number of bytes in data
+*
+* Returns: Index of the first newline, or -1 if there is none
+*/
+static int aesdsoc_scan_word(const char *data, int len) {
+    uint64_t word;
+    int i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&word, data + i, sizeof(word));
+        word ^= SCAN_ONES * '\n';
+        /* Non-zero when one of the bytes is zero */
+        if ((word - SCAN_ONES) & ~word & SCAN_HIGHS) {
+            break;
+        }
+    }
+    for (; i < len; i++) {
+        if (data[i] == '\n') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#if (SCAN_SSE2 == 1)
+/*
+* aesdsoc_scan_sse2
+*
+* Parameters:
+*   data:       Data to scan
+*   len:        Number of bytes in data
+*
+* Returns: Index of the first newline, or -1 if there is none
+*/
+static int aesdsoc_scan_sse2(const char *data, int len) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    unsigned mask;
+    int rc;
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    rc = aesdsoc_scan_word(data + i, len - i);
+    return (rc < 0) ? -1 : i + rc;
+}
+#endif
+
+#if (SCAN_AVX2 == 1)
+/*
+* aesdsoc_scan_avx2
+* Compiled for AVX2 regardless of the build flags, only called when the CPU
+* supports it.
+*
+* Parameters:
+*   data:       Data to scan
+*   len:        Number of bytes in data
+*
+* Returns: Index of the first newline, or -1 if there is none
+*/
+__attribute__((target("avx2")))
+static int aesdsoc_scan_avx2(const char *data, int len) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    unsigned mask;
+    int rc;
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + i));
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    rc = aesdsoc_scan_sse2(data + i, len - i);
+    return (rc < 0) ? -1 : i + rc;
+}
+#endif
+
+/*
+* aesdsoc_scan_newline
+* Finds the end of the next packet.
+*
+* Parameters:
+*   data:       Data to scan
+*   len:        Number of bytes in data
+*
+* Returns: Index of the first newline, or -1 if there is none
+*/
+int aesdsoc_scan_newline(const char *data, int len) {
+#if (SCAN_AVX2 == 1)
+    if (scan_use_avx2 < 0) {
+        __builtin_cpu_init();
+        scan_use_avx2 = __builtin_cpu_supports("avx2") ? TRUE : FALSE;
+    }
+    if (scan_use_avx2) {
+        return aesdsoc_scan_avx2(data, len);
+    }
+#endif
+#if (SCAN_SSE2 == 1)
+    return aesdsoc_scan_sse2(data, len);
+#else
+    return aesdsoc_scan_word(data, len);
+#endif
+}
+
+/*
+* aesdsoc_parse_uint
+* Parses a decimal number of at most 32 bits.
+*
+* Parameters:
+*   data:       Text, advanced past the digits
+*   end:        End of the text
+*   value:      Returns the number
+*
+* Returns: 0 for success, -1 if there is no digit or the number overflows
+*/
+static int aesdsoc_parse_uint(const char **data, const char *end, uint32_t *value) {
+    const char *pos = *data;
+    uint64_t number = 0;
+
+    if (pos == end || *pos < '0' || *pos > '9') {
+        return -1;
+    }
+    for (; pos < end && *pos >= '0' && *pos <= '9'; pos++) {
+        number = number * 10 + (*pos - '0');
+        if (number > UINT32_MAX) {
+            return -1;
+        }
+    }
+    *value = (uint32_t)number;
+    *data = pos;
+    return 0;
+}
+
+/*
+* aesdsoc_parse_seek
+* Parses the "X,Y" arguments of AESDCHAR_IOCSEEKTO, any number of digits.
+*
+* Parameters:
+*   args:       Text after the colon, without the newline
+*   len:        Number of bytes in args
+*   word:       Returns X, the write command index
+*   offset:     Returns Y, the byte offset within the write command
+*
+* Returns: 0 for success, -1 if the arguments are malformed
+*/
+int aesdsoc_parse_seek(const char *args, int len, uint32_t *word, uint32_t *offset) {
+    const char *end = args + len;
+
+    if (aesdsoc_parse_uint(&args, end, word) || args == end || *args++ != ',' ||
+        aesdsoc_parse_uint(&args, end, offset) || args != end) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,611 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_segment.c
+* @brief Segmented log storage of aesdsocket
+*
+* The "segment" backend splits the log into files in SEGMENT_DIR, named by
+* the storage offset of their first byte. Packets are appended to the last
+* segment until it holds aesdsoc_segment_size bytes, a packet is never split
+* across segments. An index of the segment start offsets maps a storage
+* offset to its segment.
+*
+* Retention drops whole segments from the front of the log:
+*   - aesdsoc_retain_bytes keeps the log below that many bytes,
+*   - aesdsoc_retain_age drops segments written to last that many seconds
+*     ago, checked on every append. The timestamp line keeps it going on an
+*     idle server.
+* Storage offsets keep counting, a client behind the oldest segment
+* continues at the oldest packet still kept. Write command numbers of
+* AESDCHAR_IOCSEEKTO keep counting too: the index of aesdsocket_index.c
+* covers the kept segments, and the number of the first write command is
+* saved in the SEGMENT_BASE_XATTR attribute of the oldest segment. With
+* aesdsoc_reply_window set,
+* a reply starts no further back than the first segment within that many
+* bytes of the end, so its cost is bounded however long the server runs.
+*
+* The segments in use are locked with flock() on SEGMENT_DIR, a server
+* taking over with -u waits for the old one to finish.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define SEGMENT_DIR                 ("/var/tmp/aesdsocketdata.d")
+#define SEGMENT_NAME_SIZE           (64)
+#define SEGMENT_DEFAULT_SIZE        (1024 * 1024)
+/* Write command number of the first write command of the oldest segment */
+#define SEGMENT_BASE_XATTR          ("user.aesdsocket.base")
+
+typedef struct segment {
+    off_t start;                /* Storage offset of the first byte */
+    int fd;
+    time_t written;             /* Time of the last append */
+} segment_t;
+
+/*******************************************************************************
+ * Prototypes
+*******************************************************************************/
+static int segment_open(void);
+static void segment_close(int keep);
+static int segment_append(struct iovec *iov, int count);
+static int segment_read(off_t start, char *buf, int len);
+static off_t segment_size(void);
+static int segment_seek(uint32_t word, uint32_t offset, off_t *pos);
+static int segment_flush(void);
+static int segment_fd(void);
+static off_t segment_first(off_t start);
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+const aesdsoc_storage_t aesdsoc_segment_storage = {
+    .name         = "segment",
+    .timestamps   = TRUE,
+    .regular_file = FALSE,
+    .sendfile     = FALSE,
+    .stable_offsets = TRUE,
+    .open         = segment_open,
+    .close        = segment_close,
+    .append       = segment_append,
+    .read         = segment_read,
+    .size         = segment_size,
+    .seek         = segment_seek,
+    .flush        = segment_flush,
+    .fd           = segment_fd,
+    .first        = segment_first,
+};
+
+/* Limits, 0 = unlimited */
+long aesdsoc_segment_size = SEGMENT_DEFAULT_SIZE;
+long aesdsoc_retain_bytes = 0;
+int aesdsoc_retain_age = 0;
+long aesdsoc_reply_window = 0;
+
+/* Segment index, oldest first, the last one is appended to */
+static segment_t *seg_index = NULL;
+static int seg_count = 0;
+static int seg_capacity = 0;
+static int seg_dir_fd = -1;
+/* End of the complete packets, published with a release store */
+static off_t seg_tail = 0;
+/* Exclusive to change the index, shared to read through it */
+static pthread_rwlock_t seg_lock = PTHREAD_RWLOCK_INITIALIZER;
+/* Serializes appends and flushes */
+static pthread_mutex_t seg_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* segment_name
+*
+* Parameters:
+*   start:      Storage offset of the segment
+*   name:       Returns the file name within SEGMENT_DIR
+*
+* Returns: None
+*/
+static void segment_name(off_t start, char *name) {
+    snprintf(name, SEGMENT_NAME_SIZE, "%020lld", (long long)start);
+}
+
+/*
+* segment_add
+* Opens a segment and adds it at the end of the index. Takes seg_lock.
+*
+* Parameters:
+*   start:      Storage offset of the segment
+*   flags:      Extra open() flags, O_CREAT | O_EXCL for a new segment
+*   written:    Time of the last append
+*
+* Returns: 0 for success, -1 on error
+*/
+static int segment_add(off_t start, int flags, time_t written) {
+    char name[SEGMENT_NAME_SIZE];
+    segment_t *new_index;
+    int fd;
+
+    segment_name(start, name);
+    fd = openat(seg_dir_fd, name, O_RDWR | O_APPEND | O_CLOEXEC | flags, 0666);
+    if (fd < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: open segment %s failed %s", name, strerror(errno));
+        return -1;
+    }
+    pthread_rwlock_wrlock(&seg_lock);
+    if (seg_count == seg_capacity) {
+        new_index = (segment_t *)realloc(seg_index,
+            (seg_capacity ? seg_capacity * 2 : 16) * sizeof(segment_t));
+        if (new_index == NULL) {
+            pthread_rwlock_unlock(&seg_lock);
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: realloc failed %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        seg_index = new_index;
+        seg_capacity = seg_capacity ? seg_capacity * 2 : 16;
+    }
+    seg_index[seg_count].start = start;
+    seg_index[seg_count].fd = fd;
+    seg_index[seg_count].written = written;
+    seg_count++;
+    pthread_rwlock_unlock(&seg_lock);
+    return 0;
+}
+
+/*
+* segment_compare
+* qsort() order of the segment start offsets.
+*
+* Parameters:
+*   a, b:       off_t start offsets
+*
+* Returns: <0, 0 or >0
+*/
+static int segment_compare(const void *a, const void *b) {
+    off_t x = *(const off_t *)a;
+    off_t y = *(const off_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+* segment_open
+* Locks SEGMENT_DIR and builds the index from the segments left by a
+* previous server, if any.
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+static int segment_open(void) {
+    struct dirent *dent;
+    struct stat st;
+    off_t *starts = NULL;
+    off_t *new_starts;
+    uint32_t base;
+    int count = 0;
+    int size = 0;
+    char *endp;
+    DIR *dir;
+
+    if (mkdir(SEGMENT_DIR, 0755) < 0 && errno != EEXIST) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: mkdir %s failed %s", SEGMENT_DIR, strerror(errno));
+        return -1;
+    }
+    seg_dir_fd = open(SEGMENT_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (seg_dir_fd < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: open %s failed %s", SEGMENT_DIR, strerror(errno));
+        return -1;
+    }
+    while (flock(seg_dir_fd, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: flock failed %s", strerror(errno));
+            goto error;
+        }
+    }
+
+    dir = fdopendir(dup(seg_dir_fd));
+    if (dir == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: opendir failed %s", strerror(errno));
+        goto error;
+    }
+    while ((dent = readdir(dir)) != NULL) {
+        off_t start = strtoll(dent->d_name, &endp, 10);
+
+        if (dent->d_name[0] < '0' || dent->d_name[0] > '9' || *endp != '\0') {
+            continue;
+        }
+        if (count == size) {
+            size = size ? size * 2 : 16;
+            new_starts = (off_t *)realloc(starts, size * sizeof(off_t));
+            if (new_starts == NULL) {
+                AESDSOC_LOG(LOG_ERR, "aesdsocket: realloc failed %s", strerror(errno));
+                closedir(dir);
+                goto error;
+            }
+            starts = new_starts;
+        }
+        starts[count++] = start;
+    }
+    closedir(dir);
+    qsort(starts, count, sizeof(off_t), segment_compare);
+
+    for (int i = 0; i < count; i++) {
+        if (segment_add(starts[i], 0, time(NULL))) {
+            goto error;
+        }
+        if (fstat(seg_index[i].fd, &st) == 0) {
+            seg_index[i].written = st.st_mtime;
+        }
+    }
+    if (seg_count == 0 && segment_add(0, O_CREAT | O_EXCL, time(NULL))) {
+        goto error;
+    }
+    if (fstat(seg_index[seg_count - 1].fd, &st)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: fstat failed %s", strerror(errno));
+        goto error;
+    }
+    seg_tail = seg_index[seg_count - 1].start + st.st_size;
+    if (fgetxattr(seg_index[0].fd, SEGMENT_BASE_XATTR, &base, sizeof(base)) != sizeof(base)) {
+        base = 0;
+    }
+    if (aesdsoc_index_open_storage(base, seg_index[0].start, seg_tail)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: indexing %s failed", SEGMENT_DIR);
+        goto error;
+    }
+    free(starts);
+    return 0;
+
+error:
+    free(starts);
+    segment_close(TRUE);
+    return -1;
+}
+
+/*
+* segment_close
+*
+* Parameters:
+*   keep:       TRUE to leave the segments for the next server
+*
+* Returns: None
+*/
+static void segment_close(int keep) {
+    char name[SEGMENT_NAME_SIZE];
+
+    aesdsoc_index_close(keep);
+    for (int i = 0; i < seg_count; i++) {
+        close(seg_index[i].fd);
+        if (!keep) {
+            segment_name(seg_index[i].start, name);
+            unlinkat(seg_dir_fd, name, 0);
+        }
+    }
+    free(seg_index);
+    seg_index = NULL;
+    seg_count = 0;
+    seg_capacity = 0;
+    seg_tail = 0;
+    if (seg_dir_fd >= 0) {
+        close(seg_dir_fd);
+        seg_dir_fd = -1;
+    }
+    if (!keep && rmdir(SEGMENT_DIR)) {
+        printf("Error file removal\n");
+    }
+}
+
+/*
+* segment_retain
+* Drops the oldest segments outside the retention limits, and their write
+* commands from the index. The last segment is always kept. Called with
+* seg_mutex held.
+*
+* Parameters:
+*   now:        Current time
+*
+* Returns: None
+*/
+static void segment_retain(time_t now) {
+    char name[SEGMENT_NAME_SIZE];
+    uint32_t base;
+    int drop = 0;
+
+    while (drop < seg_count - 1) {
+        if (aesdsoc_retain_bytes > 0 &&
+            seg_tail - seg_index[drop].start > aesdsoc_retain_bytes) {
+            drop++;
+        }
+        else if (aesdsoc_retain_age > 0 &&
+            now - seg_index[drop].written > aesdsoc_retain_age) {
+            drop++;
+        }
+        else {
+            break;
+        }
+    }
+    if (drop == 0) {
+        return;
+    }
+    /* Saved before the old segments go, a crash keeps a consistent base */
+    base = aesdsoc_index_drop(seg_index[drop].start);
+    if (fsetxattr(seg_index[drop].fd, SEGMENT_BASE_XATTR, &base, sizeof(base), 0) &&
+        errno != ENOTSUP) {
+        AESDSOC_LOG(LOG_WARNING, "aesdsocket: saving the write command base failed %s",
+            strerror(errno));
+    }
+    /* Readers hold seg_lock while they use a segment descriptor */
+    pthread_rwlock_wrlock(&seg_lock);
+    for (int i = 0; i < drop; i++) {
+        close(seg_index[i].fd);
+        segment_name(seg_index[i].start, name);
+        if (unlinkat(seg_dir_fd, name, 0) < 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: unlink segment %s failed %s", name,
+                strerror(errno));
+        }
+    }
+    memmove(seg_index, seg_index + drop, (seg_count - drop) * sizeof(segment_t));
+    seg_count -= drop;
+    pthread_rwlock_unlock(&seg_lock);
+    AESDSOC_LOG(LOG_DEBUG, "aesdsocket: dropped %d segments, log starts at %lld", drop,
+        (long long)seg_index[0].start);
+}
+
+/*
+* segment_append
+* Writes the packets to the last segment, starting a new one whenever it is
+* full. A failed write is cut off the segment again.
+*
+* Parameters:
+*   iov:        Packets, modified while writing
+*   count:      Number of entries in iov
+*
+* Returns: 0 for success, -1 on error
+*/
+static int segment_append(struct iovec *iov, int count) {
+    time_t now = time(NULL);
+    segment_t *last;
+    off_t tail;
+    off_t len;
+    int first = 0;
+    int end;
+    int rc = 0;
+
+    pthread_mutex_lock(&seg_mutex);
+    aesdsoc_index_add(iov, count);
+    tail = seg_tail;
+    while (rc == 0 && first < count) {
+        last = &seg_index[seg_count - 1];
+        if (tail > last->start && tail - last->start >= aesdsoc_segment_size) {
+            if (aesdsoc_sync_policy != AESDSOC_SYNC_NONE && fdatasync(last->fd) < 0) {
+                AESDSOC_LOG(LOG_ERR, "aesdsocket: fdatasync failed %s", strerror(errno));
+            }
+            if (segment_add(tail, O_CREAT | O_EXCL, now)) {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+        /* Packets up to the one that fills the segment */
+        end = first;
+        len = tail - last->start;
+        while (end < count && len < aesdsoc_segment_size) {
+            len += iov[end].iov_len;
+            tail += iov[end].iov_len;
+            end++;
+        }
+        rc = aesdsoc_storage_writev(last->fd, iov + first, end - first);
+        if (rc == 0) {
+            last->written = now;
+            /* Published per segment, the next one may not be there yet */
+            __atomic_store_n(&seg_tail, tail, __ATOMIC_RELEASE);
+        }
+        else if (ftruncate(last->fd, seg_tail - last->start) < 0) {
+            /* Part of the batch may be written, the next append must not
+             * follow it. In a new segment it is never read. */
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: ftruncate failed %s", strerror(errno));
+            segment_add(seg_tail, O_CREAT | O_EXCL, now);
+        }
+        first = end;
+    }
+    if (rc) {
+        aesdsoc_index_rebuild(-1, seg_tail);
+    }
+    segment_retain(now);
+    pthread_mutex_unlock(&seg_mutex);
+    return rc;
+}
+
+/*
+* segment_find
+* Looks up the segment holding a storage offset. Called with seg_lock held.
+*
+* Parameters:
+*   start:      Storage offset
+*
+* Returns: Index of the segment, or -1 if start was dropped
+*/
+static int segment_find(off_t start) {
+    int low = 0;
+    int high = seg_count - 1;
+    int mid;
+
+    if (seg_count == 0 || start < seg_index[0].start) {
+        return -1;
+    }
+    while (low < high) {
+        mid = (low + high + 1) / 2;
+        if (seg_index[mid].start <= start) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/*
+* segment_read
+* Reads from the segment holding start, up to its end.
+*
+* Parameters:
+*   start:      Storage offset
+*   buf:        Destination
+*   len:        Size of buf
+*
+* Returns: Number of bytes read, 0 at the end or if start was dropped,
+*          -1 on error
+*/
+static int segment_read(off_t start, char *buf, int len) {
+    off_t tail = __atomic_load_n(&seg_tail, __ATOMIC_ACQUIRE);
+    off_t end;
+    ssize_t rd_len = 0;
+    int i;
+
+    if (start >= tail) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&seg_lock);
+    i = segment_find(start);
+    if (i >= 0) {
+        end = (i + 1 < seg_count) ? seg_index[i + 1].start : tail;
+        if (len > end - start) {
+            len = end - start;
+        }
+        do {
+            rd_len = pread(seg_index[i].fd, buf, len, start - seg_index[i].start);
+        } while (rd_len < 0 && errno == EINTR);
+        if (rd_len < 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: pread failed %s", strerror(errno));
+        }
+    }
+    pthread_rwlock_unlock(&seg_lock);
+    return rd_len;
+}
+
+/*
+* segment_size
+*
+* Parameters: None
+*
+* Returns: End of the log, always at the end of a complete packet
+*/
+static off_t segment_size(void) {
+    return __atomic_load_n(&seg_tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+* segment_first
+* Moves a reply start past the dropped segments and into the reply window.
+*
+* Parameters:
+*   start:      Storage offset the reply would start from
+*
+* Returns: Storage offset the reply starts from
+*/
+static off_t segment_first(off_t start) {
+    off_t tail = __atomic_load_n(&seg_tail, __ATOMIC_ACQUIRE);
+    off_t first;
+    int i;
+
+    pthread_rwlock_rdlock(&seg_lock);
+    first = seg_index[0].start;
+    if (aesdsoc_reply_window > 0 && tail - aesdsoc_reply_window > first) {
+        i = segment_find(tail - aesdsoc_reply_window);
+        /* The segment holding the window start begins before it */
+        if (seg_index[i].start < tail - aesdsoc_reply_window && i + 1 < seg_count) {
+            i++;
+        }
+        first = seg_index[i].start;
+    }
+    pthread_rwlock_unlock(&seg_lock);
+    return (start > first) ? start : first;
+}
+
+/*
+* segment_seek
+*
+* Parameters:
+*   word:       Write command index, counted from the start of the log
+*   offset:     Byte offset within the write command
+*   pos:        Returns the storage offset
+*
+* Returns: 0 for success, -1 if the seek failed or the write command was
+*          dropped
+*/
+static int segment_seek(uint32_t word, uint32_t offset, off_t *pos) {
+    return aesdsoc_index_seek(word, offset, pos);
+}
+
+/*
+* segment_flush
+* Syncs the last segment, a full one is synced when the next one starts.
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+static int segment_flush(void) {
+    int fd;
+    int rc;
+
+    pthread_mutex_lock(&seg_mutex);
+    fd = seg_index[seg_count - 1].fd;
+    if (aesdsoc_sync_policy == AESDSOC_SYNC_ASYNC) {
+        rc = sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+    else {
+        rc = fdatasync(fd);
+    }
+    pthread_mutex_unlock(&seg_mutex);
+    if (rc < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: segment sync failed %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* segment_fd
+*
+* Parameters: None
+*
+* Returns: -1, a reply may span several segment files
+*/
+static int segment_fd(void) {
+    return -1;
+}
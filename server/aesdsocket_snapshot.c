@@ -0,0 +1,186 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_snapshot.c
+* @brief Shared reply snapshot of aesdsocket
+*
+* Replies that cannot use sendfile() read the storage into memory. Without
+* sharing, every client replying after the same commit reads the same
+* bytes again: one read per write command on the char device, one copy per
+* client on the ring.
+*
+* The snapshot is the storage contents from some offset to the end, tagged
+* with the group commit generation it was read at. A reply at the same
+* generation, starting at or after the snapshot start, takes a reference
+* and sends its part of the buffer. The first reply after a commit reads a
+* new snapshot, replies arriving meanwhile wait for it rather than reading
+* themselves. The last reference frees a replaced snapshot.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+/* Larger replies are streamed by each client */
+#define SNAPSHOT_MAX_SIZE           (4 * 1024 * 1024)
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+/* Snapshot of the current generation, holds one reference */
+static aesdsoc_snapshot_t *snapshot_current = NULL;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long snapshot_hits = 0;
+static unsigned long snapshot_misses = 0;
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* snapshot_unref
+* Called with snapshot_mutex held.
+*
+* Parameters:
+*   snap:       Snapshot
+*
+* Returns: None
+*/
+static void snapshot_unref(aesdsoc_snapshot_t *snap) {
+    if (--snap->refs == 0) {
+        free(snap->data);
+        aesdsoc_mem_uncharge(NULL, snap->end - snap->start);
+        free(snap);
+    }
+}
+
+/*
+* aesdsoc_snapshot_get
+* Hands out the snapshot covering a reply, reading a new one after a commit.
+*
+* Parameters:
+*   start:      Storage offset the reply starts from
+*
+* Returns: Snapshot, released with aesdsoc_snapshot_put(). NULL if the reply
+*          is too large to share, does not fit the memory budget or reading
+*          failed, the caller reads the storage itself then.
+*/
+aesdsoc_snapshot_t *aesdsoc_snapshot_get(off_t start) {
+    unsigned long generation;
+    aesdsoc_snapshot_t *snap;
+    off_t end;
+    int len;
+
+    pthread_mutex_lock(&snapshot_mutex);
+    generation = aesdsoc_commit_generation();
+    snap = snapshot_current;
+    if (snap != NULL && snap->generation == generation &&
+        start >= snap->start && start <= snap->end) {
+        snap->refs++;
+        snapshot_hits++;
+        pthread_mutex_unlock(&snapshot_mutex);
+        return snap;
+    }
+    snapshot_misses++;
+    end = aesdsoc_storage->size();
+    if (end >= 0 && end - start > SNAPSHOT_MAX_SIZE) {
+        pthread_mutex_unlock(&snapshot_mutex);
+        return NULL;
+    }
+    snap = (aesdsoc_snapshot_t *)malloc(sizeof(aesdsoc_snapshot_t));
+    if (snap == NULL) {
+        pthread_mutex_unlock(&snapshot_mutex);
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+        return NULL;
+    }
+    /* Read under the lock, concurrent replies wait for this one read. Shared
+     * by the replies, charged to the server. */
+    len = aesdsoc_storage_read(NULL, start, SNAPSHOT_MAX_SIZE + 1, &snap->data);
+    if (len < 0 || len > SNAPSHOT_MAX_SIZE) {
+        pthread_mutex_unlock(&snapshot_mutex);
+        if (len > 0) {
+            free(snap->data);
+            aesdsoc_mem_uncharge(NULL, len);
+        }
+        free(snap);
+        return NULL;
+    }
+    /* A commit during the read only adds complete packets, the older
+     * generation keeps the snapshot from being reused after it */
+    snap->generation = generation;
+    snap->start = start;
+    snap->end = start + len;
+    snap->refs = 2;
+    if (snapshot_current != NULL) {
+        snapshot_unref(snapshot_current);
+    }
+    snapshot_current = snap;
+    pthread_mutex_unlock(&snapshot_mutex);
+    return snap;
+}
+
+/*
+* aesdsoc_snapshot_put
+*
+* Parameters:
+*   snap:       Snapshot from aesdsoc_snapshot_get()
+*
+* Returns: None
+*/
+void aesdsoc_snapshot_put(aesdsoc_snapshot_t *snap) {
+    pthread_mutex_lock(&snapshot_mutex);
+    snapshot_unref(snap);
+    pthread_mutex_unlock(&snapshot_mutex);
+}
+
+/*
+* aesdsoc_snapshot_release
+* Drops the current snapshot on exit.
+*
+* Parameters: None
+*
+* Returns: None
+*/
+void aesdsoc_snapshot_release(void) {
+    pthread_mutex_lock(&snapshot_mutex);
+    if (snapshot_current != NULL) {
+        snapshot_unref(snapshot_current);
+        snapshot_current = NULL;
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+}
+
+/*
+* aesdsoc_snapshot_stats
+*
+* Parameters:
+*   hits:       Returns the number of replies sent from a shared snapshot
+*   misses:     Returns the number of snapshots read
+*
+* Returns: None
+*/
+void aesdsoc_snapshot_stats(unsigned long *hits, unsigned long *misses) {
+    pthread_mutex_lock(&snapshot_mutex);
+    *hits = snapshot_hits;
+    *misses = snapshot_misses;
+    pthread_mutex_unlock(&snapshot_mutex);
+}
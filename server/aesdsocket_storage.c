@@ -0,0 +1,444 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_storage.c
+* @brief Storage backends of aesdsocket
+*
+* Packets are kept by the backend selected with -t:
+*   - "file" appends to /var/tmp/aesdsocketdata. Appends are serialized with
+*     the size queries, so a reply only ever covers complete packets.
+*     AESDCHAR_IOCSEEKTO is resolved with the index of aesdsocket_index.c.
+*   - "aesdchar" writes to /dev/aesdchar, which keeps the last write
+*     commands and supports AESDCHAR_IOCSEEKTO.
+*   - "mmap" appends to /var/tmp/aesdsocketdata through a mapping, see
+*     aesdsocket_mmap.c.
+*   - "segment" splits the log into segment files with retention, see
+*     aesdsocket_segment.c.
+*   - "ring" keeps the same write commands in this process, see
+*     aesdsocket_ring.c.
+* The default is "aesdchar", or "file" when built with
+* -DUSE_AESD_CHAR_DEVICE=0.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+*
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "./../aesd-char-driver/aesd_ioctl.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define STORAGE_FILE_PATH           ("/var/tmp/aesdsocketdata")
+#define STORAGE_DEVICE_PATH         ("/dev/aesdchar")
+
+/*******************************************************************************
+ * Prototypes
+*******************************************************************************/
+static int file_open(void);
+static void file_close(int keep);
+static int file_append(struct iovec *iov, int count);
+static int storage_read(off_t start, char *buf, int len);
+static off_t file_size(void);
+static int file_seek(uint32_t word, uint32_t offset, off_t *pos);
+static int file_flush(void);
+static int storage_fd(void);
+static int device_open(void);
+static void device_close(int keep);
+static int device_append(struct iovec *iov, int count);
+static off_t device_size(void);
+static int device_seek(uint32_t word, uint32_t offset, off_t *pos);
+static int device_flush(void);
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+const aesdsoc_storage_t aesdsoc_file_storage = {
+    .name         = "file",
+    .timestamps   = TRUE,
+    .regular_file = TRUE,
+    .sendfile     = TRUE,
+    .stable_offsets = TRUE,
+    .open         = file_open,
+    .close        = file_close,
+    .append       = file_append,
+    .read         = storage_read,
+    .size         = file_size,
+    .seek         = file_seek,
+    .flush        = file_flush,
+    .fd           = storage_fd,
+};
+
+const aesdsoc_storage_t aesdsoc_device_storage = {
+    .name         = "aesdchar",
+    .timestamps   = FALSE,
+    .regular_file = FALSE,
+    .sendfile     = FALSE,
+    .stable_offsets = FALSE,
+    .open         = device_open,
+    .close        = device_close,
+    .append       = device_append,
+    .read         = storage_read,
+    .size         = device_size,
+    .seek         = device_seek,
+    .flush        = device_flush,
+    .fd           = storage_fd,
+};
+
+static const aesdsoc_storage_t *aesdsoc_storages[] = {
+    &aesdsoc_file_storage,
+    &aesdsoc_device_storage,
+    &aesdsoc_mmap_storage,
+    &aesdsoc_segment_storage,
+    &aesdsoc_ring_storage,
+    NULL,
+};
+
+#if (USE_AESD_CHAR_DEVICE == 1)
+const aesdsoc_storage_t *aesdsoc_storage = &aesdsoc_device_storage;
+#else
+const aesdsoc_storage_t *aesdsoc_storage = &aesdsoc_file_storage;
+#endif
+
+/* Descriptor of the data file or char device */
+static int storage_desc = -1;
+/* Serializes file appends with file_size() */
+static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* aesdsoc_storage_find
+*
+* Parameters:
+*   name:       Backend name
+*
+* Returns: Backend, or NULL if there is none with that name
+*/
+const aesdsoc_storage_t *aesdsoc_storage_find(const char *name) {
+    for (int i = 0; aesdsoc_storages[i] != NULL; i++) {
+        if (strcmp(name, aesdsoc_storages[i]->name) == 0) {
+            return aesdsoc_storages[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+* aesdsoc_storage_writev
+* Writes all of iov, continuing after partial writes.
+*
+* Parameters:
+*   fd:         Storage file descriptor
+*   iov:        Packets, modified while writing
+*   count:      Number of entries in iov
+*
+* Returns: 0 for success, -1 on error
+*/
+int aesdsoc_storage_writev(int fd, struct iovec *iov, int count) {
+    ssize_t written;
+
+    while (count > 0) {
+        written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: writev failed %s", strerror(errno));
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/*
+* storage_read
+* Reads from the data file or char device, which returns at most one write
+* command per read.
+*
+* Parameters:
+*   start:      Storage offset
+*   buf:        Destination
+*   len:        Size of buf
+*
+* Returns: Number of bytes read, 0 at the end, -1 on error
+*/
+static int storage_read(off_t start, char *buf, int len) {
+    ssize_t rd_len;
+
+    do {
+        rd_len = pread(storage_desc, buf, len, start);
+    } while (rd_len < 0 && errno == EINTR);
+    if (rd_len < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: pread failed %s", strerror(errno));
+    }
+    return rd_len;
+}
+
+/*
+* storage_fd
+*
+* Parameters: None
+*
+* Returns: Descriptor of the data file or char device
+*/
+static int storage_fd(void) {
+    return storage_desc;
+}
+
+/*
+* file_open
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+static int file_open(void) {
+    struct stat st;
+
+    storage_desc = open(STORAGE_FILE_PATH, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (storage_desc < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: File open Error %s", strerror(errno));
+        return -1;
+    }
+    if (fstat(storage_desc, &st) || aesdsoc_index_open(storage_desc, st.st_size)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: indexing %s failed", STORAGE_FILE_PATH);
+        close(storage_desc);
+        storage_desc = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* file_close
+*
+* Parameters:
+*   keep:       TRUE to leave the data file for the next server
+*
+* Returns: None
+*/
+static void file_close(int keep) {
+    aesdsoc_index_close(keep);
+    close(storage_desc);
+    storage_desc = -1;
+    if (!keep && remove(STORAGE_FILE_PATH)) {
+        printf("Error file removal\n");
+    }
+}
+
+/*
+* file_append
+*
+* Parameters:
+*   iov:        Packets, modified while writing
+*   count:      Number of entries in iov
+*
+* Returns: 0 for success, -1 on error
+*/
+static int file_append(struct iovec *iov, int count) {
+    struct stat st;
+    int rc;
+
+    pthread_mutex_lock(&file_mutex);
+    aesdsoc_index_add(iov, count);
+    rc = aesdsoc_storage_writev(storage_desc, iov, count);
+    if (rc && fstat(storage_desc, &st) == 0) {
+        aesdsoc_index_rebuild(storage_desc, st.st_size);
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return rc;
+}
+
+/*
+* file_size
+*
+* Parameters: None
+*
+* Returns: Size of the data file, taken under the file lock so that it
+*          ends with a complete packet. -1 on error.
+*/
+static off_t file_size(void) {
+    struct stat st;
+    off_t end = -1;
+
+    pthread_mutex_lock(&file_mutex);
+    if (fstat(storage_desc, &st) == 0) {
+        end = st.st_size;
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return end;
+}
+
+/*
+* file_seek
+*
+* Parameters:
+*   word:       Write command index
+*   offset:     Byte offset within the write command
+*   pos:        Returns the data file offset
+*
+* Returns: 0 for success, -1 if the seek failed
+*/
+static int file_seek(uint32_t word, uint32_t offset, off_t *pos) {
+    return aesdsoc_index_seek(word, offset, pos);
+}
+
+/*
+* file_flush
+* Waits for the data file to reach the disk, or only starts the write back
+* when the sync policy is "async".
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+static int file_flush(void) {
+    if (aesdsoc_sync_policy == AESDSOC_SYNC_ASYNC) {
+        if (sync_file_range(storage_desc, 0, 0, SYNC_FILE_RANGE_WRITE) < 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: sync_file_range failed %s", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    if (fdatasync(storage_desc) < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: fdatasync failed %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* device_open
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+static int device_open(void) {
+    storage_desc = open(STORAGE_DEVICE_PATH, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (storage_desc < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: File open Error %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* device_close
+*
+* Parameters:
+*   keep:       TRUE when handed over to the next server
+*
+* Returns: None
+*/
+static void device_close(int keep) {
+    close(storage_desc);
+    storage_desc = -1;
+    if (!keep) {
+        remove(STORAGE_DEVICE_PATH);
+    }
+}
+
+/*
+* device_append
+* The char device does its own locking.
+*
+* Parameters:
+*   iov:        Packets, modified while writing
+*   count:      Number of entries in iov
+*
+* Returns: 0 for success, -1 on error
+*/
+static int device_append(struct iovec *iov, int count) {
+    return aesdsoc_storage_writev(storage_desc, iov, count);
+}
+
+/*
+* device_size
+*
+* Parameters: None
+*
+* Returns: -1, the char device hands out complete packets by itself
+*/
+static off_t device_size(void) {
+    return -1;
+}
+
+/*
+* device_seek
+* Runs AESDCHAR_IOCSEEKTO on a private descriptor of the char device, so
+* that the resulting position cannot be moved by other clients.
+*
+* Parameters:
+*   word:       Write command index
+*   offset:     Byte offset within the write command
+*   pos:        Returns the storage offset
+*
+* Returns: 0 for success, -1 if the seek failed
+*/
+static int device_seek(uint32_t word, uint32_t offset, off_t *pos) {
+    struct aesd_seekto seekto;
+    int fd = open(STORAGE_DEVICE_PATH, O_RDONLY | O_CLOEXEC);
+    int rc = -1;
+
+    if (fd < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: open %s failed %s", STORAGE_DEVICE_PATH,
+            strerror(errno));
+        return -1;
+    }
+    seekto.write_cmd = word;
+    seekto.write_cmd_offset = offset;
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: AESDCHAR_IOCSEEKTO failed %s", strerror(errno));
+    }
+    else {
+        *pos = lseek(fd, 0, SEEK_CUR);
+        rc = (*pos < 0) ? -1 : 0;
+    }
+    close(fd);
+    return rc;
+}
+
+/*
+* device_flush
+*
+* Parameters: None
+*
+* Returns: 0, the char device keeps the data in memory
+*/
+static int device_flush(void) {
+    return 0;
+}
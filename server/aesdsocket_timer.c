@@ -0,0 +1,235 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_timer.c
+* @brief Timestamp writer of aesdsocket
+*
+* A dedicated thread waits on a timerfd and appends a "timestamp:" line to
+* the data file every TIMER_PERIOD_SEC seconds, through the group commit
+* like any packet. The stamp is written when the timer expires, not when
+* the next client connects, and no signal is involved, so the engines never
+* see EINTR because of it.
+*
+* The formatted wall clock text is cached and only rebuilt when the second
+* changes.
+*
+* Backends keeping the last write commands only, like the char device, get
+* no timestamps.
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+* CREDIT: Consulted timerfd_create(2) man page
+*
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define TIMER_PERIOD_SEC            (10)
+#define TIMER_TEXT_SIZE             (64)
+
+/*******************************************************************************
+ * Prototypes
+*******************************************************************************/
+static void *aesdsoc_timer_thread(void *argument);
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+static pthread_t timer_thread;
+static int timer_fd = -1;
+static int timer_wake_fd = -1;
+static int timer_running = FALSE;
+
+/* Cache of aesdsoc_clock_text(), per thread */
+static __thread time_t clock_cached_sec = -1;
+static __thread char clock_cached_text[TIMER_TEXT_SIZE];
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* aesdsoc_clock_text
+* Formats the wall clock as "%Y-%m-%d %H:%M:%S", once per second.
+*
+* Parameters:
+*   now:        Wall clock time
+*
+* Returns: Text, valid until the next call from the same thread, or NULL
+*          on error
+*/
+const char *aesdsoc_clock_text(time_t now) {
+    struct tm cur_time;
+
+    if (now == clock_cached_sec) {
+        return clock_cached_text;
+    }
+    if (localtime_r(&now, &cur_time) == NULL ||
+        strftime(clock_cached_text, sizeof(clock_cached_text), "%Y-%m-%d %H:%M:%S",
+        &cur_time) == 0) {
+        clock_cached_sec = -1;
+        return NULL;
+    }
+    clock_cached_sec = now;
+    return clock_cached_text;
+}
+
+/*
+* aesdsoc_timer_write
+* Appends one timestamp line to the storage.
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+static int aesdsoc_timer_write(void) {
+    char line[TIMER_TEXT_SIZE + 16];
+    const char *text = aesdsoc_clock_text(time(NULL));
+    int len;
+
+    if (text == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: timestamp formatting failed");
+        return -1;
+    }
+    len = snprintf(line, sizeof(line), "timestamp: %s\n", text);
+    if (aesdsoc_group_commit(line, len)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: timestamp write failed");
+        return -1;
+    }
+    AESDSOC_LOG(LOG_DEBUG, "aesdsocket: wrote timestamp %s", text);
+    return 0;
+}
+
+/*
+* aesdsoc_timer_thread
+* Writes a timestamp at every expiration until aesdsoc_timer_stop().
+*
+* Parameters:
+*   argument:   Unused
+*
+* Returns: argument
+*/
+static void *aesdsoc_timer_thread(void *argument) {
+    struct pollfd pfds[2];
+    uint64_t expirations;
+    int rc;
+
+    pfds[0].fd = timer_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = timer_wake_fd;
+    pfds[1].events = POLLIN;
+    while (exit_aesd_soc == FALSE) {
+        rc = poll(pfds, 2, -1);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: poll failed %s", strerror(errno));
+            break;
+        }
+        if (pfds[1].revents) {
+            break;
+        }
+        /* Missed periods are not written twice */
+        if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            aesdsoc_timer_write();
+        }
+    }
+    return argument;
+}
+
+/*
+* aesdsoc_timer_start
+* Arms the timerfd and starts the timestamp thread. Called after daemon(),
+* threads do not survive the fork.
+*
+* Parameters: None
+*
+* Returns: 0 for success, -1 on error
+*/
+int aesdsoc_timer_start(void) {
+    struct itimerspec period;
+
+    if (!aesdsoc_storage->timestamps) {
+        return 0;
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    timer_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (timer_fd < 0 || timer_wake_fd < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: timer creation failed %s", strerror(errno));
+        goto error;
+    }
+    memset(&period, 0, sizeof(period));
+    period.it_value.tv_sec = TIMER_PERIOD_SEC;
+    period.it_interval.tv_sec = TIMER_PERIOD_SEC;
+    if (timerfd_settime(timer_fd, 0, &period, NULL) < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Unable to set the timer %s", strerror(errno));
+        goto error;
+    }
+    if (aesdsoc_thread_create(&timer_thread, aesdsoc_timer_thread, NULL) != 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: timer thread cannot be started");
+        goto error;
+    }
+    timer_running = TRUE;
+    return 0;
+
+error:
+    if (timer_fd >= 0) {
+        close(timer_fd);
+    }
+    if (timer_wake_fd >= 0) {
+        close(timer_wake_fd);
+    }
+    timer_fd = -1;
+    timer_wake_fd = -1;
+    return -1;
+}
+
+/*
+* aesdsoc_timer_stop
+* Stops the timestamp thread, a write in progress completes first.
+*
+* Parameters: None
+*
+* Returns: None
+*/
+void aesdsoc_timer_stop(void) {
+    uint64_t one = 1;
+
+    if (!timer_running) {
+        return;
+    }
+    timer_running = FALSE;
+    if (write(timer_wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: eventfd write failed %s", strerror(errno));
+    }
+    pthread_join(timer_thread, NULL);
+    close(timer_fd);
+    close(timer_wake_fd);
+    timer_fd = -1;
+    timer_wake_fd = -1;
+}
@@ -0,0 +1,1250 @@
+/*****************************************************************************
+* Copyright (C) 2023
+*
+* Redistribution, modification or use of this software in source or binary
+* forms is permitted as long as the files maintain this copyright. Users are
+* permitted to modify this and use it to learn about the field of embedded
+* software. Sujoy Ray and the University of Colorado are not liable for
+* any misuse of this material.
+*
+*****************************************************************************/
+/**
+* @file aesdsocket_uring.c
+* @brief io_uring based connection engine for aesdsocket
+*
+* A single thread drives one ring:
+*   - one multishot accept on the listening socket
+*   - recv from a group of provided buffers, so no buffer is pinned per client.
+*     The group grows with the clients, one buffer each, and a client whose
+*     recv finds the group empty waits for the next buffer handed back
+*   - once a packet is complete, a linked chain
+*       write(storage) -> read(storage) -> send(client) -> close(client)
+*     is queued, so the whole reply costs one io_uring_enter() call. With a
+*     sync policy the write is followed by a linked fdatasync, or
+*     sync_file_range for "-f async", like the flush of the group commit.
+*
+* Other storage backends, like the char device which returns a single write
+* command per read, get the packet written and the reply read synchronously
+* and only the send -> close part is linked. Backends without a descriptor
+* send from the shared reply snapshot, so clients replying after the same
+* commit do not read the storage again.
+*
+* The ring is set up with the raw system calls so that no extra library is
+* needed on the target. Enable with "make USE_IO_URING=1" and run with
+* "-e uring".
+*
+* @author Sujoy Ray
+* @date February 25, 2023
+* @version 1.0
+* CREDIT: Header credit: University of Colorado coding standard
+* CREDIT: Consulted io_uring(7), io_uring_setup(2) and io_uring_enter(2)
+*
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "queue.h"
+#include "aesdsocket.h"
+
+/*******************************************************************************
+ * Definitions
+*******************************************************************************/
+#define URING_ENTRIES               (256)
+/* Provided buffers are added in chunks, up to the 16 bit buffer ids */
+#define URING_BUF_COUNT             (256)
+#define URING_BUF_CHUNKS            (256)
+#define URING_BUF_GROUP             (0)
+#define URING_MAX_RETRY             (3)
+/* Longest linked chain queued in one go: write, sync, read, send, close */
+#define URING_CHAIN_LEN             (5)
+
+/* Operation tag kept in the low bits of the user_data. A WAKE completion is
+ * the stop event poll without an owner, a cancel request when owned by the
+ * ring and the drain deadline when owned by its timespec. */
+#define URING_OP_WAKE               (0)
+#define URING_OP_ACCEPT             (1)
+#define URING_OP_RECV               (2)
+/* Also the sync linked to the write, which completes after it */
+#define URING_OP_WRITE              (3)
+#define URING_OP_READ               (4)
+#define URING_OP_SEND               (5)
+#define URING_OP_CLOSE              (6)
+#define URING_OP_PROVIDE            (7)
+#define URING_OP_MASK               (7)
+
+typedef struct aesdsoc_uring_client aesdsoc_uring_client_t;
+LIST_HEAD(uring_client_head, aesdsoc_uring_client);
+STAILQ_HEAD(uring_starved_head, aesdsoc_uring_client);
+
+typedef struct aesdsoc_uring {
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned sq_tail_local;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_len;
+    size_t sqes_len;
+    /* Provided receive buffers, URING_BUF_COUNT per chunk */
+    char *bufs[URING_BUF_CHUNKS];
+    int buf_chunks;
+    int client_count;
+    int multishot_accept;
+    int soc_server;
+    int storage_fd;
+    /* The storage is a regular file, written and read by the ring itself */
+    int direct;
+    /* Bytes of storage writes queued but not completed yet */
+    off_t pending_bytes;
+    /* Requests queued and not completed yet, a multishot accept counts once */
+    unsigned outstanding;
+    int accepting;
+    int waking;
+    /* Stopping: no new packets are received, the replies in flight finish */
+    int draining;
+    /* The drain deadline passed, the replies in flight are cancelled */
+    int expired;
+    int deadline_armed;
+    struct __kernel_timespec deadline;
+    struct uring_client_head clients;
+    /* Clients whose recv found no buffer, in arrival order */
+    struct uring_starved_head starved;
+} aesdsoc_uring_t;
+
+struct aesdsoc_uring_client {
+    aesdsoc_conn_t conn;
+    aesdsoc_uring_t *ring;
+    /* Complete packets waiting for the storage write */
+    char *wr_buf;
+    int wr_len;
+    /* Reply, owned until the send completes */
+    char *tx_buf;
+    int tx_len;
+    off_t tx_start;
+    /* tx_buf points into this shared snapshot instead of being owned */
+    aesdsoc_snapshot_t *tx_snapshot;
+    /* tx_buf is a prepared reply, not a storage read */
+    int tx_prepared;
+    /* Memory budget charged for tx_buf */
+    long tx_charged;
+    int inflight;
+    /* A sync is linked to the storage write */
+    int syncing;
+    int retries;
+    int send_cancelled;
+    int receiving;
+    int closing;
+    LIST_ENTRY(aesdsoc_uring_client) entries;
+    STAILQ_ENTRY(aesdsoc_uring_client) starved_entries;
+};
+
+/*******************************************************************************
+ * Prototypes
+*******************************************************************************/
+static int aesdsoc_uring_engine_run(int soc_server);
+
+/*******************************************************************************
+ * Variables
+*******************************************************************************/
+const aesdsoc_engine_t aesdsoc_uring_engine = {
+    .name = "uring",
+    .run  = aesdsoc_uring_engine_run,
+};
+
+/*******************************************************************************
+ * Code
+*******************************************************************************/
+
+/*
+* uring_setup
+* Creates the ring and maps the submission and completion queues.
+*
+* Parameters:
+*   ring:       Ring to set up
+*
+* Returns: 0 for success, -1 on error
+*/
+static int uring_setup(aesdsoc_uring_t *ring) {
+    struct io_uring_params params;
+    size_t sq_len;
+    size_t cq_len;
+    char *ptr;
+
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->ring_fd < 0) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: io_uring_setup failed %s", strerror(errno));
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: kernel io_uring is too old");
+        return -1;
+    }
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_len = (sq_len > cq_len) ? sq_len : cq_len;
+    ring->ring_ptr = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        ring->ring_ptr = NULL;
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: io_uring mmap failed %s", strerror(errno));
+        return -1;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: io_uring mmap failed %s", strerror(errno));
+        return -1;
+    }
+
+    ptr = (char *)ring->ring_ptr;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned *)(ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *)(ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+    ring->sq_tail_local = *ring->sq_tail;
+    return 0;
+}
+
+/*
+* uring_teardown
+*
+* Parameters:
+*   ring:       Ring to release
+*
+* Returns: None
+*/
+static void uring_teardown(aesdsoc_uring_t *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->ring_ptr != NULL) {
+        munmap(ring->ring_ptr, ring->ring_len);
+    }
+    if (ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+    }
+    while (ring->buf_chunks > 0) {
+        free(ring->bufs[--ring->buf_chunks]);
+    }
+}
+
+/*
+* uring_submit
+* Submits the queued entries and optionally waits for completions.
+*
+* Parameters:
+*   ring:       Ring
+*   wait_nr:    Number of completions to wait for
+*
+* Returns: Number of entries submitted, or -1 with errno set
+*/
+static int uring_submit(aesdsoc_uring_t *ring, unsigned wait_nr) {
+    unsigned to_submit;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_tail_local, __ATOMIC_RELEASE);
+    to_submit = ring->sq_tail_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    return syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, wait_nr,
+        (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/*
+* uring_reserve
+* Makes sure that count submission entries can be queued back to back, so a
+* linked chain is never split between two submissions.
+*
+* Parameters:
+*   ring:       Ring
+*   count:      Number of entries needed
+*
+* Returns: 0 for success, -1 if the queue stays full
+*/
+static int uring_reserve(aesdsoc_uring_t *ring, unsigned count) {
+    unsigned used = ring->sq_tail_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_entries - used >= count) {
+        return 0;
+    }
+    if (uring_submit(ring, 0) < 0 && errno != EINTR && errno != EBUSY) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: io_uring_enter failed %s", strerror(errno));
+    }
+    used = ring->sq_tail_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return (ring->sq_entries - used >= count) ? 0 : -1;
+}
+
+/*
+* uring_get_sqe
+* Returns the next free submission entry, cleared and tagged.
+*
+* Parameters:
+*   ring:       Ring
+*   ptr:        Request owner, at least 8 byte aligned, or NULL
+*   op:         URING_OP_* tag
+*
+* Returns: Submission entry or NULL when the queue is full
+*/
+static struct io_uring_sqe *uring_get_sqe(aesdsoc_uring_t *ring, void *ptr, int op) {
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (uring_reserve(ring, 1)) {
+        return NULL;
+    }
+    index = ring->sq_tail_local & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)ptr | op;
+    ring->sq_array[index] = index;
+    ring->sq_tail_local++;
+    ring->outstanding++;
+    return sqe;
+}
+
+/*
+* uring_buf
+*
+* Parameters:
+*   ring:       Ring
+*   bid:        Buffer id
+*
+* Returns: Start of the provided buffer
+*/
+static char *uring_buf(aesdsoc_uring_t *ring, int bid) {
+    return ring->bufs[bid / URING_BUF_COUNT] + (size_t)(bid % URING_BUF_COUNT) * FIXED_RD_BUF_SIZE;
+}
+
+/*
+* uring_provide_buffers
+* Hands receive buffers back to the kernel buffer group.
+*
+* Parameters:
+*   ring:       Ring
+*   bid:        First buffer id
+*   count:      Number of buffers
+*
+* Returns: 0 for success, -1 if the queue is full
+*/
+static int uring_provide_buffers(aesdsoc_uring_t *ring, int bid, int count) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, NULL, URING_OP_PROVIDE);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uint64_t)(uintptr_t)uring_buf(ring, bid);
+    sqe->len = FIXED_RD_BUF_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = URING_BUF_GROUP;
+    return 0;
+}
+
+/*
+* uring_post_accept
+*
+* Parameters:
+*   ring:       Ring
+*
+* Returns: 0 for success, -1 if the queue is full
+*/
+static int uring_post_accept(aesdsoc_uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, NULL, URING_OP_ACCEPT);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->soc_server;
+    if (ring->multishot_accept) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    ring->accepting = 1;
+    return 0;
+}
+
+/*
+* uring_post_wake
+* Polls the acceptor stop event, its completion ends the event loop.
+*
+* Parameters:
+*   ring:       Ring
+*   wake_fd:    Acceptor stop event
+*
+* Returns: 0 for success, -1 if the queue is full
+*/
+static int uring_post_wake(aesdsoc_uring_t *ring, int wake_fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, NULL, URING_OP_WAKE);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wake_fd;
+    sqe->poll32_events = POLLIN;
+    ring->waking = 1;
+    return 0;
+}
+
+/*
+* uring_post_cancel
+*
+* Parameters:
+*   ring:       Ring
+*   user_data:  Tagged user_data of the request to cancel
+*
+* Returns: 0 for success, -1 if the queue is full
+*/
+static int uring_post_cancel(aesdsoc_uring_t *ring, uintptr_t user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, ring, URING_OP_WAKE);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)user_data;
+    return 0;
+}
+
+/*
+* uring_post_recv
+* Waits for the next packet of the client. While the ring drains the client
+* is left idle instead, for the handoff.
+*
+* Parameters:
+*   client:     Client to receive from
+*
+* Returns: 0 for success, -1 if the queue is full
+*/
+static int uring_post_recv(aesdsoc_uring_client_t *client) {
+    struct io_uring_sqe *sqe;
+
+    if (client->ring->draining) {
+        return 0;
+    }
+    sqe = uring_get_sqe(client->ring, client, URING_OP_RECV);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->conn.soc_client;
+    sqe->len = FIXED_RD_BUF_SIZE;
+    /* A longer SOCK_SEQPACKET message is reported, not cut short */
+    sqe->msg_flags = client->conn.message ? MSG_TRUNC : 0;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    client->inflight++;
+    client->receiving = 1;
+    return 0;
+}
+
+/*
+* uring_post_close
+*
+* Parameters:
+*   client:     Client to close
+*
+* Returns: None, the socket is closed synchronously if the queue is full
+*/
+static void uring_post_close(aesdsoc_uring_client_t *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(client->ring, client, URING_OP_CLOSE);
+    client->closing = 1;
+    if (sqe == NULL) {
+        close(client->conn.soc_client);
+        client->conn.soc_client = -1;
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = client->conn.soc_client;
+    client->inflight++;
+}
+
+/*
+* uring_add_buffers
+* Allocates another chunk of receive buffers and hands it to the group.
+*
+* Parameters:
+*   ring:       Ring
+*
+* Returns: 0 for success, -1 at the limit or on error
+*/
+static int uring_add_buffers(aesdsoc_uring_t *ring) {
+    char *chunk;
+
+    if (ring->buf_chunks == URING_BUF_CHUNKS) {
+        return -1;
+    }
+    chunk = (char *)malloc((size_t)URING_BUF_COUNT * FIXED_RD_BUF_SIZE);
+    if (chunk == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+        return -1;
+    }
+    ring->bufs[ring->buf_chunks] = chunk;
+    if (uring_provide_buffers(ring, ring->buf_chunks * URING_BUF_COUNT, URING_BUF_COUNT)) {
+        free(chunk);
+        return -1;
+    }
+    ring->buf_chunks++;
+    return 0;
+}
+
+/*
+* uring_return_buffers
+* Hands received buffers back to the group, and rearms the receive of as many
+* clients that found the group empty.
+*
+* Parameters:
+*   ring:       Ring
+*   bid:        First buffer id, -1 when they are provided already
+*   count:      Number of buffers
+*
+* Returns: None
+*/
+static void uring_return_buffers(aesdsoc_uring_t *ring, int bid, int count) {
+    aesdsoc_uring_client_t *client;
+
+    if (bid >= 0 && uring_provide_buffers(ring, bid, count)) {
+        return;
+    }
+    while (count-- > 0 && (client = STAILQ_FIRST(&ring->starved)) != NULL) {
+        STAILQ_REMOVE_HEAD(&ring->starved, starved_entries);
+        if (uring_post_recv(client)) {
+            uring_post_close(client);
+        }
+    }
+}
+
+/*
+* uring_commit
+* Commit hook of a regular file storage, keeps complete packets until the reply
+* chain is queued. Binary records are written at once, a READ frame of the
+* same receive has to see them.
+*
+* Parameters:
+*   conn:       Connection state
+*   data:       Complete packet
+*   len:        Packet length
+*
+* Returns: 0 for success, -1 on allocation failure
+*/
+static int uring_commit(aesdsoc_conn_t *conn, const char *data, int len) {
+    aesdsoc_uring_client_t *client = (aesdsoc_uring_client_t *)conn->engine_data;
+    char *new_buf;
+
+    if (conn->binary) {
+        return aesdsoc_group_commit(data, len);
+    }
+    new_buf = (char *)realloc(client->wr_buf, client->wr_len + len);
+    if (new_buf == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: realloc failed %s", strerror(errno));
+        return -1;
+    }
+    memcpy(new_buf + client->wr_len, data, len);
+    client->wr_buf = new_buf;
+    client->wr_len += len;
+    return 0;
+}
+
+/*
+* uring_commit_sync
+* Writes the packets uring_commit holds, a seek or metrics command of the same
+* receive has to see them. No write of the client is in flight while its
+* receive is processed.
+*
+* Parameters:
+*   conn:       Connection state
+*
+* Returns: 0 for success, -1 on write failure
+*/
+static int uring_commit_sync(aesdsoc_conn_t *conn) {
+    aesdsoc_uring_client_t *client = (aesdsoc_uring_client_t *)conn->engine_data;
+    int rc;
+
+    if (client->wr_len == 0) {
+        return 0;
+    }
+    rc = aesdsoc_group_commit(client->wr_buf, client->wr_len);
+    free(client->wr_buf);
+    client->wr_buf = NULL;
+    client->wr_len = 0;
+    return rc;
+}
+
+/*
+* uring_tx_release
+* Drops the reply of the last send.
+*
+* Parameters:
+*   client:     Client
+*
+* Returns: None
+*/
+static void uring_tx_release(aesdsoc_uring_client_t *client) {
+    if (client->tx_snapshot != NULL) {
+        aesdsoc_snapshot_put(client->tx_snapshot);
+        client->tx_snapshot = NULL;
+    }
+    else {
+        free(client->tx_buf);
+    }
+    client->tx_buf = NULL;
+    client->tx_len = 0;
+    aesdsoc_mem_uncharge(&client->conn, client->tx_charged);
+    client->tx_charged = 0;
+}
+
+/*
+* uring_post_reply
+* Queues the linked write -> read -> send -> close chain for a client. An
+* incremental or binary client stays open, its next receive is queued once
+* the send completed. A prepared reply, like the metrics text or binary
+* frames, is sent instead of the storage.
+*
+* Parameters:
+*   client:     Client with a complete packet
+*   start:      Storage offset the reply starts from
+*
+* Returns: 0 for success, -1 on error
+*/
+static int uring_post_reply(aesdsoc_uring_client_t *client, off_t start) {
+    aesdsoc_uring_t *ring = client->ring;
+    struct io_uring_sqe *sqe;
+    struct stat st;
+
+    if (uring_reserve(ring, URING_CHAIN_LEN)) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: io_uring submission queue full");
+        return -1;
+    }
+    uring_tx_release(client);
+    client->tx_start = start;
+    client->tx_prepared = (client->conn.reply_len > 0);
+    client->send_cancelled = 0;
+
+    if (client->tx_prepared) {
+        /* Owned by the client until the send completes */
+        client->tx_buf = client->conn.reply_buf;
+        client->tx_len = client->conn.reply_len;
+        client->conn.reply_buf = NULL;
+        client->conn.reply_len = 0;
+        client->tx_charged = client->conn.reply_size;
+        client->conn.reply_size = 0;
+    }
+    else if (!ring->direct && !aesdsoc_storage->sendfile &&
+        (client->tx_snapshot = aesdsoc_snapshot_get(start)) != NULL) {
+        client->tx_buf = client->tx_snapshot->data + (start - client->tx_snapshot->start);
+        client->tx_len = client->tx_snapshot->end - start;
+    }
+    else if (!ring->direct) {
+        client->tx_len = aesdsoc_reply_read(&client->conn, start, &client->tx_buf);
+        if (client->tx_len < 0) {
+            client->tx_len = 0;
+            return -1;
+        }
+        client->tx_charged = client->tx_len;
+    }
+
+    if (ring->direct && client->wr_len > 0) {
+        sqe = uring_get_sqe(ring, client, URING_OP_WRITE);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = ring->storage_fd;
+        sqe->addr = (uint64_t)(uintptr_t)client->wr_buf;
+        sqe->len = client->wr_len;
+        /* Storage is opened with O_APPEND, -1 uses the file position */
+        sqe->off = (uint64_t)-1;
+        sqe->flags = IOSQE_IO_LINK;
+        client->inflight++;
+        ring->pending_bytes += client->wr_len;
+        if (aesdsoc_sync_policy != AESDSOC_SYNC_NONE) {
+            sqe = uring_get_sqe(ring, client, URING_OP_WRITE);
+            sqe->fd = ring->storage_fd;
+            if (aesdsoc_sync_policy == AESDSOC_SYNC_ASYNC) {
+                sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+                sqe->sync_range_flags = SYNC_FILE_RANGE_WRITE;
+            }
+            else {
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            }
+            sqe->flags = IOSQE_IO_LINK;
+            client->inflight++;
+            client->syncing = 1;
+        }
+    }
+    /* The prepared reply is ready, no storage read */
+    if (ring->direct && !client->tx_prepared) {
+        if (fstat(ring->storage_fd, &st) < 0) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: fstat failed %s", strerror(errno));
+            return -1;
+        }
+        /* Writes in flight may land before the own one. Without an own
+         * write, a retry, the file only grows and the read is never short */
+        client->tx_len = st.st_size - start;
+        if (client->wr_len > 0) {
+            client->tx_len += ring->pending_bytes;
+        }
+        if (client->tx_len > 0) {
+            if (aesdsoc_mem_charge(&client->conn, client->tx_len)) {
+                aesdsoc_metric_add(AESDSOC_METRIC_REJECTED, 1);
+                AESDSOC_LOG(LOG_WARNING, "aesdsocket: no memory budget left for a reply");
+                client->tx_len = 0;
+                return -1;
+            }
+            client->tx_charged = client->tx_len;
+            client->tx_buf = (char *)malloc(client->tx_len);
+            if (client->tx_buf == NULL) {
+                AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+                client->tx_len = 0;
+                return -1;
+            }
+            sqe = uring_get_sqe(ring, client, URING_OP_READ);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = ring->storage_fd;
+            sqe->addr = (uint64_t)(uintptr_t)client->tx_buf;
+            sqe->len = client->tx_len;
+            sqe->off = start;
+            sqe->flags = IOSQE_IO_LINK;
+            client->inflight++;
+        }
+    }
+
+    if (client->tx_len > 0) {
+        sqe = uring_get_sqe(ring, client, URING_OP_SEND);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = client->conn.soc_client;
+        sqe->addr = (uint64_t)(uintptr_t)client->tx_buf;
+        sqe->len = client->tx_len;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->flags = aesdsoc_conn_keep_open(&client->conn) ? 0 : IOSQE_IO_LINK;
+        client->inflight++;
+    }
+    else {
+        client->tx_len = 0;
+        if (aesdsoc_conn_keep_open(&client->conn)) {
+            return uring_post_recv(client);
+        }
+    }
+    if (!aesdsoc_conn_keep_open(&client->conn)) {
+        uring_post_close(client);
+    }
+    return 0;
+}
+
+/*
+* uring_handle_send
+* Records the reply and, for an incremental or binary client, waits for
+* its next packet.
+*
+* Parameters:
+*   client:     Client
+*   cqe:        Send completion
+*
+* Returns: None
+*/
+static void uring_handle_send(aesdsoc_uring_client_t *client, struct io_uring_cqe *cqe) {
+    if (cqe->res > 0) {
+        aesdsoc_metric_add(AESDSOC_METRIC_BYTES_OUT, cqe->res);
+    }
+    if (cqe->res == client->tx_len && client->tx_prepared) {
+        client->retries = 0;
+    }
+    else if (cqe->res == client->tx_len) {
+        aesdsoc_reply_done(&client->conn, client->tx_start + client->tx_len);
+        client->retries = 0;
+    }
+    else if (cqe->res == -ECANCELED) {
+        /* Read came up short while another client's write was in flight */
+        client->send_cancelled = 1;
+    }
+    else {
+        aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+        AESDSOC_LOG(LOG_INFO, "aesdsocket: send failed %d", cqe->res);
+    }
+    if (!aesdsoc_conn_keep_open(&client->conn)) {
+        /* The linked close follows */
+        return;
+    }
+    /* A prepared reply cannot be built again */
+    if (client->send_cancelled && !client->tx_prepared && !client->ring->expired &&
+        client->retries < URING_MAX_RETRY) {
+        client->retries++;
+        if (uring_post_reply(client, client->tx_start)) {
+            uring_post_close(client);
+        }
+    }
+    else if (cqe->res != client->tx_len || uring_post_recv(client)) {
+        uring_post_close(client);
+    }
+}
+
+/*
+* uring_client_put
+* Frees the client once its last request completed and it is closed.
+*
+* Parameters:
+*   client:     Client
+*
+* Returns: None
+*/
+static void uring_client_put(aesdsoc_uring_client_t *client) {
+    if (client->inflight > 0 || client->conn.soc_client >= 0) {
+        return;
+    }
+    LIST_REMOVE(client, entries);
+    client->ring->client_count--;
+    /* Uncharged before the connection drops the rest of its charge */
+    uring_tx_release(client);
+    aesdsoc_conn_release(&client->conn);
+    free(client->wr_buf);
+    free(client);
+}
+
+/*
+* uring_client_add
+* Starts serving an accepted client.
+*
+* Parameters:
+*   ring:           Ring
+*   soc_client:     Client socket, closed on error
+*   aesdsoc_addr:   Peer address
+*
+* Returns: None
+*/
+static void uring_client_add(aesdsoc_uring_t *ring, int soc_client,
+    const struct sockaddr_storage *aesdsoc_addr) {
+    aesdsoc_uring_client_t *client;
+
+    if (aesdsoc_accepted(soc_client, aesdsoc_addr)) {
+        close(soc_client);
+        return;
+    }
+    client = (aesdsoc_uring_client_t *)calloc(1, sizeof(aesdsoc_uring_client_t));
+    if (client == NULL) {
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: Malloc failed");
+        close(soc_client);
+        return;
+    }
+    if (aesdsoc_conn_init(&client->conn, soc_client, aesdsoc_addr)) {
+        close(soc_client);
+        free(client);
+        return;
+    }
+    client->ring = ring;
+    client->conn.engine_data = client;
+    /* One receive buffer per client, so that they all can receive at once */
+    ring->client_count++;
+    if (ring->client_count > ring->buf_chunks * URING_BUF_COUNT &&
+        uring_add_buffers(ring) == 0) {
+        uring_return_buffers(ring, -1, URING_BUF_COUNT);
+    }
+    if (ring->direct) {
+        client->conn.commit = uring_commit;
+        client->conn.commit_sync = uring_commit_sync;
+    }
+    LIST_INSERT_HEAD(&ring->clients, client, entries);
+    if (uring_post_recv(client)) {
+        uring_post_close(client);
+        uring_client_put(client);
+    }
+}
+
+/*
+* uring_handle_accept
+*
+* Parameters:
+*   ring:       Ring
+*   cqe:        Accept completion
+*
+* Returns: None
+*/
+static void uring_handle_accept(aesdsoc_uring_t *ring, struct io_uring_cqe *cqe) {
+    struct sockaddr_storage aesdsoc_addr;
+    socklen_t addr_len = sizeof(aesdsoc_addr);
+    int soc_client = cqe->res;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        ring->accepting = 0;
+        if (soc_client == -EINVAL && ring->multishot_accept) {
+            AESDSOC_LOG(LOG_INFO, "aesdsocket: multishot accept not supported");
+            ring->multishot_accept = 0;
+        }
+        if (!ring->draining) {
+            uring_post_accept(ring);
+        }
+    }
+    if (soc_client < 0) {
+        if (soc_client != -EINVAL && soc_client != -ECANCELED) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: accept failed %s", strerror(-soc_client));
+        }
+        return;
+    }
+
+    memset(&aesdsoc_addr, 0, sizeof(aesdsoc_addr));
+    getpeername(soc_client, (struct sockaddr *)&aesdsoc_addr, &addr_len);
+    if (ring->draining) {
+        /* Accepted while the cancel was on its way, not served yet */
+        aesdsoc_handoff_client(soc_client, &aesdsoc_addr, NULL);
+        close(soc_client);
+        return;
+    }
+    uring_client_add(ring, soc_client, &aesdsoc_addr);
+}
+
+/*
+* uring_handle_recv
+*
+* Parameters:
+*   client:     Client
+*   cqe:        Receive completion
+*
+* Returns: None
+*/
+static void uring_handle_recv(aesdsoc_uring_client_t *client, struct io_uring_cqe *cqe) {
+    aesdsoc_uring_t *ring = client->ring;
+    int bid;
+    int rc;
+
+    if (cqe->res == -ECANCELED && ring->draining) {
+        /* Idle, kept for the handoff */
+        return;
+    }
+    if (cqe->res == -ENOBUFS) {
+        /* Every buffer holds a packet of another client, not processed yet */
+        STAILQ_INSERT_TAIL(&ring->starved, client, starved_entries);
+        return;
+    }
+    if (cqe->res <= 0) {
+        if (cqe->res < 0) {
+            aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+            AESDSOC_LOG(LOG_INFO, "aesdsocket: recv returned error %s", strerror(-cqe->res));
+        }
+        uring_post_close(client);
+        return;
+    }
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > FIXED_RD_BUF_SIZE) {
+        aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+        AESDSOC_LOG(LOG_ERR, "aesdsocket: message of %d bytes above %d", cqe->res,
+            FIXED_RD_BUF_SIZE);
+        uring_post_close(client);
+        uring_return_buffers(ring, bid, 1);
+        return;
+    }
+    rc = aesdsoc_conn_process(&client->conn, uring_buf(ring, bid), cqe->res);
+    if (rc < 0) {
+        uring_post_close(client);
+    }
+    else if (rc == 0) {
+        if (uring_post_recv(client)) {
+            uring_post_close(client);
+        }
+    }
+    else if (uring_post_reply(client, aesdsoc_reply_start(&client->conn))) {
+        uring_post_close(client);
+    }
+    /* After the chain, so that the provide request is not linked into it */
+    uring_return_buffers(ring, bid, 1);
+}
+
+/*
+* uring_handle_client
+* Dispatches a completion of a client request.
+*
+* Parameters:
+*   client:     Client
+*   op:         URING_OP_* tag
+*   cqe:        Completion
+*
+* Returns: None
+*/
+static void uring_handle_client(aesdsoc_uring_client_t *client, int op,
+    struct io_uring_cqe *cqe) {
+
+    client->inflight--;
+    switch (op) {
+    case URING_OP_RECV:
+        client->receiving = 0;
+        uring_handle_recv(client, cqe);
+        break;
+    case URING_OP_WRITE:
+        if (client->wr_buf == NULL && client->syncing) {
+            /* The write completed first, cancelled if it failed */
+            client->syncing = 0;
+            if (cqe->res < 0 && cqe->res != -ECANCELED) {
+                aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+                AESDSOC_LOG(LOG_ERR, "aesdsocket: storage sync failed %s",
+                    strerror(-cqe->res));
+            }
+            break;
+        }
+        client->ring->pending_bytes -= client->wr_len;
+        if (cqe->res != client->wr_len) {
+            aesdsoc_metric_add(AESDSOC_METRIC_ERRORS, 1);
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: storage write failed %d", cqe->res);
+        }
+        free(client->wr_buf);
+        client->wr_buf = NULL;
+        client->wr_len = 0;
+        break;
+    case URING_OP_READ:
+        break;
+    case URING_OP_SEND:
+        uring_handle_send(client, cqe);
+        break;
+    case URING_OP_CLOSE:
+        if (cqe->res == -ECANCELED && client->send_cancelled && !client->tx_prepared &&
+            !client->ring->expired && client->retries < URING_MAX_RETRY) {
+            client->retries++;
+            if (uring_post_reply(client, client->tx_start) == 0) {
+                break;
+            }
+        }
+        if (cqe->res < 0) {
+            close(client->conn.soc_client);
+        }
+        client->conn.soc_client = -1;
+        break;
+    default:
+        break;
+    }
+    uring_client_put(client);
+}
+
+/*
+* uring_reap
+* Dispatches the available completions.
+*
+* Parameters:
+*   ring:       Ring
+*
+* Returns: None
+*/
+static void uring_reap(aesdsoc_uring_t *ring) {
+    struct io_uring_cqe *cqe;
+    uintptr_t user_data;
+    unsigned head = *ring->cq_head;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        user_data = (uintptr_t)cqe->user_data;
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            ring->outstanding--;
+        }
+        switch (user_data & URING_OP_MASK) {
+        case URING_OP_WAKE:
+            /* Exit or handoff, exit_aesd_soc is checked by the loop */
+            if (user_data == (uintptr_t)URING_OP_WAKE) {
+                ring->waking = 0;
+            }
+            else if (user_data == (uintptr_t)&ring->deadline) {
+                ring->deadline_armed = 0;
+                ring->expired = (cqe->res == -ETIME);
+            }
+            break;
+        case URING_OP_ACCEPT:
+            uring_handle_accept(ring, cqe);
+            break;
+        case URING_OP_PROVIDE:
+            if (cqe->res < 0) {
+                AESDSOC_LOG(LOG_ERR, "aesdsocket: provide buffers failed %s",
+                    strerror(-cqe->res));
+            }
+            break;
+        default:
+            uring_handle_client((aesdsoc_uring_client_t *)(user_data & ~(uintptr_t)URING_OP_MASK),
+                user_data & URING_OP_MASK, cqe);
+            break;
+        }
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+* uring_cancel_client
+*
+* Parameters:
+*   client:     Client
+*   expired:    Cancel the reply chain as well, not only the receive
+*
+* Returns: None
+*/
+static void uring_cancel_client(aesdsoc_uring_client_t *client, int expired) {
+    if (client->receiving) {
+        uring_post_cancel(client->ring, (uintptr_t)client | URING_OP_RECV);
+    }
+    if (expired && client->inflight > 0) {
+        uring_post_cancel(client->ring, (uintptr_t)client | URING_OP_READ);
+        uring_post_cancel(client->ring, (uintptr_t)client | URING_OP_SEND);
+    }
+}
+
+/*
+* uring_drain
+* Stops the ring before it is freed. The accept and the idle receives are
+* cancelled, a receive that completed with data first is processed and the
+* replies in flight finish, or are cancelled after AESDSOC_DRAIN_MS. Every
+* request is reaped, the kernel no longer touches the buffers on return.
+*
+* Parameters:
+*   ring:       Ring
+*
+* Returns: None
+*/
+static void uring_drain(aesdsoc_uring_t *ring) {
+    aesdsoc_uring_client_t *client;
+    struct io_uring_sqe *sqe;
+    int expired = FALSE;
+    int removing = FALSE;
+
+    ring->draining = 1;
+    if (ring->accepting) {
+        uring_post_cancel(ring, (uintptr_t)URING_OP_ACCEPT);
+    }
+    if (ring->waking) {
+        uring_post_cancel(ring, (uintptr_t)URING_OP_WAKE);
+    }
+    LIST_FOREACH(client, &ring->clients, entries) {
+        uring_cancel_client(client, FALSE);
+    }
+    ring->deadline.tv_sec = AESDSOC_DRAIN_MS / 1000;
+    ring->deadline.tv_nsec = (AESDSOC_DRAIN_MS % 1000) * 1000000L;
+    sqe = uring_get_sqe(ring, &ring->deadline, URING_OP_WAKE);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uint64_t)(uintptr_t)&ring->deadline;
+        sqe->len = 1;
+        ring->deadline_armed = 1;
+    }
+
+    while (ring->outstanding > 0) {
+        if (ring->expired && !expired) {
+            expired = TRUE;
+            AESDSOC_LOG(LOG_WARNING, "aesdsocket: replies still in flight after %d ms",
+                AESDSOC_DRAIN_MS);
+            if (ring->accepting) {
+                uring_post_cancel(ring, (uintptr_t)URING_OP_ACCEPT);
+            }
+            LIST_FOREACH(client, &ring->clients, entries) {
+                uring_cancel_client(client, TRUE);
+            }
+        }
+        else if (ring->deadline_armed && !removing && ring->outstanding == 1) {
+            /* Only the deadline is left */
+            sqe = uring_get_sqe(ring, ring, URING_OP_WAKE);
+            if (sqe != NULL) {
+                sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+                sqe->addr = (uint64_t)(uintptr_t)&ring->deadline | URING_OP_WAKE;
+                removing = TRUE;
+            }
+        }
+        if (uring_submit(ring, 1) < 0 && errno != EINTR && errno != EBUSY &&
+            errno != EAGAIN) {
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: io_uring_enter failed %s", strerror(errno));
+            break;
+        }
+        uring_reap(ring);
+    }
+}
+
+/*
+* io_uring engine event loop
+*
+* Parameters:
+*   soc_server: Listening socket
+*
+* Returns: 0 on exit request, otherwise error code
+*/
+static int aesdsoc_uring_engine_run(int soc_server) {
+    aesdsoc_uring_t ring;
+    aesdsoc_uring_client_t *client;
+    struct sockaddr_storage aesdsoc_addr;
+    int wake_fd = aesdsoc_stop_fd();
+    int soc_client;
+    int rc = 0;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.ring_fd = -1;
+    ring.soc_server = soc_server;
+    ring.storage_fd = aesdsoc_storage->fd();
+    ring.direct = aesdsoc_storage->regular_file && ring.storage_fd >= 0;
+    if (ring.direct) {
+        /* The write command index no longer sees every packet */
+        aesdsoc_index_external();
+    }
+    ring.multishot_accept = 1;
+    LIST_INIT(&ring.clients);
+    STAILQ_INIT(&ring.starved);
+    if (uring_setup(&ring)) {
+        rc = -1;
+        goto cleanup;
+    }
+    if (uring_add_buffers(&ring)) {
+        rc = -1;
+        goto cleanup;
+    }
+    uring_post_accept(&ring);
+    if (wake_fd >= 0) {
+        uring_post_wake(&ring, wake_fd);
+    }
+    /* Clients taken over from the previous server */
+    while ((soc_client = aesdsoc_handoff_take(&aesdsoc_addr)) >= 0) {
+        uring_client_add(&ring, soc_client, &aesdsoc_addr);
+    }
+
+    AESDSOC_LOG(LOG_INFO,"**** AESDSOCKET application: Staring io_uring mode ****");
+    while (exit_aesd_soc == FALSE) {
+        if (uring_submit(&ring, 1) < 0) {
+            if (errno == EINTR || errno == EBUSY || errno == EAGAIN) {
+                continue;
+            }
+            AESDSOC_LOG(LOG_ERR, "aesdsocket: io_uring_enter failed %s", strerror(errno));
+            rc = -1;
+            break;
+        }
+        uring_reap(&ring);
+    }
+
+cleanup:
+    if (ring.ring_fd >= 0) {
+        uring_drain(&ring);
+    }
+    uring_teardown(&ring);
+    while (!LIST_EMPTY(&ring.clients)) {
+        client = LIST_FIRST(&ring.clients);
+        LIST_REMOVE(client, entries);
+        /* Idle clients, between two packets, after the drain */
+        if (client->inflight == 0 && !client->closing && client->wr_buf == NULL) {
+            aesdsoc_handoff_client(client->conn.soc_client, &client->conn.aesdsoc_addr,
+                &client->conn);
+        }
+        uring_tx_release(client);
+        aesdsoc_conn_release(&client->conn);
+        free(client->wr_buf);
+        free(client);
+    }
+    return rc;
+}